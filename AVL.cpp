@@ -11,12 +11,14 @@
 
 #include "AVL.h"
 
-static void Destroy(AVLTreeNode *node);
+static AVLTreeNode *AllocNode(AVLTreeData *data);
+static void RecycleNode(AVLTreeData *data, AVLTreeNode *node);
 static void *Insert(AVLTreeData *data, AVLTreeNode **node,
    const void *key, void *value);
 static void *Remove(AVLTreeData *data, AVLTreeNode **node, const void *key);
 static AVLTreeNode *RemoveLeftMost(AVLTreeNode **node);
 static AVLTreeNode *RemoveRightMost(AVLTreeNode **node);
+static void MoveNodeData(AVLTreeNode *dst, const AVLTreeNode *src);
 static void Traverse(const AVLTreeNode *node,
    void (*func)(const void *key, const void *value, const void *data, void *isDirty));
 static void Balance(AVLTreeNode **node);
@@ -41,6 +43,9 @@ AVLTree *CreateAVL(AVLComparator comparator) {
    tree->root = NULL;
    tree->comparator = comparator;
    tree->size = 0;
+   tree->slabUsed = 0;
+   tree->slabs = NULL;
+   tree->freeNodes = NULL;
 
    return (AVLTree*)tree;
 
@@ -50,25 +55,44 @@ AVLTree *CreateAVL(AVLComparator comparator) {
 void DestroyAVL(AVLTree *tree) {
 
    AVLTreeData *data = (AVLTreeData*)tree;
+   AVLSlab *slab, *next;
 
-   Destroy(data->root);
+   for(slab = data->slabs; slab; slab = next) {
+      next = slab->next;
+      ptfree(slab);
+   }
    ptfree(data);
 #ifndef NDEBUG
    printf("AVLTree destroyed\n");
 #endif
 }
 
-/* Helper method for destroying an AVL tree. */
-void Destroy(AVLTreeNode *node) {
-
-   if(node) {
+/* Helper method for allocating a node from the slabs of the tree. */
+AVLTreeNode *AllocNode(AVLTreeData *data) {
 
-      Destroy(node->left);
-      Destroy(node->right);
+   AVLTreeNode *np = data->freeNodes;
+   AVLSlab *slab;
 
-      ptfree(node);
+   if(np) {
+      data->freeNodes = np->left;
+      return np;
+   }
 
+   if(!data->slabs || data->slabUsed == AVL_SLAB_NODES) {
+      slab = (AVLSlab*)ptmalloc(sizeof(AVLSlab));
+      slab->next = data->slabs;
+      data->slabs = slab;
+      data->slabUsed = 0;
    }
+   return &data->slabs->nodes[data->slabUsed++];
+
+}
+
+/* Helper method for giving a removed node back to the tree. */
+void RecycleNode(AVLTreeData *data, AVLTreeNode *node) {
+
+   node->left = data->freeNodes;
+   data->freeNodes = node;
 
 }
 
@@ -94,15 +118,14 @@ void *Insert(AVLTreeData *data, AVLTreeNode **node,
 
    /* If this is an empty tree, just set the root and return. */
    if(!*node) {
-      *node = (AVLTreeNode*)ptmalloc(sizeof(AVLTreeNode));
+      *node = AllocNode(data);
       (*node)->key = key;
       (*node)->value = value;
       (*node)->left = NULL;
       (*node)->right = NULL;
       (*node)->height = 1;
-	  (*node)->creator = GetBacktrace();
-	  GetCallStack((*node)->callStack, MAX_STACK_DEPTH);
-      (*node)->dirty = 0;
+      (*node)->stackId = InternCallStack();
+      (*node)->policy = 0;
 
       ++data->size;
       return NULL;
@@ -115,7 +138,7 @@ void *Insert(AVLTreeData *data, AVLTreeNode **node,
          Balance(node);
          return result;
       } else {
-         (*node)->left = (AVLTreeNode*)ptmalloc(sizeof(AVLTreeNode));
+         (*node)->left = AllocNode(data);
          np = (*node)->left;
       }
    } else if(rc > 0) {
@@ -124,7 +147,7 @@ void *Insert(AVLTreeData *data, AVLTreeNode **node,
          Balance(node);
          return result;
       } else {
-         (*node)->right = (AVLTreeNode*)ptmalloc(sizeof(AVLTreeNode));
+         (*node)->right = AllocNode(data);
          np = (*node)->right;
       }
    } else {
@@ -139,8 +162,8 @@ void *Insert(AVLTreeData *data, AVLTreeNode **node,
    np->left = NULL;
    np->right = NULL;
    np->height = 1;
-   np->creator = GetBacktrace();
-   GetCallStack(np->callStack, MAX_STACK_DEPTH);
+   np->stackId = InternCallStack();
+   np->policy = 0;
    ++data->size;
 
    if(   ((*node)->right && !(*node)->left)
@@ -213,9 +236,8 @@ void *Remove(AVLTreeData *data, AVLTreeNode **node, const void *key) {
 		   np = RemoveLeftMost(&(*node)->right);
 
 		   /* Move the data in np to this node and remove it. */
-		   (*node)->key = np->key;
-		   (*node)->value = np->value;
-		   ptfree(np);
+		   MoveNodeData(*node, np);
+		   RecycleNode(data, np);
 
 		   Balance(node);
 
@@ -226,9 +248,8 @@ void *Remove(AVLTreeData *data, AVLTreeNode **node, const void *key) {
 		   np = RemoveRightMost(&(*node)->left);
 
 		   /* Move the data in np to this node and remove it. */
-		   (*node)->key = np->key;
-		   (*node)->value = np->value;
-		   ptfree(np);
+		   MoveNodeData(*node, np);
+		   RecycleNode(data, np);
 
 		   Balance(node);
 
@@ -237,7 +258,7 @@ void *Remove(AVLTreeData *data, AVLTreeNode **node, const void *key) {
 		   /* This node contains no children.
 			* Just remove the node. */
 
-		   ptfree(*node);
+		   RecycleNode(data, *node);
 		   *node = NULL;
 
 	   }
@@ -249,6 +270,16 @@ void *Remove(AVLTreeData *data, AVLTreeNode **node, const void *key) {
 
 }
 
+/* Moves key, value and allocation info of a node to another one. */
+void MoveNodeData(AVLTreeNode *dst, const AVLTreeNode *src) {
+
+   dst->key = src->key;
+   dst->value = src->value;
+   dst->stackId = src->stackId;
+   dst->policy = src->policy;
+
+}
+
 /* Remove the left-most node and return it. */
 AVLTreeNode *RemoveLeftMost(AVLTreeNode **node) {
 
@@ -340,6 +371,28 @@ void *FindAVL(const AVLTree *tree, const void *key) {
 
 }
 
+/* Find the node with the smallest key not less than key. */
+void *FindNextAVL(const AVLTree *tree, const void *key) {
+
+	const AVLTreeData *data = (const AVLTreeData*)tree;
+	AVLTreeNode *np, *next = NULL;
+	int rc;
+
+	np = data->root;
+	while(np) {
+		rc = (data->comparator)(key, np->key);
+		if(rc < 0) { /* candidate, look for a smaller one */
+			next = np;
+			np = np->left;
+		} else if (rc > 0) {
+			np = np->right;
+		} else {
+			return np;
+		}
+	}
+	return next;
+}
+
 /* Find if a value is in range of the AVL tree. */
 void *FindRangeAVL(const AVLTree *tree, const void *key) {
 
@@ -381,8 +434,8 @@ void Traverse(const AVLTreeNode *node,
    if(node) {
       Traverse(node->left, func);
 	  // Susmit: previously was passing only the creator address. Now passing the entire callstack.
-	  (func)(node->key, node->value, (void*)(node->callStack), (void *)&(node->dirty));
-	  //      (func)(node->key, node->value, (void*)(node->creator), (void *)&(node->dirty));
+	  // Now passing the node, which has the id of the interned callstack and the merge policy.
+	  (func)(node->key, node->value, (void*)node, NULL);
       Traverse(node->right, func);
    }
 }
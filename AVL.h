@@ -51,7 +51,8 @@ typedef int (*AVLComparator)(const void *key1, const void *key2);
 AVLTree *CreateAVL(AVLComparator comparator);
 
 /*! 
- * @brief Destroy an AVL tree.
+ * @brief Destroy an AVL tree. Frees the slabs of its nodes without walking
+ * the tree.
  * @param tree The AVL tree to destroy.
  */
 void DestroyAVL(AVLTree *tree);
@@ -91,11 +92,20 @@ void *FindAVL(const AVLTree *tree, const void *key);
  */
 void *FindRangeAVL(const AVLTree *tree, const void *key);
 
+/*! 
+ * @brief Find the node with the smallest key not less than key, used for
+ * resuming a traversal from a saved key.
+ * @param tree The AVL tree.
+ * @param key The key.
+ * @return The node (NULL if there is no such node).
+ */
+void *FindNextAVL(const AVLTree *tree, const void *key);
+
 /*! 
  * @brief Traverse each element of the tree.
  * @param tree The AVL tree.
- * @param func The traversal function.
- * @param data A value to be passed to the traversal function.
+ * @param func The traversal function. It gets key, value, the node itself
+ * as data and NULL, written pages are tracked per page by the caller.
  */
 void TraverseAVL(const AVLTree *tree,
    void (*func)(const void *key, const void *value, const void *data, void *isDirty));
@@ -117,38 +127,53 @@ int GetAVLHeight(const AVLTree *tree);
 /*! @brief Maximum depth of call stack stored */
 #define MAX_STACK_DEPTH 20
 
+/*! @brief Call stack of an allocation site, stored once for all regions
+ * allocated from it and referred to by its id */
+typedef struct CallStack {
+   uint64_t hash; /**< hash of creator and frames, 0 if the entry is unused */
+   uintptr_t creator;  /**< address of the code block that allocated the regions */
+   void *frames[MAX_STACK_DEPTH]; /**< call stack when the malloc was called */
+} CallStack;
+
 /*! @brief Structure to represent an AVL tree node. */
 typedef struct AVLTreeNode {
 
    const void *key; /**< used for comparison */
    void *value; /**< stored value */
-   int height; /**< height of the avl tree */
    struct AVLTreeNode *left; /**< left child */
    struct AVLTreeNode *right; /**< right child */
+   int height; /**< height of the avl tree */
 
-   int dirty; /**< indicates if it is modified since last merge */
-   uintptr_t creator;  /**< address of the code block that allocated this block */
-   void *callStack[MAX_STACK_DEPTH]; /**< call stack when the malloc was called */
+   int policy; /**< merge policy from the merge profile, 0 by default */
+   uint32_t stackId; /**< interned call stack of the allocation, 0 without backtraces */
 
 } AVLTreeNode;
 
+/*! @brief Nodes carved from one slab of an AVL tree */
+#define AVL_SLAB_NODES 256
+
+/*! @brief Slab the nodes of an AVL tree are allocated from. Slabs are only
+ * freed with the tree, all at once. */
+typedef struct AVLSlab {
+   struct AVLSlab *next; /**< slab allocated before this one */
+   AVLTreeNode nodes[AVL_SLAB_NODES]; /**< the nodes */
+} AVLSlab;
+
 /*! @brief Data for an AVL tree. */
 typedef struct AVLTreeData {
    AVLTreeNode *root; /**< root of AVL tree */
    AVLComparator comparator; /**< The comparator function */
    int size; /**< size of the avl tree */
+   int slabUsed; /**< nodes carved from the newest slab */
+   AVLSlab *slabs; /**< newest slab, NULL if none */
+   AVLTreeNode *freeNodes; /**< removed nodes linked by left, reused first */
 } AVLTreeData;
 
 
-/*! @brief Returns the creator of the region 
- * @return address outside this library that created this region. 
- */
-extern uintptr_t  	GetBacktrace();
-
-/*! @brief Stores call stack in stack. depth is the maximum size supported 
- * @param stack an array to store the pointers 
- * @depth the length of the array stack 
+/*! @brief Interns the call stack of the allocation being recorded
+ * @return Id of the call stack, 0 if backtraces are disabled,
+ * \c UNKNOWN_STACK_ID if no more call stacks fit in the table
  */
-extern void         GetCallStack(void **stack, int depth);
+extern uint32_t     InternCallStack();
 #endif /* AVL_H */
 
@@ -43,6 +43,43 @@ extern "C" {
 	  * @return size of the region
 	 */
 	size_t 	ShmGetSizeWrapper(void *ptr);
+
+	/*! @brief public interface for mapping a segment of the small object
+	  * allocator in the shared heap, so that its pages can be merged
+	  * @param sz Size of the segment
+	  * @param head Bytes at the start of the segment never merged
+	  * @param tail Bytes at the end of the segment never merged
+	  * @return Address of the segment, MAP_FAILED if mmap failed
+	 */
+	void*	ShmArenaMmapWrapper(size_t sz, size_t head, size_t tail);
+
+	/*! @brief public interface for unmapping (a tail of) a segment mapped
+	  * by ShmArenaMmapWrapper or by mmap
+	  * @param ptr Address of the first page to unmap
+	  * @param sz Size to unmap
+	  * @return Result of munmap
+	 */
+	int 	ShmArenaMunmapWrapper(void *ptr, size_t sz);
+
+	/*! @brief Writes the shared heap of the task to a checkpoint image.
+	  * Called by all tasks of a node while none is merging. Pages shared by
+	  * several tasks go to the node image path.shared.<node> once, written
+	  * by the task of the lowest rank sharing them, where <node> is the
+	  * lowest rank of the node. Zero pages are not stored and private pages
+	  * go to path.<rank>.
+	  * @param path Prefix of the image files
+	  * @return 0 if successful, -1 with errno set otherwise
+	 */
+	int 	ShmCheckpoint(const char *path);
+
+	/*! @brief Restores the shared heap of the task from a checkpoint image.
+	  * The regions must be allocated at the same addresses again, by the
+	  * same ranks on each node. Shared pages are mapped from the slot of the
+	  * first task restoring them, without a merge pass.
+	  * @param path Prefix of the image files
+	  * @return 0 if successful, -1 with errno set otherwise
+	 */
+	int 	ShmRestore(const char *path);
 #ifdef __cplusplus
 }
 #endif
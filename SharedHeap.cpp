@@ -22,7 +22,8 @@
   for the first time or a shared page becomes private. In the threshold based
   merge technique, at the end of SigSegvHandler, \c MergeByTHRESHOLD() routine
   is called with iteratively calls MergeNode2() by traversing the AVL tree. If
-  a AVL tree node is dirty, \c MergeManyPages() routine is called which merges
+  a AVL tree node has pages set in the dirty page bitvector (set by the fault
+  handler), \c MergeManyPages() routine is called which merges
   identical pages from that node. In \c MergeManyPages() many pages are handled
   at once i.e. their permission bits are changed, they are mapped/unmapped
   in-order to reduce overhead. \c FLUSH_OUTSTANDING_MERGES() is used in this
@@ -61,9 +62,11 @@ static int mmapCount = 0;				/**< Used for keeping track of mmap counts and chec
 static int myRank = -1;					/**< Rank of current task */
 static int numProc = 0;					/**< Number of processes in local node */
 static int sharedFileDescr = -1; 		/**< mmapped file used for sharing */
+static int sharedFileSocket = -1; 		/**< Socket passing the memfd shared file to other tasks */
+static bool isSharedMemfd = false; 		/**< Whether the shared file is a memfd, else the POSIX shared file */
+static int useMemfd = 1; 				/**< Create the shared file with memfd_create() if available */
 static int *sharingProcessesInfo = NULL;/**< Bitvectors for indicating sharing status of pages */
 static unsigned long currProcMask = 0x01;/**< Used for faster bitwise ops, created from myRank */
-static unsigned long currProcMaskInverted =(unsigned long)(-1); /**< Used for faster bitwise ops, created from myRank */
 static int notMPIApp = 0;				/**< A stand alone program needs to define corresponding env var */
 /*------------------------ Merge Controller ---------------------------------*/
 static int mergeMetric = THRESHOLD; 	/**< How to perform merge? allocation frequency/threshold/buffer */
@@ -76,8 +79,12 @@ static int bufferPtr = 0; 				/**< Indicates where we should put the dirty page
 /*------------------------ Profile Controller ---------------------------------*/
 
 
-#ifdef ENABLE_PROFILER
 static int profileMode = NONE; 			/**< Whether we are creating profile or using it for a profile based run */
+static ProfSite *profSites = NULL; 		/**< Merge profile table, hashed on site key */
+static uintptr_t eagerRegions[MAX_EAGER_REGIONS]; /**< Start of the live regions with eager policy */
+static int numEagerRegions = 0; 		/**< Number of entries in eagerRegions */
+static CallStack *callStacks = NULL; 	/**< Interned call stacks, hashed on stack hash, only with backtraces */
+#ifdef ENABLE_PROFILER
 static FILE *profFile = NULL; 			/**< Profile file */
 #endif /* ENABLE_PROFILER */
 
@@ -89,7 +96,11 @@ static int enableBacktrace = 0; 		/**< Find the sources of merging regions i.e.
 /*------------------------ Library management core components ---------------------------------*/
 static key_t semKey = 1234;				/**< Key used to create a new semaphore name */
 static char	semName[200]; 				/**< Used for posix semaphore */
-static sem_t *mutex = NULL; 			/**< Semaphore used for coherence */
+static sem_t *mutex = NULL; 			/**< Semaphore used for startup and teardown */
+static SharedLock *sharedLock = NULL; 	/**< Robust lock used for coherence of shared metadata */
+static __thread bool isSharedLockHeld = false; /**< Set while the calling thread holds sharedLock */
+static SlotRange (*taskSlots)[2] = NULL; /**< Slots each task has set sharing bits in, by rank and tier */
+static int *nodeId = NULL; 				/**< 1 + lowest MPI rank of the tasks of the node */
 static AVLTreeData *allocRecord = NULL; /**< Avl tree used to keep track of allocated regions */
 static int *aliveProcs = NULL; 			/**< Number of active processes */
 static int PAGE_SIZE = 4096; 			/**< 4 KB default page */
@@ -112,6 +123,9 @@ static int localPageCount = 0; 			/**< Number of pages for current process */
 
 #ifdef COLLECT_MALLOC_STAT
 static char initializedPagesBV[98304]; 	/**< 3GB, 1 bit per page i.e. 0.75/8 MB*/
+static char dirtyPagesBV[98304]; 		/**< Written since last merge pass, 3GB, 1 bit per page */
+static int lazyTouchStat = 0; 			/**< Map regions writable and find touched pages with mincore() */
+static long lazyPendingPages = 0; 		/**< Pages allocated in lazy mode and not yet seen touched */
 #endif /* COLLECT_MALLOC_STAT */
 static char zeroPagesBV[98304]; 		/**< Is it a zero page, 3GB, 1 bit per page i.e. 0.75/8 MB*/
 
@@ -123,6 +137,10 @@ static uintptr_t sharedHeapTop = 0x7fffffffffff;	/**< (128TB i.e. 0x800000000000
 
 static char *zeroPage = NULL;			/**< Addr of zero page */
 static int zeroPageCount = 0; 			/**< Number of zero pages for current task */
+static int faultAroundMax = 256; 		/**< Max pages unmerged together on sequential write faults */
+static char *pagePool = NULL; 			/**< Pre-faulted private pages for unmerging, used from the top */
+static int pagePoolPages = 0; 			/**< Number of pages left in pagePool */
+static int pagePoolSize = 512; 			/**< Number of pages in a full pagePool, 0 disables it */
 static FILE	*outFile = NULL; 			/**< Output file for storing results */
 
 #ifdef PRINT_STATS
@@ -131,12 +149,7 @@ static int maxBaseCaseTotalPageCount = 0; /**< Total amount of memory used with
 											merge is disabled */
 #endif /* PRINT_STATS */
 
-/*! @brief Profile guided merge: \b disabled*/
-//#define PROFILE_BASED_MERGE
-#define PROF_MERGE_VERSION 2
-
-#ifdef PROFILE_BASED_MERGE
-/* for every page, I need an int for storing the time of last merge and a byte for the history */
+/* for every page, I need the time of last merge or split and a byte for the history */
 /*********************************************************************************
 * Time taken to operate on 1GB of memory:
 * mmap + many mprotects (1/page)	: 2420512.000000 μs 
@@ -156,15 +169,66 @@ static int maxBaseCaseTotalPageCount = 0; /**< Total amount of memory used with
 **********************************************************************************/
 
 
-const static uint32_t mergeCostPerPage = 8000; /*< ~5 us for mmap+mprotect+memcmp+mprotect. ~8ms for merging 1GB */
-static uint8_t *mergeSuccHist = NULL; /**< Stores merge success as a history */
-static uint32_t *lastMergeTime = NULL; /**< Stores the last merge time in
-										 microsec. At the sighandler, the time
+static int mergeOverheadPct = 2; 		/**< Share of run time spent in merging with ADAPTIVE metric */
+static long passScannedPages = 0; 		/**< Pages scanned in current merge pass */
+static long passMergedPages = 0; 		/**< Pages merged in current merge pass */
+static uintptr_t mergeCursor = 0; 		/**< Where the merge pass in progress resumes, 0 if none */
+static int mergeSlicePages = 0; 		/**< Max pages scanned in a slice of merge pass, 0 for no limit */
+static int mergeSliceUsec = 0; 			/**< Max usec spent in a slice of merge pass, 0 for no limit */
+static int mergeThreads = 1; 			/**< Threads classifying pages in a merge pass, including the merging one */
+static int numMergeWorkers = 0; 		/**< Number of started merge threads */
+static pthread_t mergeWorkers[MAX_MERGE_THREADS]; /**< Merge threads */
+static MergeJob mergeJob = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER }; /**< Window given to merge threads */
+static uint8_t pageClass[MAX_MERGE_THREADS * MERGE_CHUNK_PAGES]; /**< \c _PAGE_CLASSES of pages in a window */
+static int mergeDaemon = 0; 			/**< Whether page compares are done by a merge daemon per node */
+static int mergeDaemonCpu = -1; 		/**< CPU the merge daemon is pinned to, -1 for no pinning */
+static pid_t daemonChild = 0; 			/**< Child forked before MPI_Init, the daemon if this task is the first */
+static int daemonSocket = -1; 			/**< Socket passing the shared file to daemonChild */
+static MergeDaemonArea *daemonArea = NULL; /**< Shared area of the merge daemon, NULL if not used */
+static int memPressureTrigger = 0; 		/**< Whether merging follows memory pressure of the cgroup */
+static int pressureLowPct = 50; 		/**< Memory usage in percent of limit below which merging is held back */
+static int pressureHighPct = 90; 		/**< Memory usage in percent of limit above which merging is aggressive */
+static int memCurrentFd = -1; 			/**< memory.current of the cgroup, or /proc/meminfo if no limit */
+static long long memLimit = 0; 			/**< memory.max of the cgroup in bytes, 0 if using /proc/meminfo */
+static int psiFd = -1; 					/**< memory.pressure of the cgroup with a trigger set, -1 if not available */
+static int mpiPhaseMerge = PHASE_OFF; 	/**< How merging is done while waiting in collectives, \c _PHASE_MODES */
+static PhaseSite phaseSites[MAX_PHASE_SITES]; /**< Call sites of collectives */
+static uint64_t collectiveSeq = 0; 		/**< Number of intercepted collectives */
+static PhaseSite *phaseMarker = NULL; 	/**< Call site starting an iteration, NULL until learned */
+static uintptr_t mpiBufStart[MAX_MPI_BUFS]; /**< Buffers of the collective in progress, kept out of merging */
+static uintptr_t mpiBufEnd[MAX_MPI_BUFS]; /**< Ends of the buffers of the collective in progress */
+static int hotBufferMs = 0; 			/**< MPI buffers are not merged until idle for this long, 0 disables */
+static uint32_t *hotTable = NULL; 		/**< Last use of each 64KB block by MPI in msec, 0 if never used */
+static int eagerMergeKb = 0; 			/**< Buffers of Bcast and collective reads at least this large are merged at once, 0 disables */
+static int arenaMerge = 0; 				/**< Whether segments of ptmalloc arenas are mapped in the shared heap */
+static ArenaSeg arenaSegs[MAX_ARENA_SEGS]; /**< Arena segments in the shared heap */
+static int numArenaSlots = 0; 			/**< Slots of arenaSegs used so far, the rest are free */
+static volatile int arenaSegLock = 0; 	/**< Guards arenaSegs, arenas of different threads map segments at once */
+static volatile int arenaSegsChanged = 0; /**< A segment is mapped or unmapped since the last \c SyncArenaSegments() */
+static size_t arenaSegBytes = 0; 		/**< Bytes of arena segments in the shared heap, accounted as pages */
+static __thread int inFaultHandler = 0; 	/**< Merging from the fault handler, when an arena may be locked */
+static int numaPlacement = 0; 			/**< Whether merged pages are placed on the node most of their sharers run on */
+static NumaInfo *numaInfo = NULL; 		/**< NUMA placement state shared by the tasks of the node */
+static uint8_t *slotHome = NULL; 		/**< 1 + node each page of the shared file lives on, 0 if unknown */
+static int myNode = 0; 					/**< NUMA node the current task runs on */
+static bool numaMoveAll = true; 		/**< Whether pages mapped by other tasks can be moved, needs CAP_SYS_NICE */
+static int mergeDomain = DOMAIN_NODE; 	/**< Tasks merge within a socket or L3 group first, see \c _MERGE_DOMAINS */
+static DomainInfo *domainInfo = NULL; 	/**< Merge domains of the node, NULL if all tasks merge in one */
+static int myDomain = 0; 				/**< Merge domain of the current task */
+static off64_t slotFileBase = 0; 		/**< Offset of the slots pages are merged into, node wide while promoting */
+static SharedLock *nodeLock = NULL; 	/**< Guards node wide slots if merge domains are used */
+static char nodeTierBV[98304]; 			/**< Is the page mapped to a node wide slot, 3GB, 1 bit per page */
+static char *nodeView = NULL; 			/**< Node wide slots mapped read only for promotion */
+static char *domainViews[MAX_MERGE_DOMAINS]; /**< Slots of the other domains mapped read only for promotion */
+static void *domainBits[MAX_MERGE_DOMAINS]; /**< Sharing bits of the domains, the own one writable, others read only for promotion */
+static int myDomainRank = 0; 			/**< Order the current task attached to its domain in */
+static unsigned long myDomainMask = 0x01; /**< Bit of the current task in the sharing bits of its domain, from myDomainRank */
+static int mergeStableMs = 1000; 		/**< A merge undone within this time is a failed merge, 0 disables history */
+static uint8_t *mergeSuccHist = NULL; 	/**< Stores merge success as a history, 1 bit per merge, latest at MSB */
+static uint64_t *lastMergeTime = NULL; 	/**< Stores the last merge or split time in
+										 microsec (monotonic). At the sighandler, the time
 										 difference is recorded to decide the
-										 success of merge.  Supports 1hr gap...
-										 good enough */
-											
-#endif /* PROFILE_BASED_MERGE */
+										 success of merge. */
 
 #ifdef MICROTIME_STAT
 static unsigned long mergeTime = 0; /**< Time spent in merge operation */
@@ -219,6 +283,8 @@ inline void UpdateMergeStat(
 	memStat[memStatCounter].totalUnmergedMem	= tum;
 	memStat[memStatCounter].totalMergedMem   	= tmm; 
 	memStat[memStatCounter].mergeTimeinMicrosec = mtm;
+	memStat[memStatCounter].sharedRefs			= (numaInfo? numaInfo->sharedRefs: 0);
+	memStat[memStatCounter].remoteRefs			= (numaInfo? numaInfo->remoteRefs: 0);
 	memStatCounter++;
 }
 
@@ -228,7 +294,7 @@ inline void PrintMergeStat(){
 		return;
 
 	for (int i = 0; i < memStatCounter; i++) {
-		fprintf(outFile, "P: %16lu; L: %16lu; Z: %16lu; S: %16lu; U: %16lu; M: %16lu\n",
+		fprintf(outFile, "P: %16lu; L: %16lu; Z: %16lu; S: %16lu; U: %16lu; M: %16lu",
 				memStat[i].totalPrivateMem,
 				memStat[i].totalPtmallocMem,
 				memStat[i].totalZeroMem,
@@ -236,6 +302,13 @@ inline void PrintMergeStat(){
 				memStat[i].totalUnmergedMem,
 				memStat[i].totalMergedMem
 			   );
+		if(numaPlacement) /* mappings of shared pages on a remote node, of all */
+			fprintf(outFile, "; R: %16lu; T: %16lu (%.2f%% remote)",
+					memStat[i].remoteRefs,
+					memStat[i].sharedRefs,
+					(memStat[i].sharedRefs? 100.0 * memStat[i].remoteRefs / memStat[i].sharedRefs: 0.0)
+				   );
+		fprintf(outFile, "\n");
 	}
 }
 
@@ -246,22 +319,24 @@ void StoreMemUsageStat(){
 #ifdef PRINT_STATS
 	if(!outFile)
 		return;
-	unsigned long private_mem 			= ptmalloc_get_mem_usage();
+	unsigned long private_mem 			= ptmalloc_get_mem_usage() - arenaSegBytes; /* those are counted as pages */
 
 	unsigned long total_private_mem 	= (long unsigned)private_mem * (*aliveProcs) 
-											+ (long unsigned)(*allProcPrivatePageCount) * PAGE_SIZE ;
+											+ (long unsigned)NodeTotal(allProcPrivatePageCount) * PAGE_SIZE ;
 	unsigned long total_ptmalloc_mem	= (long unsigned)private_mem * (*aliveProcs);
 	unsigned long total_zero_mem 		= (long unsigned)zeroPageCount * PAGE_SIZE;
+	unsigned long total_pool_mem 		= (long unsigned)pagePoolPages * PAGE_SIZE * (*aliveProcs); /* pre-faulted, not in the base case */
+	total_private_mem 					+= total_pool_mem;
 #ifdef SHARED_STATS
-	unsigned long total_shared_mem		= (long unsigned)(*sharedPageCount) * PAGE_SIZE;
+	unsigned long total_shared_mem		= (long unsigned)NodeTotal(sharedPageCount) * PAGE_SIZE;
 	unsigned long total_unmerged_mem 	= (long unsigned)private_mem * (*aliveProcs) 
-											+ (long unsigned)(*baseCaseTotalPageCount) * PAGE_SIZE;
-	unsigned long total_merged_mem 		= (long unsigned)private_mem * (*aliveProcs) 
-											+ (long unsigned)(*allProcPrivatePageCount + *sharedPageCount) * PAGE_SIZE;
+											+ (long unsigned)NodeTotal(baseCaseTotalPageCount) * PAGE_SIZE;
+	unsigned long total_merged_mem 		= (long unsigned)private_mem * (*aliveProcs) + total_pool_mem
+											+ (long unsigned)(NodeTotal(allProcPrivatePageCount) + NodeTotal(sharedPageCount)) * PAGE_SIZE;
 #else
 	unsigned long total_shared_mem		= 0;
 	unsigned long total_unmerged_mem 	= (long unsigned)private_mem * (*aliveProcs);
-	unsigned long total_merged_mem 		= (long unsigned)private_mem * (*aliveProcs); 
+	unsigned long total_merged_mem 		= (long unsigned)private_mem * (*aliveProcs) + total_pool_mem; 
 #endif /* !SHARED_STATS */
 	UpdateMergeStat(total_private_mem, total_ptmalloc_mem, total_zero_mem, 
 			total_shared_mem, total_unmerged_mem, total_merged_mem, 0);
@@ -315,8 +390,10 @@ int MPI_Init(int *argc, char ***argv){
 		Init_Heap_Boundary();
 #endif /* __x86_64__ */
 
+	ForkMergeDaemon(); /* before MPI registers memory */
 	int ret_val = PMPI_Init(argc, argv);
 	InitAddrSpace(); /* set flag here */
+	RecordNodeId();
 
 	char out_filename[200]; /* output file */
 	char hostname[100];
@@ -359,6 +436,10 @@ int MPI_Finalize(){
 	int ret_val = 0;
 
 	isMPIFinalized = true;
+	if(profileMode == CREATE_PROF){ /* regions still allocated count too */
+		TraverseAVL((AVLTree* )allocRecord, RecordProfNode);
+		WriteMergeProfile();
+	}
 #ifdef PRINT_STATS
 	if(outFile){
 		PrintMergeStat();
@@ -371,11 +452,26 @@ int MPI_Finalize(){
 #ifdef PRINT_STATS
 	if(!myRank)
 		fprintf(stderr, "Max Mem Usage Per Node: %ld\n", (maxBaseCaseTotalPageCount) * (long)PAGE_SIZE);
+	if(!myRank && numaInfo)
+		fprintf(stderr, "Remote Shared Page Mappings: %ld of %ld, Migrated Pages: %ld\n", 
+				numaInfo->remoteRefs, numaInfo->sharedRefs, numaInfo->migratedPages);
+	if(!myRank && domainInfo)
+		fprintf(stderr, "Merge Domains: %d, Pages Promoted to Node Wide Slots: %ld\n", 
+				domainInfo->numDomains, domainInfo->promotedPages);
 #endif /* PRINT_STATS */
 	errno = saved_errno;
 	return ret_val;
 }
 
+/* Returns the sharing bits per slot needed by num_tasks tasks, at most
+ * MAX_NODE_TASKS */
+int SharingBitsWidth(int num_tasks){
+	if(num_tasks <= 8) 		return 8;
+	if(num_tasks <= 16) 	return 16;
+	if(num_tasks <= 32) 	return 32;
+	return MAX_NODE_TASKS;
+}
+
 /* initializes the library */
 void InitAddrSpace(){
 	int saved_errno = errno;
@@ -415,9 +511,9 @@ void InitAddrSpace(){
 	errno = 0;
 	numProc = sysconf( _SC_NPROCESSORS_ONLN );
 
-	if(numProc <= 8) 		numProc = 8;
-	else if(numProc <= 16) 	numProc = 16;
-	else die("error: More number of cores than supported, rebuild library and link again ... exiting\n");
+	/* bits per slot of the sharing bits, at most MAX_NODE_TASKS tasks are
+	 * checked when they attach */
+	numProc = SharingBitsWidth(numProc);
 
 	if(enableBacktrace){
 		/* call to get the memory ranges of loaded library. need to use the addresses in backtrace */
@@ -426,6 +522,11 @@ void InitAddrSpace(){
 		fprintf(stderr, "Library loaded between %p and %p\n", (void *)lowLoadAddr, (void *)highLoadAddr);
 #endif /* PRINT_DEBUG_MSG */
 	}
+	if(enableBacktrace){
+		/* zero filled on first touch, only entries in use take memory */
+		callStacks = (CallStack *) SH_MMAP(NULL, MAX_CALL_STACKS * sizeof(CallStack), PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+		ASSERTX(callStacks != MAP_FAILED);
+	}
 	CheckForError();
 
 	/* create semaphore */
@@ -446,6 +547,10 @@ void InitAddrSpace(){
 	//
 	/* open shared file and map pointers */
 	AllocateSharedMetadata();
+	RefillPagePool();
+	StartMergeThreads();
+	if(memPressureTrigger)
+		InitMemPressure();
 #ifdef PRINT_DEBUG_MSG
 	fprintf(stderr, "shared data allocated\n");
 	fprintf(stderr, "sharedHeapTop: %20p\n", (void*)sharedHeapTop);
@@ -467,13 +572,7 @@ void InitAddrSpace(){
 			fprintf(stderr, "%s opened in profiling mode\n", fileName);
 #endif /* PRINT_DEBUG_MSG */
 			break;
-		case USE_PROF:
-			profFile = fopen(fileName, "r");
-#ifdef PRINT_DEBUG_MSG
-			fprintf(stderr, "%s opened for using profile\n", fileName);
-#endif /* PRINT_DEBUG_MSG */
-			break;
-		default: /* no profiling */
+		default: /* no profiling or merge profile is used */
 #ifdef PRINT_DEBUG_MSG
 			fprintf(stderr, "profiling disabled\n");
 #endif /* PRINT_DEBUG_MSG */
@@ -481,15 +580,22 @@ void InitAddrSpace(){
 	}
 #endif /* ENABLE_PROFILER */
 
+	if(profileMode != NONE)
+		InitMergeProfile();
+
 
-#ifdef PROFILE_BASED_MERGE
-	mergeSuccHist = (uint8_t*)  SH_MMAP(NULL, 0x03 << (30 - log2PAGE_SIZE),     PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0); // 3GB/4KB i.e. 1B per 4KB page
-	lastMergeTime = (uint32_t*) SH_MMAP(NULL, 0x03 << (30 - log2PAGE_SIZE + 2), PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0); // 4B per 4KB page
-	ASSERTX(mergeSuccHist != MAP_FAILED);
-	ASSERTX(lastMergeTime != MAP_FAILED);
-	memset(mergeSuccHist, 0, 0x03 << (30 - log2PAGE_SIZE));
-	memset(lastMergeTime, 0, 0x03 << (30 - log2PAGE_SIZE+2));
-#endif /* PROFILE_BASED_MERGE */
+	if(mergeStableMs > 0){
+		/* zero filled on first touch, only pages of the history in use take memory */
+		mergeSuccHist = (uint8_t*)  SH_MMAP(NULL, 0x03UL << (30 - log2PAGE_SIZE),     PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0); // 3GB/4KB i.e. 1B per 4KB page
+		lastMergeTime = (uint64_t*) SH_MMAP(NULL, 0x03UL << (30 - log2PAGE_SIZE + 3), PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0); // 8B per 4KB page
+		ASSERTX(mergeSuccHist != MAP_FAILED);
+		ASSERTX(lastMergeTime != MAP_FAILED);
+	}
+
+	if(hotBufferMs > 0){
+		hotTable = (uint32_t*) SH_MMAP(NULL, (0x03UL << (30 - HOT_BLOCK_SHIFT)) * sizeof(uint32_t), PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0); // 4B per 64KB
+		ASSERTX(hotTable != MAP_FAILED);
+	}
 
 	/* install SIGSEGV handler */
 	errno = 0;
@@ -519,17 +625,506 @@ void InitAddrSpace(){
 		ASSERTX(sigaction(SIGINT, &act, NULL) == 0);
 	}
 	*/
-#ifdef COLLECT_MALLOC_STAT
-	memset(initializedPagesBV, 0, 98304);
-#endif
-	
-	memset(zeroPagesBV, 0, 98304);
+	/* the page bitmaps are zero filled on first touch, not cleared here */
 	atexit(CleanUpSharedData);
 
 	errno = saved_errno;
 }
 
 
+/*===============================================================================*/
+/*                            Merge in MPI collectives                           */
+/*===============================================================================*/
+/* Whether collectives are posted nonblocking to merge while waiting */
+bool IsPhaseMergeEnabled(){
+	return (mpiPhaseMerge != PHASE_OFF && isMPIInitialized && !isMPIFinalized);
+}
+
+/* Decides whether a collective should merge while waiting */
+bool ShouldMergeInCollective(uintptr_t site){
+	if(!IsPhaseMergeEnabled())
+		return false;
+	if(mpiPhaseMerge == PHASE_EVERY)
+		return IsMergeDue();
+
+	/* learn the period of each call site in number of collectives */
+	collectiveSeq++;
+	PhaseSite *ps = NULL;
+	for(int i = 0; i < MAX_PHASE_SITES; i++){
+		if(phaseSites[i].site == site || phaseSites[i].site == 0){
+			ps = &phaseSites[i];
+			break;
+		}
+	}
+	if(!ps)
+		return false;
+	if(ps->site == 0)
+		ps->site = site;
+	if(ps->lastSeq){
+		uint64_t period = collectiveSeq - ps->lastSeq;
+		if(period == ps->period){
+			ps->stable++;
+		}else{
+			ps->period = period;
+			ps->stable = 0;
+			if(ps == phaseMarker)
+				phaseMarker = NULL; /* iteration changed, learn again */
+		}
+	}
+	ps->lastSeq = collectiveSeq;
+
+	if(ps->stable >= PHASE_STABLE_COUNT && (!phaseMarker || ps->period > phaseMarker->period))
+		phaseMarker = ps;
+	return (ps == phaseMarker);
+}
+
+/* Checks whether a range is used by a collective in progress */
+bool IsMPIBufferBusy(uintptr_t addr, size_t *size, uintptr_t *busy_end){
+	for(int i = 0; i < MAX_MPI_BUFS; i++){
+		if(mpiBufStart[i] == mpiBufEnd[i])
+			continue;
+		if(addr >= mpiBufStart[i] && addr < mpiBufEnd[i]){
+			*busy_end = mpiBufEnd[i];
+			return true;
+		}
+		if(mpiBufStart[i] > addr && mpiBufStart[i] < addr + *size)
+			*size = mpiBufStart[i] - addr;
+	}
+	return false;
+}
+
+/* Runs merge slices while the collective is in progress */
+int WaitAndMerge(MPI_Request *req, uintptr_t site, const void *buf1, size_t len1, const void *buf2, size_t len2){
+	/* decided after posting, the other ranks may decide otherwise */
+	if(!ShouldMergeInCollective(site))
+		return PMPI_Wait(req, MPI_STATUS_IGNORE);
+
+	const void *bufs[MAX_MPI_BUFS] = { buf1, buf2 };
+	size_t lens[MAX_MPI_BUFS] = { len1, len2 };
+	for(int i = 0; i < MAX_MPI_BUFS; i++){
+		if(bufs[i] && bufs[i] != MPI_IN_PLACE && lens[i]){
+			mpiBufStart[i] = ptr2offset(bufs[i]) & ~((uintptr_t)PAGE_SIZE - 1);
+			mpiBufEnd[i] = (ptr2offset(bufs[i]) + lens[i] + PAGE_SIZE - 1) & ~((uintptr_t)PAGE_SIZE - 1);
+		}
+	}
+
+	int flag = 0;
+	int ret_val = PMPI_Test(req, &flag, MPI_STATUS_IGNORE);
+	while(ret_val == MPI_SUCCESS && !flag){
+		if(RunMergePass(MERGE_SLICE_CHUNK, 0)){
+			ret_val = PMPI_Wait(req, MPI_STATUS_IGNORE); /* pass done, nothing left to overlap */
+			break;
+		}
+		ret_val = PMPI_Test(req, &flag, MPI_STATUS_IGNORE);
+	}
+
+	for(int i = 0; i < MAX_MPI_BUFS; i++)
+		mpiBufStart[i] = mpiBufEnd[i] = 0;
+	return ret_val;
+}
+
+/* Length of a buffer of count elements of datatype */
+size_t MPIBufferLength(int count, MPI_Datatype datatype){
+	MPI_Aint lb, extent;
+	if(count <= 0 || PMPI_Type_get_extent(datatype, &lb, &extent) != MPI_SUCCESS)
+		return 0;
+	return (size_t)count * extent;
+}
+
+/* Marks 64KB blocks of a buffer used by MPI as hot */
+void MarkHotBuffer(const void *buf, size_t len){
+	if(!hotTable || !buf || buf == MPI_IN_PLACE || !len)
+		return;
+	uintptr_t start = (uintptr_t)buf;
+	uintptr_t end = start + len;
+#if defined __x86_64__
+	if(end <= sharedHeapBottom + 1 || start >= sharedHeapTop)
+		return; /* not in shared heap */
+	if(start <= sharedHeapBottom)
+		start = sharedHeapBottom + 1;
+	if(end > sharedHeapTop)
+		end = sharedHeapTop;
+#endif /* __x86_64__ */
+
+	uint32_t now = (uint32_t)(GetMonotonicTime() / 1000) | 0x01; /* never 0 */
+	uintptr_t last = TranslateMmapAddr(end - 1) >> HOT_BLOCK_SHIFT;
+	for(uintptr_t block = TranslateMmapAddr(start) >> HOT_BLOCK_SHIFT; block <= last; block++)
+		hotTable[block] = now;
+}
+
+/* Checks whether a page is in a hot MPI buffer */
+bool IsHotPage(void *p, uint64_t curr_time){
+	uint32_t last_use = hotTable[TranslateMmapAddr((uintptr_t)p) >> HOT_BLOCK_SHIFT];
+	return (last_use && (uint32_t)(curr_time / 1000) - last_use < (uint32_t)hotBufferMs);
+}
+
+/* Replaces MPI_Send() */
+int MPI_Send(const void *buf, int count, MPI_Datatype datatype, int dest, int tag, MPI_Comm comm){
+	if(hotTable)
+		MarkHotBuffer(buf, MPIBufferLength(count, datatype));
+	return PMPI_Send(buf, count, datatype, dest, tag, comm);
+}
+
+/* Replaces MPI_Recv() */
+int MPI_Recv(void *buf, int count, MPI_Datatype datatype, int source, int tag, MPI_Comm comm, MPI_Status *status){
+	if(hotTable)
+		MarkHotBuffer(buf, MPIBufferLength(count, datatype));
+	return PMPI_Recv(buf, count, datatype, source, tag, comm, status);
+}
+
+/* Replaces MPI_Isend() */
+int MPI_Isend(const void *buf, int count, MPI_Datatype datatype, int dest, int tag, MPI_Comm comm, MPI_Request *request){
+	if(hotTable)
+		MarkHotBuffer(buf, MPIBufferLength(count, datatype));
+	return PMPI_Isend(buf, count, datatype, dest, tag, comm, request);
+}
+
+/* Replaces MPI_Irecv() */
+int MPI_Irecv(void *buf, int count, MPI_Datatype datatype, int source, int tag, MPI_Comm comm, MPI_Request *request){
+	if(hotTable)
+		MarkHotBuffer(buf, MPIBufferLength(count, datatype));
+	return PMPI_Irecv(buf, count, datatype, source, tag, comm, request);
+}
+
+/* Replaces MPI_Sendrecv() */
+int MPI_Sendrecv(const void *sendbuf, int sendcount, MPI_Datatype sendtype, int dest, int sendtag,
+		void *recvbuf, int recvcount, MPI_Datatype recvtype, int source, int recvtag, MPI_Comm comm, MPI_Status *status){
+	if(hotTable){
+		MarkHotBuffer(sendbuf, MPIBufferLength(sendcount, sendtype));
+		MarkHotBuffer(recvbuf, MPIBufferLength(recvcount, recvtype));
+	}
+	return PMPI_Sendrecv(sendbuf, sendcount, sendtype, dest, sendtag,
+			recvbuf, recvcount, recvtype, source, recvtag, comm, status);
+}
+
+/* Replaces MPI_Allgather() */
+int MPI_Allgather(const void *sendbuf, int sendcount, MPI_Datatype sendtype,
+		void *recvbuf, int recvcount, MPI_Datatype recvtype, MPI_Comm comm){
+	if(hotTable){
+		int comm_size = 1;
+		PMPI_Comm_size(comm, &comm_size);
+		MarkHotBuffer(sendbuf, MPIBufferLength(sendcount, sendtype));
+		MarkHotBuffer(recvbuf, MPIBufferLength(recvcount, recvtype) * comm_size);
+	}
+	return PMPI_Allgather(sendbuf, sendcount, sendtype, recvbuf, recvcount, recvtype, comm);
+}
+
+/* Replaces MPI_Alltoall() */
+int MPI_Alltoall(const void *sendbuf, int sendcount, MPI_Datatype sendtype,
+		void *recvbuf, int recvcount, MPI_Datatype recvtype, MPI_Comm comm){
+	if(hotTable){
+		int comm_size = 1;
+		PMPI_Comm_size(comm, &comm_size);
+		MarkHotBuffer(sendbuf, MPIBufferLength(sendcount, sendtype) * comm_size);
+		MarkHotBuffer(recvbuf, MPIBufferLength(recvcount, recvtype) * comm_size);
+	}
+	return PMPI_Alltoall(sendbuf, sendcount, sendtype, recvbuf, recvcount, recvtype, comm);
+}
+
+/* Replaces MPI_Barrier() */
+int MPI_Barrier(MPI_Comm comm){
+	if(!IsPhaseMergeEnabled())
+		return PMPI_Barrier(comm);
+
+	MPI_Request req;
+	int ret_val = PMPI_Ibarrier(comm, &req);
+	if(ret_val != MPI_SUCCESS)
+		return ret_val;
+	return WaitAndMerge(&req, (uintptr_t)__builtin_return_address(0), NULL, 0, NULL, 0);
+}
+
+/* Replaces MPI_Allreduce() */
+int MPI_Allreduce(const void *sendbuf, void *recvbuf, int count, MPI_Datatype datatype, MPI_Op op, MPI_Comm comm){
+	if(hotTable){
+		MarkHotBuffer(sendbuf, MPIBufferLength(count, datatype));
+		MarkHotBuffer(recvbuf, MPIBufferLength(count, datatype));
+	}
+	if(!IsPhaseMergeEnabled())
+		return PMPI_Allreduce(sendbuf, recvbuf, count, datatype, op, comm);
+
+	MPI_Request req;
+	int ret_val = PMPI_Iallreduce(sendbuf, recvbuf, count, datatype, op, comm, &req);
+	if(ret_val != MPI_SUCCESS)
+		return ret_val;
+	size_t len = MPIBufferLength(count, datatype);
+	return WaitAndMerge(&req, (uintptr_t)__builtin_return_address(0), sendbuf, len, recvbuf, len);
+}
+
+/* Replaces MPI_Reduce() */
+int MPI_Reduce(const void *sendbuf, void *recvbuf, int count, MPI_Datatype datatype, MPI_Op op, int root, MPI_Comm comm){
+	if(hotTable){
+		MarkHotBuffer(sendbuf, MPIBufferLength(count, datatype));
+		MarkHotBuffer(recvbuf, MPIBufferLength(count, datatype));
+	}
+	if(!IsPhaseMergeEnabled())
+		return PMPI_Reduce(sendbuf, recvbuf, count, datatype, op, root, comm);
+
+	MPI_Request req;
+	int ret_val = PMPI_Ireduce(sendbuf, recvbuf, count, datatype, op, root, comm, &req);
+	if(ret_val != MPI_SUCCESS)
+		return ret_val;
+	size_t len = MPIBufferLength(count, datatype);
+	return WaitAndMerge(&req, (uintptr_t)__builtin_return_address(0), sendbuf, len, recvbuf, len);
+}
+
+/* Replaces MPI_Bcast() */
+int MPI_Bcast(void *buffer, int count, MPI_Datatype datatype, int root, MPI_Comm comm){
+	size_t len = ((hotTable || eagerMergeKb)? MPIBufferLength(count, datatype): 0);
+	bool is_eager = IsEagerMergeBuffer(buffer, len);
+	int ret_val;
+
+	if(hotTable && !is_eager) /* replicated data is not rewritten by MPI */
+		MarkHotBuffer(buffer, len);
+	if(!IsPhaseMergeEnabled()){
+		ret_val = PMPI_Bcast(buffer, count, datatype, root, comm);
+	}else{
+		MPI_Request req;
+		ret_val = PMPI_Ibcast(buffer, count, datatype, root, comm, &req);
+		if(ret_val == MPI_SUCCESS)
+			ret_val = WaitAndMerge(&req, (uintptr_t)__builtin_return_address(0), 
+					buffer, MPIBufferLength(count, datatype), NULL, 0);
+	}
+
+	if(is_eager && ret_val == MPI_SUCCESS)
+		MergeReplicatedBuffer(buffer, len);
+	return ret_val;
+}
+
+/* Replaces MPI_File_read_all() */
+int MPI_File_read_all(MPI_File fh, void *buf, int count, MPI_Datatype datatype, MPI_Status *status){
+	int ret_val = PMPI_File_read_all(fh, buf, count, datatype, status);
+	if(eagerMergeKb && ret_val == MPI_SUCCESS){
+		size_t len = MPIBufferLength(count, datatype);
+		if(IsEagerMergeBuffer(buf, len))
+			MergeReplicatedBuffer(buf, len);
+	}
+	return ret_val;
+}
+
+/* Replaces MPI_File_read_at_all() */
+int MPI_File_read_at_all(MPI_File fh, MPI_Offset offset, void *buf, int count, MPI_Datatype datatype, MPI_Status *status){
+	int ret_val = PMPI_File_read_at_all(fh, offset, buf, count, datatype, status);
+	if(eagerMergeKb && ret_val == MPI_SUCCESS){
+		size_t len = MPIBufferLength(count, datatype);
+		if(IsEagerMergeBuffer(buf, len))
+			MergeReplicatedBuffer(buf, len);
+	}
+	return ret_val;
+}
+
+/* Checks whether a buffer filled by a collective should be merged at once */
+bool IsEagerMergeBuffer(const void *buf, size_t len){
+	if(!eagerMergeKb || !isMPIInitialized || isMPIFinalized || !buf)
+		return false;
+	if(len < (size_t)eagerMergeKb * 1024)
+		return false;
+#if defined __x86_64__
+	if((uintptr_t)buf <= sharedHeapBottom || (uintptr_t)buf + len > sharedHeapTop)
+		return false; /* not in shared heap */
+#endif /* __x86_64__ */
+	return true;
+}
+
+/* Merges whole pages of a buffer holding the same data in every task */
+void MergeReplicatedBuffer(const void *buf, size_t len){
+	uintptr_t addr = (ptr2offset(buf) + PAGE_SIZE - 1) & ~((uintptr_t)PAGE_SIZE - 1);
+	uintptr_t end = (ptr2offset(buf) + len) & ~((uintptr_t)PAGE_SIZE - 1);
+
+	SyncArenaSegments();
+	while(addr < end){
+		AVLTreeNode *node = (AVLTreeNode *)AspaceAvlSearchRangeWrapper(addr);
+		if(!node){ /* skip the gap up to the next region */
+			node = (AVLTreeNode *)FindNextAVL((AVLTree *)allocRecord, offset2ptr(addr));
+			if(!node || ptr2offset(node->key) >= end)
+				break;
+			addr = ptr2offset(node->key);
+		}
+		uintptr_t region_end = ptr2offset(node->key) + ptr2offset(node->value);
+		size_t size = (region_end < end? region_end: end) - addr;
+		MergeRegion(node, addr, size);
+		addr += size;
+	}
+}
+
+
+/* Fills the address of the socket passing the shared file, in the abstract
+ * namespace so that it vanishes with its last user */
+static socklen_t GetSharedFileSocketAddr(struct sockaddr_un *addr){
+	memset(addr, 0, sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+	int len = snprintf(addr->sun_path + 1, sizeof(addr->sun_path) - 1, 
+			SHARED_FILE_NAME ".%u.%d", (unsigned int) getuid(), (int) semKey);
+	return (socklen_t) (offsetof(struct sockaddr_un, sun_path) + 1 + len);
+}
+
+/* Receives a file descriptor over a local socket, -1 if none */
+static int ReceiveFd(int sock){
+	char byte;
+	char control[CMSG_SPACE(sizeof(int))];
+	struct iovec iov = { &byte, 1 };
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+
+	ssize_t len;
+	while((len = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC)) == -1 && errno == EINTR);
+
+	struct cmsghdr *cmsg = (len == 1? CMSG_FIRSTHDR(&msg): NULL);
+	if(!cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+		return -1;
+	int fd;
+	memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+	return fd;
+}
+
+/* Sends a file descriptor over a local socket, returns 0 if sent */
+static int SendFd(int sock, int fd){
+	char byte = 0;
+	char control[CMSG_SPACE(sizeof(int))];
+	struct iovec iov = { &byte, 1 };
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	memset(control, 0, sizeof(control));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+	ssize_t len;
+	while((len = sendmsg(sock, &msg, MSG_NOSIGNAL)) == -1 && errno == EINTR);
+	return (len == 1? 0: -1);
+}
+
+/* Receives the shared file from the task that created it, -1 if none */
+static int ReceiveSharedMemfd(){
+	struct sockaddr_un addr;
+	socklen_t addr_len = GetSharedFileSocketAddr(&addr);
+	int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if(sock == -1)
+		return -1;
+	if(connect(sock, (struct sockaddr *)&addr, addr_len) != 0){
+		close(sock);
+		return -1;
+	}
+	int fd = ReceiveFd(sock);
+	close(sock);
+	return fd;
+}
+
+/* Passes the shared file to each task of the same user connecting */
+static void *ServeSharedMemfd(void *arg){
+	int fd = (int)(intptr_t) arg;
+	for(;;){
+		int conn = accept4(sharedFileSocket, NULL, NULL, SOCK_CLOEXEC);
+		if(conn == -1){
+			if(errno == EINTR || errno == ECONNABORTED)
+				continue;
+			break; /* socket shut down */
+		}
+
+		struct ucred cred;
+		socklen_t cred_len = sizeof(cred);
+		if(getsockopt(conn, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len) == 0 && cred.uid == getuid())
+			SendFd(conn, fd);
+		close(conn);
+	}
+	return NULL;
+}
+
+/* Opens the shared file as a memfd, created by the first task of the node */
+int OpenSharedMemfd(bool *init_shared){
+#ifdef SYS_memfd_create
+	int saved_errno = errno;
+	int fd = ReceiveSharedMemfd();
+	if(fd != -1){
+		*init_shared = false;
+		errno = saved_errno;
+		return fd;
+	}
+
+	/* nobody serves the file, so we are the first */
+	fd = (int) syscall(SYS_memfd_create, SHARED_FILE_NAME, MFD_CLOEXEC);
+	if(fd == -1){
+		errno = saved_errno;
+		return -1;
+	}
+
+	struct sockaddr_un addr;
+	socklen_t addr_len = GetSharedFileSocketAddr(&addr);
+	pthread_t server;
+	pthread_attr_t attr;
+	sharedFileSocket = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if(sharedFileSocket == -1 
+			|| bind(sharedFileSocket, (struct sockaddr *)&addr, addr_len) != 0
+			|| listen(sharedFileSocket, 64) != 0){
+		warn("unable to pass the shared memfd, using /dev/shm");
+		CloseSharedFileSocket();
+		close(fd);
+		errno = saved_errno;
+		return -1;
+	}
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	pthread_attr_setstacksize(&attr, PTHREAD_STACK_MIN > 65536? PTHREAD_STACK_MIN: 65536);
+	int ret_val = pthread_create(&server, &attr, ServeSharedMemfd, (void *)(intptr_t) fd);
+	pthread_attr_destroy(&attr);
+	if(ret_val != 0){
+		warn("unable to pass the shared memfd, using /dev/shm");
+		CloseSharedFileSocket();
+		close(fd);
+		errno = saved_errno;
+		return -1;
+	}
+	*init_shared = true;
+	errno = saved_errno;
+	return fd;
+#else
+	return -1;
+#endif /* SYS_memfd_create */
+}
+
+/* Stops passing the shared file to tasks attaching later */
+void CloseSharedFileSocket(){
+	if(sharedFileSocket != -1){
+		shutdown(sharedFileSocket, SHUT_RDWR); /* wakes up the server */
+		close(sharedFileSocket);
+		sharedFileSocket = -1;
+	}
+}
+
+
+/*-------------------------------------------------------------------------------*/
+/* Lowers the node id to the rank of the current task */
+void RecordNodeId(){
+	if(!nodeId)
+		return;
+	int rank, id;
+	PMPI_Comm_rank(MPI_COMM_WORLD, &rank);
+	do{
+		id = *nodeId;
+	}while((id == 0 || id > rank + 1) && !__sync_bool_compare_and_swap(nodeId, id, rank + 1));
+}
+
+/*-------------------------------------------------------------------------------*/
+/* Returns the size of the sharing bits, numProc bits for each slot of the
+ * domain and node wide tiers */
+static inline size_t SharingInfoSize(){
+	return 2 * (size_t) SLOTS_PER_TIER * (numProc / 8);
+}
+
+/* Returns the size of the sharing bits of the slots of merge domain d */
+static inline size_t DomainBitsSize(int d){
+	return (size_t) SLOTS_PER_TIER * (domainInfo->domains[d].bitWidth / 8);
+}
+
+
 /*-------------------------------------------------------------------------------*/
 /* allocates shared data, metadata and initializes them*/
 void AllocateSharedMetadata(){
@@ -545,11 +1140,13 @@ void AllocateSharedMetadata(){
 		fprintf(stderr, "obtained sem\n");
 #endif /* PRINT_DEBUG_MSG */
 
-		/* open POSIX shared file */
-		char shm_name[] = "/PSMallocTest";
-		sharedFileDescr = shm_open(shm_name, O_CREAT|O_EXCL|O_RDWR|O_TRUNC, S_IRUSR|S_IWUSR);
+		/* open POSIX shared file unless a memfd is passed around */
+		char shm_name[] = "/" SHARED_FILE_NAME;
+		sharedFileDescr = (useMemfd? OpenSharedMemfd(&init_shared): -1);
 
 		if(sharedFileDescr != -1){
+			isSharedMemfd = true;
+		} else if((sharedFileDescr = shm_open(shm_name, O_CREAT|O_EXCL|O_RDWR|O_TRUNC, S_IRUSR|S_IWUSR)) != -1){
 			init_shared = true; // nobody initialized data yet 
 		} else if((sharedFileDescr == -1) 
 				&& (errno == EEXIST)){
@@ -571,36 +1168,22 @@ void AllocateSharedMetadata(){
 #ifdef PRINT_DEBUG_MSG
 			fprintf(stderr, "initializing shared metadata\n");
 #endif /* PRINT_DEBUG_MSG */
-			/* Max 3 GB address space available for mmap + 3 MB for shared metadata + 4KB for alive proc stat and other metadata */
-			/* if ftruncate64 changes size, it fills the extended part with 0 */
-			if (ftruncate64(sharedFileDescr, ((off64_t)0x03 << 30) | ((off64_t)0x03 << 20 ) | ((off64_t)0x01 << 12 )) < 0) { 
+			/* Max 3 GB address space available for mmap, followed by 4KB for alive proc stat
+			 * and other metadata, the node of each page, the merge daemon area and the
+			 * sharing bits last */
+			off64_t file_size = SHARING_INFO_OFFSET + SharingInfoSize();
+			if(mergeDomain != DOMAIN_NODE) /* + 4 GB for slots of each domain, sparse */
+				file_size = DOMAIN_FILE_BASE(MAX_MERGE_DOMAINS);
+			/* the file is new, ftruncate64 extends it with holes reading as 0,
+			 * so the metadata takes memory only where it is written */
+			if (ftruncate64(sharedFileDescr, file_size) < 0) { 
 				SignalSem(mutex);
 				perror("unable to truncate file\n");
 				Fatal();
 			}
 			CheckForError();
-			/* use one page to map all zero pages */
-			zeroPage = (char*) SH_MMAP(NULL, PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, sharedFileDescr, 0);
-			memset(zeroPage, 0, PAGE_SIZE);
-			MakeReadOnlyWrapper(zeroPage, PAGE_SIZE); /* make the zero page read only to prevent errors */
-		}else{ /* someone already initialized, so map it as read only */
-			zeroPage = (char*) SH_MMAP(NULL, PAGE_SIZE, PROT_READ, MAP_SHARED, sharedFileDescr, 0);
 		}
 
-		ASSERTX(zeroPage != MAP_FAILED);
-
-		/* attach 3MB after 3GB user space of the shared file as shared memory
-		 * for storing metadata */
-
-		sharingProcessesInfo = (int*) SH_MMAP(NULL, 
-				0x03 << 20, /* map 3MB */
-				PROT_READ | PROT_WRITE, /* with RDWR */
-				MAP_SHARED, /* as shared memory */
-				sharedFileDescr, 
-				(((off64_t)0x03) << 30) /* at the end of 3GB */
-				); /* assuming pagesize of 4096 B*/
-		ASSERTX(sharingProcessesInfo != MAP_FAILED);
-
 		/* use the a page for storing alive proc info */
 		aliveProcs = (int *) SH_MMAP(NULL, 
 				PAGE_SIZE, 
@@ -612,6 +1195,19 @@ void AllocateSharedMetadata(){
 
 		ASSERTX(aliveProcs != MAP_FAILED);
 
+		sharedLock = (SharedLock *) ((char *)aliveProcs + SHARED_LOCK_OFFSET);
+		taskSlots = (SlotRange (*)[2]) ((char *)aliveProcs + TASK_SLOTS_OFFSET);
+		nodeId = (int *) ((char *)aliveProcs + NODE_ID_OFFSET);
+		if(init_shared)
+			InitSharedLock(sharedLock);
+
+		if(numaPlacement)
+			numaInfo = (NumaInfo *) ((char *)aliveProcs + NUMA_INFO_OFFSET);
+		if(mergeDomain != DOMAIN_NODE){
+			domainInfo = (DomainInfo *) ((char *)aliveProcs + DOMAIN_INFO_OFFSET);
+			nodeLock = sharedLock; /* tasks take the lock of their domain instead */
+		}
+
 #ifdef SHARED_STATS		
 		sharedPageCount 				= (int *) (aliveProcs + 1);
 		allProcPrivatePageCount 	= (int *) (aliveProcs + 2);
@@ -625,7 +1221,6 @@ void AllocateSharedMetadata(){
 		CheckForError();
 
 		if(init_shared){
-			memset(sharingProcessesInfo, 0, 3 * 1024 * 1024);
 			/* num alive process determines how many procs have cleared their data structure */
 
 			if(aliveProcs)
@@ -654,13 +1249,51 @@ void AllocateSharedMetadata(){
 
 		{
 			myRank = *aliveProcs - 1;
-			currProcMask = (0x01) << myRank;
-			currProcMaskInverted= ~(currProcMask);
+			currProcMask = (0x01UL) << myRank;
 		}
+		if(numaPlacement)
+			NumaAttachTask();
+		if(domainInfo)
+			AttachMergeDomain();
+		if(mergeDaemon)
+			AttachMergeDaemon(init_shared);
 #ifdef PRINT_DEBUG_MSG
 		fprintf(stderr, "signalling sem\n");
 #endif /* PRINT_DEBUG_MSG */
 		SignalSem(mutex);
+		if(myRank >= numProc || (domainInfo && myDomainRank >= domainInfo->domains[myDomain].bitWidth))
+			die("error: More tasks in the node than sharing bits per page ... exiting\n");
+	}
+
+	/* the file is initialized, map the rest without holding the semaphore */
+
+	/* use one page to map all zero pages, read only to prevent errors */
+	zeroPage = (char*) SH_MMAP(NULL, PAGE_SIZE, PROT_READ, MAP_SHARED, sharedFileDescr, 0);
+	ASSERTX(zeroPage != MAP_FAILED);
+
+	/* attach the sharing bits after the metadata following the 3GB user space
+	 * of the shared file as shared memory */
+	sharingProcessesInfo = (int*) SH_MMAP(NULL, 
+			SharingInfoSize(), /* numProc bits for each slot of both tiers */
+			PROT_READ | PROT_WRITE, /* with RDWR */
+			MAP_SHARED, /* as shared memory */
+			sharedFileDescr, 
+			SHARING_INFO_OFFSET
+			); /* assuming pagesize of 4096 B*/
+	ASSERTX(sharingProcessesInfo != MAP_FAILED);
+
+	if(domainInfo){
+		/* sharing bits of the slots of the domain, after its slots */
+		domainBits[myDomain] = SH_MMAP(NULL, DomainBitsSize(myDomain), PROT_READ | PROT_WRITE, 
+				MAP_SHARED, sharedFileDescr, DOMAIN_BITS_OFFSET(myDomain));
+		ASSERTX(domainBits[myDomain] != MAP_FAILED);
+	}
+
+	if(numaPlacement){
+		/* node of each domain and node wide slot */
+		slotHome = (uint8_t *) SH_MMAP(NULL, 2 * SLOTS_PER_TIER, PROT_READ | PROT_WRITE, 
+				MAP_SHARED, sharedFileDescr, SLOT_HOME_OFFSET);
+		ASSERTX(slotHome != MAP_FAILED);
 	}
 	errno = saved_errno;
 }
@@ -685,10 +1318,16 @@ void GetMemRange(){
 	char line[LMAX];
 	FILE * procmap = fopen("/proc/self/maps", "r");
 	uintptr_t number1, number2;
+	Dl_info info;
+	const char *lib_name = "libsbllmalloc";
+
+	/* find the name of this library, whatever it is installed as */
+	if(dladdr((void *)GetMemRange, &info) && info.dli_fname && info.dli_fname[0])
+		lib_name = info.dli_fname;
 	
 	if(procmap != NULL){
 		while (fgets(line, LMAX, procmap) != NULL) {
-			if(strstr(line, "libptmalloc")){
+			if(strstr(line, lib_name)){
 				sscanf(line, "%lx-%lx", &number1, &number2);
 				if(number1 < lowLoadAddr)
 					lowLoadAddr = number1;
@@ -707,12 +1346,48 @@ void GetMemRange(){
 /* Checks environment variables for sanity */
 void CheckEnv(){
 	ASSERTX(mergeMetric < NUM_METRIC);
-#ifdef ENABLE_PROFILER
 	ASSERTX(profileMode < NUM_MODES);
-#endif /* ENABLE_PROFILER */
+	if(profileMode != NONE)
+		enableBacktrace = 1; /* allocation sites are needed */
 	ASSERTX((mergeMinMemTh > 0) && (mergeMinMemTh < 100000)); /*assuming less than 100GB */
 	ASSERTX(mallocRefFreq > 0);
+	ASSERTX((mergeOverheadPct > 0) && (mergeOverheadPct < 100));
+	if(faultAroundMax < 1)
+		faultAroundMax = 1;
+	if(pagePoolSize < 0 || mergeMetric == MERGE_DISABLED)
+		pagePoolSize = 0;
+	if(mergeStableMs < 0 || mergeMetric == MERGE_DISABLED)
+		mergeStableMs = 0;
+	if(hotBufferMs < 0 || mergeMetric == MERGE_DISABLED)
+		hotBufferMs = 0;
+	if(eagerMergeKb < 0 || mergeMetric == MERGE_DISABLED)
+		eagerMergeKb = 0;
+	if(mergeMetric == MERGE_DISABLED)
+		arenaMerge = numaPlacement = 0;
+	ASSERTX((mergeDomain >= DOMAIN_NODE) && (mergeDomain < NUM_DOMAIN_KINDS));
+	if(mergeMetric == MERGE_DISABLED)
+		mergeDomain = DOMAIN_NODE;
 	mergeMinMemTh *= (1000000/PAGE_SIZE);
+	if(mergeThreads < 1 || mergeMetric == MERGE_DISABLED)
+		mergeThreads = 1;
+	if(mergeThreads > MAX_MERGE_THREADS)
+		mergeThreads = MAX_MERGE_THREADS;
+#if defined(MICROTIME_STAT) || defined(PART_BLOCK_MERGE_STAT)
+	mergeThreads = 1; /* stats are not updated atomically */
+	mergeDaemon = 0; /* stats are collected by the comparing process */
+#endif /* MICROTIME_STAT || PART_BLOCK_MERGE_STAT */
+	if(mergeMetric == MERGE_DISABLED)
+		mergeDaemon = 0;
+	ASSERTX((mpiPhaseMerge >= PHASE_OFF) && (mpiPhaseMerge <= PHASE_LEARNED));
+	if(mergeMetric == MERGE_DISABLED)
+		mpiPhaseMerge = PHASE_OFF;
+	if(memPressureTrigger){
+		ASSERTX((pressureLowPct >= 0) && (pressureLowPct <= pressureHighPct) && (pressureHighPct <= 100));
+	}
+#ifdef COLLECT_MALLOC_STAT
+	if(mergeMetric == MERGE_DISABLED)
+		lazyTouchStat = 0; /* touched pages are only found by merge passes */
+#endif /* COLLECT_MALLOC_STAT */
 }
 
 
@@ -722,14 +1397,12 @@ void InitEnv(){
 	errno = 0;
 	commandLineArgument args[] =
 	{
-#ifdef ENABLE_PROFILER
 		{
 			"PROFILE_MODE", 
 			&profileMode,
 			NONE,
 			"profiling mode? 0: no profiling(default), 1: create, 2: use profile for merging"
 		},
-#endif /* ENABLE_PROFILER */
 		{
 			"ENABLE_BACKTRACE", 
 			&enableBacktrace, 
@@ -740,7 +1413,103 @@ void InitEnv(){
 			"MERGE_METRIC", 
 			&mergeMetric, 
 			1,
-			"merge metric?0(disabled),1(alloc_frequency),2(threshold),3(buffered EXPERIMENTAL): default 1"
+			"merge metric?0(disabled),1(alloc_frequency),2(threshold),3(buffered EXPERIMENTAL),4(adaptive): default 1"
+		},
+		{
+			"MERGE_THREADS", 
+			&mergeThreads, 
+			1,
+			"threads classifying pages in a merge pass, default 1, max 16"
+		},
+		{
+			"MERGE_DAEMON", 
+			&mergeDaemon, 
+			0,
+			"compare pages in a merge daemon per node? 0: no(default), 1: yes"
+		},
+		{
+			"MERGE_DAEMON_CPU", 
+			&mergeDaemonCpu, 
+			-1,
+			"cpu the merge daemon is pinned to, default -1 (not pinned)"
+		},
+		{
+			"MEM_PRESSURE_TRIGGER", 
+			&memPressureTrigger, 
+			0,
+			"merge aggressively close to the cgroup memory limit and hold back far from it? 0: no(default), 1: yes"
+		},
+		{
+			"PRESSURE_LOW_PCT", 
+			&pressureLowPct, 
+			50,
+			"memory usage in percent of limit below which merging is held back, default 50"
+		},
+		{
+			"PRESSURE_HIGH_PCT", 
+			&pressureHighPct, 
+			90,
+			"memory usage in percent of limit above which merging is aggressive, default 90"
+		},
+		{
+			"MPI_PHASE_MERGE", 
+			&mpiPhaseMerge, 
+			PHASE_OFF,
+			"merge while waiting in collectives? 0: no(default), 1: when threshold is crossed, 2: once per learned iteration"
+		},
+		{
+			"HOT_BUFFER_MS", 
+			&hotBufferMs, 
+			0,
+			"MPI buffers are not merged until idle for this many ms, default 0 (disabled)"
+		},
+		{
+			"EAGER_MERGE_KB", 
+			&eagerMergeKb, 
+			0,
+			"buffers of MPI_Bcast and collective file reads at least this many KB are merged at once, default 0 (disabled)"
+		},
+		{
+			"ARENA_MERGE", 
+			&arenaMerge, 
+			0,
+			"map segments of the small object allocator in the shared heap to merge them? 0: no(default), 1: yes"
+		},
+		{
+			"NUMA_PLACEMENT", 
+			&numaPlacement, 
+			0,
+			"place merged pages on the NUMA node most of their sharers run on? 0: no(default), 1: yes"
+		},
+		{
+			"SHM_MEMFD", 
+			&useMemfd, 
+			1,
+			"create the shared file with memfd_create and pass it over a socket? 0: no, use /dev/shm, 1: yes(default)"
+		},
+		{
+			"MERGE_DOMAIN", 
+			&mergeDomain, 
+			0,
+			"tasks merge within a domain first, then across: 0: node(default), 1: socket, 2: L3 cache"
+		},
+		{
+			"MERGE_SLICE_PAGES", 
+			&mergeSlicePages, 
+			0,
+			"max pages scanned before a merge pass yields, resumed on next trigger, default 0 (no limit)"
+		},
+		{
+			"MERGE_SLICE_USEC", 
+			&mergeSliceUsec, 
+			0,
+			"max usec spent before a merge pass yields, resumed on next trigger, default 0 (no limit)"
+		},
+		{
+			"MERGE_OVERHEAD_PCT", 
+			&mergeOverheadPct, 
+			2,
+			"percentage of run time spent in merging with adaptive merge metric, default 2"
 		},
 		{
 			"MIN_MEM_TH", 
@@ -766,6 +1535,32 @@ void InitEnv(){
 			1234,
 			"semaphore key, default 1234"
 		},
+		{
+			"MERGE_STABLE_MS", 
+			&mergeStableMs, 
+			1000,
+			"a merge undone within this many ms is failed, merging such pages backs off exponentially, 0 disables, default 1000"
+		},
+		{
+			"PAGE_POOL_SIZE", 
+			&pagePoolSize, 
+			512,
+			"pre-faulted private pages kept for unmerging, 0 disables, default 512"
+		},
+		{
+			"FAULT_AROUND_MAX", 
+			&faultAroundMax, 
+			256,
+			"max pages unmerged together on sequential write faults, 1 disables, default 256"
+		},
+#ifdef COLLECT_MALLOC_STAT
+		{
+			"LAZY_TOUCH_STAT", 
+			&lazyTouchStat, 
+			0,
+			"map regions writable and find touched pages with mincore() at merge time? 1/0(default)"
+		},
+#endif /* COLLECT_MALLOC_STAT */
 		{ NULL, NULL, 0, NULL}
 	};
 
@@ -923,16 +1718,579 @@ inline void WaitSem (sem_t *mutex) {
 	errno = saved_errno;
 }
 
+/*-------------------------------------------------------------------------------*/
+/* Initializes the robust, process shared lock in the metadata page */
+void InitSharedLock(SharedLock *lock){
+	pthread_mutexattr_t attr;
+
+	ASSERTX(pthread_mutexattr_init(&attr) == 0);
+	ASSERTX(pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED) == 0);
+	ASSERTX(pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST) == 0);
+	/* report recursive locking, e.g. a fault inside a locked section */
+	ASSERTX(pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_ERRORCHECK) == 0);
+	ASSERTX(pthread_mutex_init(&lock->mutex, &attr) == 0);
+	pthread_mutexattr_destroy(&attr);
+	lock->owner = -1;
+}
 
+/*-------------------------------------------------------------------------------*/
+/* Takes the inter-process lock guarding shared metadata */
+void AcquireSharedLock(){
+	int saved_errno = errno;
+	int ret_val = pthread_mutex_lock(&sharedLock->mutex);
+
+	if(ret_val == EOWNERDEAD){
+		/* the owner died in the middle of an update */
+		int dead_rank = sharedLock->owner;
+		fprintf(stderr, "%d:warning! task %d died holding the lock, repairing metadata\n", myRank, dead_rank);
+		RepairSharedMetadata(dead_rank);
+		ASSERTX(pthread_mutex_consistent(&sharedLock->mutex) == 0);
+	}else if(ret_val == EDEADLK){
+		/* we already hold it: fault while updating metadata */
+		warn("shared lock taken twice");
+		Fatal();
+	}else if(ret_val != 0){
+		errno = ret_val;
+		die("unable to take shared lock");
+	}
+	isSharedLockHeld = true;
+	sharedLock->owner = myRank;
+#ifdef SHARED_STATS
+	sharedLock->sharedPageCount 		= *sharedPageCount;
+	sharedLock->allProcPrivatePageCount = *allProcPrivatePageCount;
+	sharedLock->baseCaseTotalPageCount 	= *baseCaseTotalPageCount;
+#endif /* SHARED_STATS */
+	errno = saved_errno;
+}
 
-/*===============================================================================*/
-/*                 SIGSEGV Handler for Changing Page Permissions                 */
-/*===============================================================================*/
-
-/* SIGSEGV signal handler */
-void SigSegvHandler(int32_t signo, siginfo_t *si , void *sc) {
+/*-------------------------------------------------------------------------------*/
+/* Releases the inter-process lock guarding shared metadata */
+void ReleaseSharedLock(){
+	int saved_errno = errno;
+	sharedLock->owner = -1;
+	isSharedLockHeld = false;
+	ASSERTX(pthread_mutex_unlock(&sharedLock->mutex) == 0);
+	errno = saved_errno;
+}
 
-	char* faultaddr;
+/*-------------------------------------------------------------------------------*/
+/* Returns the bits of slot i of an array of width bits per slot */
+static inline unsigned long LoadBits(const void *bits, int width, uintptr_t i){
+	switch(width){
+	case 8:		return *((const uint8_t *) bits + i);
+	case 16:	return *((const uint16_t *) bits + i);
+	case 32:	return *((const uint32_t *) bits + i);
+	default:	return *((const uint64_t *) bits + i);
+	}
+}
+
+/* Sets the bits of mask in slot i of an array of width bits per slot */
+static inline void OrBits(void *bits, int width, uintptr_t i, unsigned long mask){
+	switch(width){
+	case 8:		__sync_fetch_and_or((uint8_t *) bits + i, (uint8_t) mask); break;
+	case 16:	__sync_fetch_and_or((uint16_t *) bits + i, (uint16_t) mask); break;
+	case 32:	__sync_fetch_and_or((uint32_t *) bits + i, (uint32_t) mask); break;
+	default:	__sync_fetch_and_or((uint64_t *) bits + i, (uint64_t) mask); break;
+	}
+}
+
+/* Clears the bits of mask in slot i of an array of width bits per slot,
+ * returns the bits left */
+static inline unsigned long AndNotBits(void *bits, int width, uintptr_t i, unsigned long mask){
+	switch(width){
+	case 8:		return __sync_and_and_fetch((uint8_t *) bits + i, (uint8_t) ~mask);
+	case 16:	return __sync_and_and_fetch((uint16_t *) bits + i, (uint16_t) ~mask);
+	case 32:	return __sync_and_and_fetch((uint32_t *) bits + i, (uint32_t) ~mask);
+	default:	return __sync_and_and_fetch((uint64_t *) bits + i, (uint64_t) ~mask);
+	}
+}
+
+/* Whether index is a slot of the merge domain of the current task, whose
+ * sharing bits are those of the domain, else of the node */
+static inline bool IsDomainSlot(uintptr_t index){
+	return (domainInfo && index < SLOTS_PER_TIER);
+}
+
+/* Returns the sharing bits of the page at index */
+static inline unsigned long GetSharingBits(uintptr_t index){
+	if(IsDomainSlot(index))
+		return LoadBits(domainBits[myDomain], domainInfo->domains[myDomain].bitWidth, index);
+	return LoadBits(sharingProcessesInfo, numProc, index);
+}
+
+/* Sets the bits of mask in the sharing bits of the page at index */
+static inline void SetSharingBits(uintptr_t index, unsigned long mask){
+	if(IsDomainSlot(index))
+		OrBits(domainBits[myDomain], domainInfo->domains[myDomain].bitWidth, index, mask);
+	else
+		OrBits(sharingProcessesInfo, numProc, index, mask);
+}
+
+/* Clears the bits of mask in the sharing bits of the page at index, returns the bits left */
+static inline unsigned long ClearSharingBits(uintptr_t index, unsigned long mask){
+	if(IsDomainSlot(index))
+		return AndNotBits(domainBits[myDomain], domainInfo->domains[myDomain].bitWidth, index, mask);
+	return AndNotBits(sharingProcessesInfo, numProc, index, mask);
+}
+
+/* Returns the bit of the current task in the sharing bits of the page at index */
+static inline unsigned long TaskBit(uintptr_t index){
+	return (IsDomainSlot(index)? myDomainMask: currProcMask);
+}
+
+/*-------------------------------------------------------------------------------*/
+/* Repairs shared metadata after the owner of the lock died */
+void RepairSharedMetadata(int deadRank){
+#ifdef SHARED_STATS
+	/* undo the half done update of the counters */
+	*sharedPageCount 			= sharedLock->sharedPageCount;
+	*allProcPrivatePageCount 	= sharedLock->allProcPrivatePageCount;
+	*baseCaseTotalPageCount 	= sharedLock->baseCaseTotalPageCount;
+#endif /* SHARED_STATS */
+
+	if(deadRank < 0 || deadRank == myRank || !sharingProcessesInfo)
+		return;
+
+	/* the dead task does not map any page anymore, its bits are only set in
+	 * the slots it has merged pages into; node wide slots follow those of the
+	 * domains. It held the lock of our domain, so it has its bit there. */
+	for(int tier = 0; tier < (domainInfo? 2: 1) && deadRank < MAX_NODE_TASKS; tier++){
+		unsigned long dead_mask = (0x01UL << ((tier == 0 && domainInfo)? domainInfo->domainRank[deadRank]: deadRank));
+		SlotRange range = taskSlots[deadRank][tier];
+		for(uintptr_t index = range.low; index < range.high; index++){
+			unsigned long x = GetSharingBits(index);
+			if(!(x & dead_mask))
+				continue;
+#ifdef SHARED_STATS
+			if(__builtin_popcountl(x) == 1) /* page was private to the dead task */
+				(*allProcPrivatePageCount)--;
+			else if(__builtin_popcountl(x) == 2){ /* survivor keeps a private copy */
+				(*allProcPrivatePageCount)++;
+				(*sharedPageCount)--;
+			}
+#endif /* SHARED_STATS */
+			NumaLeavePage(index, deadRank);
+			ClearSharingBits(index, dead_mask);
+		}
+	}
+	if(*aliveProcs > 0)
+		--(*aliveProcs);
+}
+
+
+
+/*===============================================================================*/
+/*                       NUMA Placement of Shared Pages                          */
+/*===============================================================================*/
+
+/* Records the NUMA node the current task runs on */
+void NumaAttachTask(){
+	unsigned int cpu = 0, node = 0;
+	if(syscall(SYS_getcpu, &cpu, &node, NULL) == 0 && node < MAX_NUMA_NODES)
+		myNode = (int) node;
+	if(myRank < MAX_NUMA_TASKS)
+		numaInfo->taskNode[myRank] = (int8_t) myNode;
+}
+
+/* Counts the sharers in x running on node */
+static int NumaSharersOn(unsigned long x, int node){
+	int count = 0;
+	for(int r = 0; r < MAX_NUMA_TASKS; r++)
+		if(((x >> r) & 0x01) && numaInfo->taskNode[r] == node)
+			count++;
+	return count;
+}
+
+/* Whether the node of the slot at index is tracked, slots of merge domains
+ * at the same index are different pages and stay where they are made */
+static inline bool HasSlotHome(uintptr_t index){
+	return !(domainInfo && index < SLOTS_PER_TIER);
+}
+
+/* Sets the placement of a fresh shared mapping before it is filled */
+void NumaPreferHome(void *p0, size_t size){
+	if(!numaInfo || slotFileBase != 0)
+		return;
+
+	int tasks_on[MAX_NUMA_NODES];
+	memset(tasks_on, 0, sizeof(tasks_on));
+	for(int r = 0; r < *aliveProcs && r < MAX_NUMA_TASKS; r++)
+		tasks_on[numaInfo->taskNode[r]]++;
+
+	int most = 0;
+	for(int n = 0; n < MAX_NUMA_NODES; n++)
+		if(tasks_on[n] > most)
+			most = tasks_on[n];
+	if(!most)
+		return;
+
+	unsigned long mask = 0;
+	int num_nodes = 0;
+	for(int n = 0; n < MAX_NUMA_NODES; n++)
+		if(tasks_on[n] == most){
+			mask |= (0x01UL << n);
+			num_nodes++;
+		}
+
+	/* the pages are mapped by this task only, so they may be moved */
+	syscall(SYS_mbind, p0, size, 
+			(num_nodes == 1? MPOL_PREFERRED: MPOL_INTERLEAVE), 
+			&mask, MAX_NUMA_NODES + 1, MPOL_MF_MOVE);
+}
+
+/* Moves a batch of pages to the nodes most of their sharers run on */
+static void NumaMovePages(void **pages, int *nodes, uintptr_t *indexes, int count){
+	int status[NUMA_MOVE_BATCH];
+
+	if(syscall(SYS_move_pages, 0, (unsigned long) count, pages, nodes, status, MPOL_MF_MOVE_ALL) < 0){
+		if(errno == EPERM){
+			numaMoveAll = false; /* no CAP_SYS_NICE, keep pages where they are */
+			warn("shared pages are not moved, CAP_SYS_NICE is needed");
+		}
+		return;
+	}
+
+	for(int i = 0; i < count; i++){
+		if(status[i] != nodes[i])
+			continue;
+		unsigned long x = GetSharingBits(indexes[i]);
+		int old_home = slotHome[indexes[i]] - 1;
+		__sync_fetch_and_add(&numaInfo->remoteRefs, (long) (NumaSharersOn(x, old_home) - NumaSharersOn(x, nodes[i])));
+		__sync_fetch_and_add(&numaInfo->migratedPages, 1);
+		slotHome[indexes[i]] = (uint8_t) (nodes[i] + 1);
+	}
+}
+
+/* Accounts the current task as sharer of a merged region and moves the pages
+ * whose sharers mostly run on another node */
+void NumaPlaceRegion(void *start, size_t size, bool created){
+	if(!numaInfo || !slotHome)
+		return;
+
+	int saved_errno = errno;
+	void *pages[NUMA_MOVE_BATCH];
+	int nodes[NUMA_MOVE_BATCH];
+	uintptr_t indexes[NUMA_MOVE_BATCH];
+	int count = 0;
+
+	if(created){
+		/* find where the copies landed, a batch of pages per call */
+		long remote_refs = 0;
+		for(size_t s = 0; s < size; ){
+			for(count = 0; s < size && count < NUMA_MOVE_BATCH; s += PAGE_SIZE){
+				void *p = (void *)(ptr2offset(start)+s);
+				uintptr_t index = SlotIndex(p);
+				if(HasSlotHome(index)){
+					pages[count] = p;
+					indexes[count] = index;
+					count++;
+				}
+			}
+			if(count && syscall(SYS_move_pages, 0, (unsigned long)count, pages, NULL, nodes, 0) < 0){
+				for(int i = 0; i < count; i++)
+					nodes[i] = -1;
+			}
+			for(int i = 0; i < count; i++){
+				int home = ((nodes[i] >= 0 && nodes[i] < MAX_NUMA_NODES)? nodes[i]: -1);
+				slotHome[indexes[i]] = (uint8_t) (home + 1);
+				if(home >= 0 && home != myNode)
+					remote_refs++;
+			}
+		}
+		__sync_fetch_and_add(&numaInfo->sharedRefs, (long)(size >> log2PAGE_SIZE));
+		__sync_fetch_and_add(&numaInfo->remoteRefs, remote_refs);
+		errno = saved_errno;
+		return;
+	}
+
+	for(size_t s = 0; s < size; s += PAGE_SIZE){
+		void *p = (void *)(ptr2offset(start)+s);
+		uintptr_t index = SlotIndex(p);
+
+		int home = (HasSlotHome(index)? slotHome[index] - 1: -1);
+		__sync_fetch_and_add(&numaInfo->sharedRefs, 1);
+		if(home >= 0 && home != myNode)
+			__sync_fetch_and_add(&numaInfo->remoteRefs, 1);
+
+		if(home < 0 || !numaMoveAll)
+			continue;
+
+		/* node most sharers run on, the current one unless others run on more */
+		unsigned long x = GetSharingBits(index);
+		int best = home, best_count = NumaSharersOn(x, home);
+		for(int r = 0; r < MAX_NUMA_TASKS; r++){
+			int n = numaInfo->taskNode[r];
+			if(((x >> r) & 0x01) && n != best){
+				int c = NumaSharersOn(x, n);
+				if(c > best_count){
+					best = n;
+					best_count = c;
+				}
+			}
+		}
+		if(best == home)
+			continue;
+
+		pages[count] = p;
+		nodes[count] = best;
+		indexes[count] = index;
+		if(++count == NUMA_MOVE_BATCH){
+			NumaMovePages(pages, nodes, indexes, count);
+			count = 0;
+		}
+	}
+	if(count && numaMoveAll)
+		NumaMovePages(pages, nodes, indexes, count);
+	errno = saved_errno;
+}
+
+/* Drops a reference of a task to a shared page */
+void NumaLeavePage(uintptr_t index, int rank){
+	if(!numaInfo || !slotHome || rank >= MAX_NUMA_TASKS)
+		return;
+	int home = (HasSlotHome(index)? slotHome[index] - 1: -1);
+	__sync_fetch_and_sub(&numaInfo->sharedRefs, 1);
+	if(home >= 0 && home != numaInfo->taskNode[rank])
+		__sync_fetch_and_sub(&numaInfo->remoteRefs, 1);
+}
+
+
+
+/*===============================================================================*/
+/*                                Merge Domains                                  */
+/*===============================================================================*/
+
+/* Reads a number from a topology file of cpu in sysfs, -1 if not found */
+static int ReadCpuTopology(int cpu, const char *name){
+	char path[128], buf[32];
+	snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/%s", cpu, name);
+	int fd = open(path, O_RDONLY);
+	if(fd < 0)
+		return -1;
+	ssize_t len = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if(len <= 0)
+		return -1;
+	buf[len] = '\0';
+	return atoi(buf);
+}
+
+/* Returns the package or L3 cache id of cpu, 0 if not known */
+static int CpuDomainId(int cpu){
+	int id = -1;
+	if(cpu >= 0 && mergeDomain == DOMAIN_L3)
+		id = ReadCpuTopology(cpu, "cache/index3/id");
+	if(cpu >= 0 && id < 0) /* socket, or no L3 cache found */
+		id = ReadCpuTopology(cpu, "topology/physical_package_id");
+	return (id < 0? 0: id);
+}
+
+/* Puts the current task in the merge domain of the cpu it runs on */
+void AttachMergeDomain(){
+	int saved_errno = errno;
+	int id = CpuDomainId(sched_getcpu());
+
+	/* called with the semaphore held, domains are numbered in attach order */
+	int d;
+	for(d = 0; d < domainInfo->numDomains; d++)
+		if(domainInfo->domains[d].id == id + 1)
+			break;
+	if(d == MAX_MERGE_DOMAINS){
+		warn("too many merge domains, joining the last one");
+		d = MAX_MERGE_DOMAINS - 1;
+	}else if(d == domainInfo->numDomains){
+		/* one sharing bit per cpu of the domain */
+		int num_cpus = 0;
+		for(int cpu = 0; cpu < sysconf(_SC_NPROCESSORS_CONF); cpu++)
+			if(CpuDomainId(cpu) == id)
+				num_cpus++;
+		domainInfo->domains[d].id = id + 1;
+		domainInfo->domains[d].bitWidth = SharingBitsWidth(num_cpus);
+		InitSharedLock(&domainInfo->domains[d].lock);
+		domainInfo->numDomains++;
+	}
+	errno = saved_errno;
+
+	MergeDomain *domain = &domainInfo->domains[d];
+	myDomain = d;
+	myDomainRank = domain->numTasks++;
+	if(myDomainRank < MAX_NODE_TASKS){
+		myDomainMask = (0x01UL) << myDomainRank;
+		if(myRank < MAX_NODE_TASKS)
+			domainInfo->domainRank[myRank] = (int8_t) myDomainRank;
+	}
+	sharedLock = &domain->lock;
+	slotFileBase = DOMAIN_FILE_BASE(d);
+#ifdef SHARED_STATS
+	sharedPageCount 			= &domain->pageCounts[0];
+	allProcPrivatePageCount 	= &domain->pageCounts[1];
+	baseCaseTotalPageCount 		= &domain->pageCounts[2];
+#endif /* SHARED_STATS */
+}
+
+/* Sums a page counter over the merge domains */
+int NodeTotal(int *counter){
+	if(!domainInfo)
+		return *counter;
+	int k = (int) (counter - domainInfo->domains[myDomain].pageCounts);
+	int total = aliveProcs[1 + k]; /* values from before domains were attached */
+	for(int d = 0; d < domainInfo->numDomains; d++)
+		total += domainInfo->domains[d].pageCounts[k];
+	return total;
+}
+
+/* Takes the lock guarding node wide slots, the lock of the domain is held */
+static void AcquireNodeLock(){
+	int ret_val = pthread_mutex_lock(&nodeLock->mutex);
+	if(ret_val == EOWNERDEAD){
+		/* its domain lock was held too, the domain repairs the bits */
+		ASSERTX(pthread_mutex_consistent(&nodeLock->mutex) == 0);
+	}else if(ret_val != 0){
+		errno = ret_val;
+		die("unable to take node lock");
+	}
+	nodeLock->owner = myRank;
+}
+
+/* Releases the lock guarding node wide slots */
+static void ReleaseNodeLock(){
+	nodeLock->owner = -1;
+	ASSERTX(pthread_mutex_unlock(&nodeLock->mutex) == 0);
+}
+
+/* Moves the page p of the current task from its domain slot to the node wide
+ * one, made by copying if join is false, returns true if moved */
+static bool PromotePage(char *p, bool join){
+	uintptr_t index = Addr2PageIndex(p);
+
+	SetBit(nodeTierBV, p);
+	slotFileBase = 0;
+	int ret_val = (join? RemapRegion(p, PAGE_SIZE): CopyAndRemapRegion(p, PAGE_SIZE));
+	slotFileBase = DOMAIN_FILE_BASE(myDomain);
+	if(ret_val != 0){
+		ResetAndReturnBit(nodeTierBV, p);
+		return false;
+	}
+
+	/* leave the domain slot as if the page was unmerged */
+	NumaLeavePage(index, myRank);
+	int left = __builtin_popcountl(ClearSharingBits(index, myDomainMask));
+#ifdef SHARED_STATS
+	if(left == 1){
+		(*sharedPageCount)--;
+		(*allProcPrivatePageCount) += 2;
+	}else if(left > 1){
+		(*allProcPrivatePageCount)++;
+	}
+#endif /* SHARED_STATS */
+	if(!left) /* nobody maps the domain slot anymore, free its page */
+		fallocate(sharedFileDescr, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, 
+				DOMAIN_FILE_BASE(myDomain) + (index << log2PAGE_SIZE), PAGE_SIZE);
+	__sync_fetch_and_add(&domainInfo->promotedPages, 1);
+	return true;
+}
+
+/* Moves pages of the current task from slots of its merge domain to node wide
+ * slots where another domain holds the same contents */
+void PromoteDomainSlots(){
+	if(!domainInfo || domainInfo->numDomains < 2 || !sharingProcessesInfo)
+		return;
+
+	int saved_errno = errno;
+	/* read only views of the slots of the node and of the other domains */
+	if(!nodeView){
+		nodeView = (char *) SH_MMAP(NULL, 0xc0000000, PROT_READ, MAP_SHARED, sharedFileDescr, 0);
+		if(nodeView == MAP_FAILED){
+			nodeView = NULL;
+			errno = saved_errno;
+			return;
+		}
+	}
+	for(int d = 0; d < domainInfo->numDomains; d++){
+		if(d == myDomain || domainViews[d])
+			continue;
+		domainViews[d] = (char *) SH_MMAP(NULL, 0xc0000000, PROT_READ, MAP_SHARED, sharedFileDescr, DOMAIN_FILE_BASE(d));
+		if(domainViews[d] == MAP_FAILED){
+			domainViews[d] = NULL;
+			errno = saved_errno;
+			return;
+		}
+		domainBits[d] = SH_MMAP(NULL, DomainBitsSize(d), PROT_READ, MAP_SHARED, sharedFileDescr, DOMAIN_BITS_OFFSET(d));
+		if(domainBits[d] == MAP_FAILED){
+			domainBits[d] = NULL;
+			SH_UNMAP(domainViews[d], 0xc0000000);
+			domainViews[d] = NULL;
+			errno = saved_errno;
+			return;
+		}
+	}
+
+	/* only the pages of the regions of the task can be in its slots, they
+	 * are compared without locks and the domain and node locks are taken
+	 * just for moving a page */
+	uintptr_t addr = 0;
+	AVLTreeNode *node;
+	bool stop = false;
+	while(!stop && (node = (AVLTreeNode *)FindNextAVL((AVLTree *)allocRecord, offset2ptr(addr)))){
+		addr = ptr2offset(node->key);
+		uintptr_t region_end = addr + ((ptr2offset(node->value) + PAGE_SIZE - 1) & ~((uintptr_t)PAGE_SIZE - 1));
+		if(region_end == addr) /* stale empty node */
+			addr += PAGE_SIZE;
+		for(; addr < region_end; addr += PAGE_SIZE){
+			char *p = (char *) offset2ptr(addr);
+			uintptr_t index = Addr2PageIndex(p);
+			if(!(GetSharingBits(index) & myDomainMask)) /* not in a slot of the domain */
+				continue;
+			/* domains holding a slot at the same index */
+			unsigned long other_domains = 0;
+			for(int d = 0; d < domainInfo->numDomains; d++)
+				if(d != myDomain && domainBits[d] && LoadBits(domainBits[d], domainInfo->domains[d].bitWidth, index))
+					other_domains |= (0x01UL << d);
+			bool join = (GetSharingBits(index + SLOTS_PER_TIER) != 0);
+			if(!other_domains && !join)
+				continue;
+			if(IsCloseToMmapLimit()){
+				stop = true;
+				break;
+			}
+
+			off64_t offset = (off64_t) index << log2PAGE_SIZE;
+			bool match = false;
+			if(join) /* join the node wide slot if it matches */
+				match = (memcmp(p, nodeView + offset, PAGE_SIZE) == 0);
+			for(int d = 0; !join && !match && d < domainInfo->numDomains; d++){
+				if(!(other_domains & (0x01UL << d)))
+					continue;
+				match = (memcmp(p, domainViews[d] + offset, PAGE_SIZE) == 0);
+			}
+			if(!match)
+				continue;
+
+			AcquireSharedLock();
+			AcquireNodeLock();
+			/* the page may have left the domain slot and the node wide
+			 * slot may have been filled or emptied meanwhile */
+			if((GetSharingBits(index) & myDomainMask)
+					&& (GetSharingBits(index + SLOTS_PER_TIER) != 0) == join
+					&& (!join || memcmp(p, nodeView + offset, PAGE_SIZE) == 0))
+				PromotePage(p, join);
+			ReleaseNodeLock();
+			ReleaseSharedLock();
+		}
+	}
+	errno = saved_errno;
+}
+
+
+
+/*===============================================================================*/
+/*                 SIGSEGV Handler for Changing Page Permissions                 */
+/*===============================================================================*/
+
+/* SIGSEGV signal handler */
+void SigSegvHandler(int32_t signo, siginfo_t *si , void *sc) {
+
+	char* faultaddr;
 	int writefault;
 
 	faultaddr = (char*) si->si_addr;
@@ -986,14 +2344,11 @@ void SigSegvHandler(int32_t signo, siginfo_t *si , void *sc) {
 				MergeByBUFFERED();
 			bufferOfDirtyPages[bufferPtr++] = ptr2offset(faultaddr);
 		}
+#ifdef COLLECT_MALLOC_STAT
 		else if(mergeMetric != MERGE_DISABLED){
-			AVLTreeNode *n = NULL;
-			if(allocRecord)
-				n = (AVLTreeNode *)AspaceAvlSearchRangeWrapper((uintptr_t)faultaddr);
-			//ASSERTX(n);
-			if(n)
-				n->dirty = 1;
+			SetBit(dirtyPagesBV, faultaddr); /* no tree walk in the handler */
 		}
+#endif /* COLLECT_MALLOC_STAT */
 
 
 		bool is_initialized_page 	= true;
@@ -1008,18 +2363,18 @@ void SigSegvHandler(int32_t signo, siginfo_t *si , void *sc) {
 		// writing for the first time. bit has been set already 
 
 #ifdef SHARED_STATS
-			WaitSem(mutex);
+			AcquireSharedLock();
 			(*allProcPrivatePageCount) += 1;
 			(*baseCaseTotalPageCount) 	+= 1;
 
 #ifdef PRINT_STATS
 			if(myRank == 0){
-				if(*baseCaseTotalPageCount - maxBaseCaseTotalPageCount > 1000){
-					maxBaseCaseTotalPageCount = *baseCaseTotalPageCount + (ptmalloc_get_mem_usage() * (*aliveProcs))/PAGE_SIZE;
+				if(NodeTotal(baseCaseTotalPageCount) - maxBaseCaseTotalPageCount > 1000){
+					maxBaseCaseTotalPageCount = NodeTotal(baseCaseTotalPageCount) + ((ptmalloc_get_mem_usage() - arenaSegBytes) * (*aliveProcs))/PAGE_SIZE;
 				}
 			}
 #endif /* PRINT_STATS */
-			SignalSem(mutex);
+			ReleaseSharedLock();
 #endif /* SHARED_STATS */
 			MakeReadWriteWrapper(faultaddr, PAGE_SIZE);
 
@@ -1027,55 +2382,69 @@ void SigSegvHandler(int32_t signo, siginfo_t *si , void *sc) {
 
 			bool is_zero_page 			= ResetAndReturnBit(zeroPagesBV, faultaddr);
 			bool is_shared_page 		= GetSharingBit(faultaddr);
+			int run_pages 				= 1;
 
-			WaitSem(mutex);
+			if((is_zero_page || is_shared_page) && mergeMetric != BUFFERED)
+				run_pages = FaultAroundPages(faultaddr, is_zero_page);
+			size_t run_size = (size_t)run_pages * PAGE_SIZE;
 
-#ifdef PROFILE_BASED_MERGE
-			{
-				struct timeval tv;
-				struct timezone tz;
-				if(gettimeofday(&tv, &tz) == -1)
-					die("gettimeofday");
-				uint32_t time = (uint32_t)(tv.tv_sec * 1000000 + tv.tv_usec);
-				UpdateMergeHist(faultaddr, time);
-			}
-#endif /* PROFILE_BASED_MERGE */
+			AcquireSharedLock();
+
+			uint64_t curr_time = (mergeSuccHist? GetMonotonicTime(): 0);
 
-			if(is_zero_page){
+			for(int i = 0; i < run_pages; i++){
+				char *p = faultaddr + i * PAGE_SIZE;
+
+				if(i > 0){ /* unmerged ahead of the write, will not fault */
+					ResetAndReturnBit(zeroPagesBV, p);
+#ifdef COLLECT_MALLOC_STAT
+					if(mergeMetric != MERGE_DISABLED)
+						SetBit(dirtyPagesBV, p);
+#endif /* COLLECT_MALLOC_STAT */
+				}
+
+				if(mergeSuccHist && i == 0) /* the others are not written yet */
+					UpdateMergeHist(p, curr_time);
+
+				if(is_zero_page){
 
 #ifdef SHARED_STATS
-				(*allProcPrivatePageCount)++;
+					(*allProcPrivatePageCount)++;
 #endif /* SHARED_STATS */
-				zeroPageCount -=1;
+					zeroPageCount -=1;
 
-			} else if(is_shared_page){
+				} else if(is_shared_page){
 
-				UnsetSharingBit(faultaddr);
+					NumaLeavePage(SlotIndex(p), myRank);
+					UnsetSharingBit(p);
 
 #ifdef SHARED_STATS
-				int sh_cnt =0;
-				switch(sh_cnt = CountSharingProcs(faultaddr)){
-					case 1:
-						(*sharedPageCount)--;
-						(*allProcPrivatePageCount)+=2;
-						break;
-					case 0: // it was already private
-						break; 
-					default: // >=2 procs still sharing it
-						// increase private page count
-						(*allProcPrivatePageCount)++;
-						ASSERTX(sh_cnt <= *aliveProcs);
-				}
+					int sh_cnt =0;
+					switch(sh_cnt = CountSharingProcs(p)){
+						case 1:
+							(*sharedPageCount)--;
+							(*allProcPrivatePageCount)+=2;
+							break;
+						case 0: // it was already private
+							break; 
+						default: // >=2 procs still sharing it
+							// increase private page count
+							(*allProcPrivatePageCount)++;
+							ASSERTX(sh_cnt <= *aliveProcs);
+					}
 #endif /* SHARED_STATS */
-			}
+					if(domainInfo)
+						ResetAndReturnBit(nodeTierBV, p);
+				}
 
 
 #ifdef ENABLE_PROFILER
-			if(profileMode == CREATE_PROF){
-				/* dump in file */
-				fprintf(profFile, "%p %d %lu\n", (void*)faultaddr, 0,(unsigned long) time(NULL));
-			}
+				if(profileMode == CREATE_PROF){
+					/* dump in file */
+					fprintf(profFile, "%p %d %lu\n", (void*)p, 0,(unsigned long) time(NULL));
+				}
 #endif /* ENABLE_PROFILER */
+			}
 
 #ifdef MREMAP_FIXED
 			//
@@ -1086,31 +2455,50 @@ void SigSegvHandler(int32_t signo, siginfo_t *si , void *sc) {
 			// void * mremap(void *old_address, size_t old_size , size_t new_size, int
 			// 		flags, void *new_address); 
 			// with flags MREMAP_MAYMOVE | MREMAP_FIXED and using fault addr as new_address.
+			// A run of pages found by FaultAroundPages() is handled at once.
+			//
+
+			// Pre-faulted zero filled pages from the page pool are used when
+			// available, saving an mmap and the first touch of the new pages.
 			//
+			void *pool_pages = NULL;
+			if(is_zero_page || is_shared_page)
+				pool_pages = PopPoolPages(run_pages);
 
-			if(is_zero_page){
+			if(is_zero_page && pool_pages){
+
+				void *p = mremap(pool_pages, run_size, run_size, MREMAP_MAYMOVE | MREMAP_FIXED, faultaddr);
+				CheckForError();
+				if(p == MAP_FAILED || p != faultaddr)
+					ReleaseSharedLock();
+				ASSERTX(p != MAP_FAILED);
+
+			} else if(is_zero_page){
 
 				// no need for munmap as MAP_FIXED replaced previous mapping 
-				void *p =  SH_MMAP(faultaddr, PAGE_SIZE, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_FIXED, -1, 0);
+				void *p =  SH_MMAP(faultaddr, run_size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_FIXED, -1, 0);
 				CheckForError();
 				if(p == MAP_FAILED)
-					SignalSem(mutex);
+					ReleaseSharedLock();
 				ASSERTX(p != MAP_FAILED);
 				memset(p, 0, PAGE_SIZE);
 
 			} else if(is_shared_page){
 
-				void *p =  SH_MMAP(NULL, PAGE_SIZE, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
-				CheckForError();
-				if(p == MAP_FAILED)
-					SignalSem(mutex);
-				ASSERTX(p != MAP_FAILED);
+				void *p = pool_pages;
+				if(p == NULL){
+					p =  SH_MMAP(NULL, run_size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+					CheckForError();
+					if(p == MAP_FAILED)
+						ReleaseSharedLock();
+					ASSERTX(p != MAP_FAILED);
+				}
 
-				memcpy(p, faultaddr, PAGE_SIZE);
-				p = mremap(p, PAGE_SIZE, PAGE_SIZE, MREMAP_MAYMOVE | MREMAP_FIXED, faultaddr);
+				memcpy(p, faultaddr, run_size);
+				p = mremap(p, run_size, run_size, MREMAP_MAYMOVE | MREMAP_FIXED, faultaddr);
 				CheckForError();
 				if(p == MAP_FAILED || p != faultaddr)
-					SignalSem(mutex);
+					ReleaseSharedLock();
 				ASSERTX(p != MAP_FAILED);
 			}
 #else
@@ -1130,11 +2518,11 @@ void SigSegvHandler(int32_t signo, siginfo_t *si , void *sc) {
 			ptr = SH_MMAP(faultaddr, PAGE_SIZE, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_FIXED, -1, 0);
 			CheckForError();
 			if(ptr == MAP_FAILED || ptr != faultaddr)
-				SignalSem(mutex);
+				ReleaseSharedLock();
 			ASSERTX(ptr != MAP_FAILED);
 			memcpy(faultaddr, p, PAGE_SIZE);
 #endif
-			SignalSem(mutex);
+			ReleaseSharedLock();
 
 		}
 
@@ -1146,7 +2534,10 @@ void SigSegvHandler(int32_t signo, siginfo_t *si , void *sc) {
 		sigHandlerTime += (mt.GetDiff() ?mt.GetDiff() :1);
 #endif /*MICROTIME_STAT */
 
-		if(mergeMetric == THRESHOLD){
+		inFaultHandler = 1;
+		if(mergeMetric == ADAPTIVE){
+			MergeByADAPTIVE();
+		}else if(mergeMetric == THRESHOLD){
 //			static int counter = 1000;
 
 //			if(--counter == 0)
@@ -1157,17 +2548,18 @@ void SigSegvHandler(int32_t signo, siginfo_t *si , void *sc) {
 				MergeByTHRESHOLD();
 			}
 		}
+		inFaultHandler = 0;
 		errno = saved_errno;
 	}
 	else{
 #ifdef PRINT_DEBUG_MSG
-		WaitSem(mutex);
+		AcquireSharedLock();
 		fprintf(stderr, "error code: %d, sigsegv for accessing %p\n",(int) si->si_code, faultaddr);
 		fprintf(stderr, "errno: %d\n", (int) si->si_code);
 		fflush(stderr);
 //		ReportError(faultaddr);
 		backtrace_symbols_fd(array, size, 2);
-		SignalSem(mutex);
+		ReleaseSharedLock();
 #endif /* PRINT_DEBUG_MSG */
 		Fatal();
 	}
@@ -1177,6 +2569,107 @@ void SigSegvHandler(int32_t signo, siginfo_t *si , void *sc) {
 #endif /* PRINT_DEBUG_MSG */
 }
 
+/* Takes a run of pages from the top of the page pool, NULL if not enough */
+inline void *PopPoolPages(int num_pages){
+	if(pagePoolPages < num_pages)
+		return NULL;
+	pagePoolPages -= num_pages;
+	if(pagePoolPages > 0)
+		mmapCount += 1; /* pool mapping is split, else it is handed over */
+	return pagePool + (size_t)pagePoolPages * PAGE_SIZE;
+}
+
+/* Fills up the page pool with pre-faulted pages. Called at malloc only, never
+ * from the fault handler. The handler of another thread takes pages from the
+ * pool under the shared lock, so the pool is changed under it too. */
+void RefillPagePool(){
+	if(pagePoolPages >= pagePoolSize/2) /* unlocked hint, checked again below */
+		return;
+
+	int saved_errno = errno;
+	errno = 0;
+	AcquireSharedLock();
+	if(pagePoolPages >= pagePoolSize/2){
+		ReleaseSharedLock();
+		errno = saved_errno;
+		return;
+	}
+	size_t old_size = (size_t)pagePoolPages * PAGE_SIZE;
+	size_t new_size = (size_t)pagePoolSize * PAGE_SIZE;
+	char *p;
+
+	//
+	// The pool is kept right below the shared heap so that it does not take
+	// addresses of allocations, which must stay the same across tasks to be
+	// merged. Pages are used from the top, so it grows back in place.
+	//
+	if(pagePoolPages == 0){
+#if defined __x86_64__
+		void *hint = (void *)(sharedHeapBottom - new_size);
+#else
+		void *hint = NULL;
+#endif /* __x86_64__ */
+		p = (char *)SH_MMAP(hint, new_size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_POPULATE, -1, 0);
+#if defined __x86_64__
+		if(p != MAP_FAILED && p != hint){ /* may be inside the heap, give up on pool */
+			ASSERTX(SH_UNMAP(p, new_size) == 0);
+			pagePoolSize = 0;
+			p = (char *)MAP_FAILED;
+		}
+#endif /* __x86_64__ */
+	}else{
+		p = (char *)mremap(pagePool, old_size, new_size, 0);
+		if(p != MAP_FAILED){
+			for(size_t i = old_size; i < new_size; i += PAGE_SIZE)
+				((volatile char *)p)[i] = 0; /* fault in now, not at unmerge */
+		}
+	}
+	if(p != MAP_FAILED){ /* else keep what is left, handler falls back to mmap */
+		pagePool = p;
+		pagePoolPages = pagePoolSize;
+	}
+	ReleaseSharedLock();
+	errno = saved_errno;
+}
+
+/* Finds how many pages starting at faultaddr to unmerge together */
+int FaultAroundPages(char *faultaddr, bool is_zero_page){
+	static __thread char *nextFaultAddr = NULL; /* page right after the last run of the thread */
+	static __thread int runLength = 1;
+
+	if(faultaddr == nextFaultAddr){ /* sequential write, grow the run */
+		runLength = (runLength == 1)? 16: runLength * 4;
+	}else{
+		runLength = 1;
+	}
+	if(runLength > faultAroundMax)
+		runLength = faultAroundMax;
+
+	if(runLength > 1){ /* stay within the region of the faulting page */
+		AVLTreeNode *node = (AVLTreeNode *)AspaceAvlSearchRangeWrapper(ptr2offset(faultaddr));
+		uintptr_t region_pages = (node? (ptr2offset(node->key) + ptr2offset(node->value) - ptr2offset(faultaddr)) >> log2PAGE_SIZE: 1);
+		if((uintptr_t)runLength > region_pages)
+			runLength = (int)region_pages;
+	}
+
+	int n = 1;
+	for(char *p = faultaddr + PAGE_SIZE; n < runLength; p += PAGE_SIZE, n++){
+#ifdef COLLECT_MALLOC_STAT
+		if(!GetBit(initializedPagesBV, p))
+			break;
+#endif /* COLLECT_MALLOC_STAT */
+		bool is_zero = GetBit(zeroPagesBV, p);
+		if(is_zero_page){
+			if(!is_zero)
+				break;
+		}else if(is_zero || !GetSharingBit(p)){
+			break;
+		}
+	}
+	nextFaultAddr = faultaddr + n * PAGE_SIZE;
+	return n;
+}
+
 /* SIGINT signal handler */
 void SigIntHandler(int32_t signo, siginfo_t *si , void *sc) {
 	sigset_t set;
@@ -1230,6 +2723,14 @@ inline uintptr_t Addr2PageIndex(void *address){
 // 	return TranslateMmapAddr((uintptr_t)address)/PAGE_SIZE;
 }
 
+/* Translates page address to the index of its sharing bits */
+inline uintptr_t SlotIndex(void *address){
+	uintptr_t index = Addr2PageIndex(address);
+	if(domainInfo && GetBit(nodeTierBV, (char *)address))
+		index += SLOTS_PER_TIER; /* node wide slot */
+	return index;
+}
+
 /* Counts the number of tasks sharing a page. */
 int CountSharingProcs(void *addr) {
 	if(sharingProcessesInfo){
@@ -1237,21 +2738,18 @@ int CountSharingProcs(void *addr) {
 		MicroTimer mt;
 		mt.Start();
 #endif /*MICROTIME_STAT */
-		uintptr_t index	= Addr2PageIndex(addr);
+		uintptr_t index	= SlotIndex(addr);
 
 #ifdef ENABLE_CHECKS
-		if(index >= 3* 1024 * 256){
+		if(index >= 2 * SLOTS_PER_TIER){
 			ReportError(addr);
 			return 0;
 		}
-		ASSERTX(numProc == 8 || numProc == 16);
+		ASSERTX(numProc == 8 || numProc == 16 || numProc == 32 || numProc == 64);
 #endif
 
 
-		int x = (numProc == 8
-				? *((uint8_t *) sharingProcessesInfo + index)
-				: *((uint16_t *) sharingProcessesInfo + index)
-				);
+		unsigned long x = GetSharingBits(index);
 
 		int count	= 0;
 		for (count=0; x; count++)
@@ -1266,28 +2764,31 @@ int CountSharingProcs(void *addr) {
 }
 
 /* Sets the sharing bit corresponding to page having address addr for currest
- * process*/
+ * process. Bits of node wide slots are changed under the locks of different
+ * domains, so bits are set and unset atomically. */
 inline void SetSharingBit(void *addr){
 	if(sharingProcessesInfo){
 #ifdef MICROTIME_STAT
 		MicroTimer mt;
 		mt.Start();
 #endif /*MICROTIME_STAT */
-		uintptr_t index	= Addr2PageIndex(addr);
+		uintptr_t index	= SlotIndex(addr);
 
 #ifdef ENABLE_CHECKS
-		if(index >= 3* 1024 * 256){
+		if(index >= 2 * SLOTS_PER_TIER){
 			ReportError(addr);
 			return ;
 		}
 #endif
 
-		if(numProc == 8){
-			*((uint8_t *) sharingProcessesInfo + index) |= currProcMask;
-		}else if(numProc == 16){
-			*((uint16_t *) sharingProcessesInfo + index) |= currProcMask;
-		}else{
-			die("error: these many processors are not supported\n");
+		SetSharingBits(index, TaskBit(index));
+		if(taskSlots && myRank < MAX_NODE_TASKS){
+			/* only changed by the task itself, read after it died */
+			SlotRange *range = &taskSlots[myRank][index >= SLOTS_PER_TIER];
+			if(!range->high || index < range->low)
+				range->low = (uint32_t) index;
+			if(index >= range->high)
+				range->high = (uint32_t) index + 1;
 		}
 
 #ifdef MICROTIME_STAT
@@ -1307,21 +2808,15 @@ inline void UnsetSharingBit(void *addr){
 		MicroTimer mt;
 		mt.Start();
 #endif /*MICROTIME_STAT */
-		uintptr_t index = Addr2PageIndex(addr);
+		uintptr_t index = SlotIndex(addr);
 		
 #ifdef ENABLE_CHECKS
-		if(index >= 3* 1024 * 256){
+		if(index >= 2 * SLOTS_PER_TIER){
 			ReportError(addr);
 			return ;
 		}
 #endif
-		if(numProc == 8){
-			*((uint8_t *) sharingProcessesInfo + index) &= currProcMaskInverted;
-		}else if(numProc == 16){
-			*((uint16_t *) sharingProcessesInfo + index) &= currProcMaskInverted;
-		}else{
-			die("error: these many processors are not supported\n");
-		}
+		ClearSharingBits(index, TaskBit(index));
 #ifdef MICROTIME_STAT
 		mt.Stop();
 		bitOpTime += (mt.GetDiff()?mt.GetDiff():1);
@@ -1338,10 +2833,10 @@ inline bool GetSharingBit(void *addr){
 		MicroTimer mt;
 		mt.Start();
 #endif /*MICROTIME_STAT */
-		uintptr_t index	= Addr2PageIndex(addr);
+		uintptr_t index	= SlotIndex(addr);
 
 #ifdef ENABLE_CHECKS
-		if(index >= 3* 1024 * 256){
+		if(index >= 2 * SLOTS_PER_TIER){
 			ReportError(addr);
 			return false;
 		}
@@ -1352,13 +2847,7 @@ inline bool GetSharingBit(void *addr){
 		mt.Stop();
 		bitOpTime += (mt.GetDiff()?mt.GetDiff():1);
 #endif /*MICROTIME_STAT */
-		if(numProc == 8){
-			return (*((uint8_t *) sharingProcessesInfo + index) & currProcMask);
-		}else if(numProc == 16){
-			return (*((uint16_t *) sharingProcessesInfo + index) & currProcMask);
-		}else{
-			die("error: these many processors are not supported\n");
-		}
+		return (GetSharingBits(index) & TaskBit(index));
 	}
 	return false;
 }
@@ -1372,10 +2861,10 @@ inline bool IsOtherSharing(void *addr){
 		MicroTimer mt;
 		mt.Start();
 #endif /*MICROTIME_STAT */
-		uintptr_t index	= Addr2PageIndex(addr);
+		uintptr_t index	= SlotIndex(addr);
 
 #ifdef ENABLE_CHECKS
-		if(index >= 3* 1024 * 256){
+		if(index >= 2 * SLOTS_PER_TIER){
 			ReportError(addr);
 			return false;
 		}
@@ -1384,13 +2873,7 @@ inline bool IsOtherSharing(void *addr){
 		mt.Stop();
 		bitOpTime += (mt.GetDiff()?mt.GetDiff():1);
 #endif /*MICROTIME_STAT */
-		if(numProc == 8){
-			return (*((uint8_t *) sharingProcessesInfo + index) & currProcMaskInverted);
-		}else if(numProc == 16){
-			return (*((uint16_t *) sharingProcessesInfo + index) & currProcMaskInverted);
-		}else {
-			die("error: these many processors are not supported\n");
-		}
+		return (GetSharingBits(index) & ~TaskBit(index));
 	}
 	return false;
 }
@@ -1430,7 +2913,8 @@ inline void SetBit(char *array, char *page_address){
 		return ;
 	}
 #endif
-	array[index >> 3] |= (0x01 << (index & 0x07));
+	/* atomic, bits of the same byte are set by the handler of other threads */
+	__sync_fetch_and_or(array + (index >> 3), (char)(0x01 << (index & 0x07)));
 #ifdef MICROTIME_STAT
 	mt.Stop();
 	bitOpTime += (mt.GetDiff()?mt.GetDiff():1);
@@ -1479,7 +2963,7 @@ void SetMultiBits(char *array, char *page_address, size_t size){
 			index += 8;
 			bsize -= 8;
 		}else{
-			array[index >> 3] |= (0x01 << (index & 0x07));
+			__sync_fetch_and_or(array + (index >> 3), (char)(0x01 << (index & 0x07)));
 			index++;
 			bsize--;
 		}
@@ -1491,6 +2975,53 @@ void SetMultiBits(char *array, char *page_address, size_t size){
 }
 
 
+/* Resets bits of a region, returns if any of them was set */
+bool TestAndResetMultiBits(char *array, char *page_address, size_t size){
+#ifdef MICROTIME_STAT
+	MicroTimer mt;
+	mt.Start();
+#endif /*MICROTIME_STAT */
+	uintptr_t index	= Addr2PageIndex((void*)page_address);
+	uintptr_t bsize = size >> log2PAGE_SIZE;
+	char found = 0;
+
+#ifdef ENABLE_CHECKS
+	if((index+bsize) > 98304*8){
+		ReportError(page_address);
+		return false;
+	}
+#endif
+	/* bits are reset atomically, the handler of another thread may set bits
+	 * of the same bytes meanwhile */
+	while(bsize > 0 && (index & 0x07)){ /* leading bits */
+		char mask = (char)(0x01 << (index & 0x07));
+		found |= (__sync_fetch_and_and(array + (index >> 3), (char)~mask) & mask);
+		index++;
+		bsize--;
+	}
+	if(bsize >= 8){ /* whole bytes, only those with bits set are written */
+		char *b = array + (index >> 3);
+		uintptr_t nbytes = bsize >> 3;
+		for(uintptr_t i = 0; i < nbytes; i++){
+			if(b[i])
+				found |= __sync_fetch_and_and(b + i, (char)0);
+		}
+		index += nbytes << 3;
+		bsize -= nbytes << 3;
+	}
+	while(bsize > 0){ /* trailing bits */
+		char mask = (char)(0x01 << (index & 0x07));
+		found |= (__sync_fetch_and_and(array + (index >> 3), (char)~mask) & mask);
+		index++;
+		bsize--;
+	}
+#ifdef MICROTIME_STAT
+	mt.Stop();
+	bitOpTime += (mt.GetDiff()?mt.GetDiff():1);
+#endif /*MICROTIME_STAT */
+	return found != 0;
+}
+
 /* Sets and returns old value of bit in array corresponding to page address */
 inline bool SetAndReturnBit(char *array, char *page_address){
 #ifdef MICROTIME_STAT
@@ -1600,60 +3131,321 @@ inline int MyComparator(const void *key1, const void * key2){
 /*===============================================================================*/
 /*                                Profile guided merge                           */
 /*===============================================================================*/
-#ifdef PROFILE_BASED_MERGE
+/* Returns monotonic time in microseconds */
+uint64_t GetMonotonicTime(){
+	struct timespec ts;
+	if(clock_gettime(CLOCK_MONOTONIC, &ts) == -1)
+		die("clock_gettime");
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
 /* Checks merge profile to decide if the page should be merged */
-bool CheckIfMergeable(void *pageAddr, uint32_t currTime){
-	int index = Addr2PageIndex(pageAddr);
-	bool isMergeable = true;
-	/* check if it can be merged */
+bool CheckIfMergeable(void *pageAddr, uint64_t currTime){
+	uintptr_t index = Addr2PageIndex(pageAddr);
+	uint8_t hist = mergeSuccHist[index];
+
+	/* back off exponentially on consecutive failed merges, latest at MSB */
+	int failures = 0;
+	while(hist & 0x80){
+		failures++;
+		hist <<= 1;
+	}
+	if(failures && (currTime - lastMergeTime[index]) < ((uint64_t)mergeStableMs * 1000 << failures))
+		return false;
+	return true;
+}
+
+/* Records the merge time of pages just remapped to shared or zero pages */
+void RecordMergeTime(void *start, size_t size){
+	if(!mergeSuccHist)
+		return;
+	uint64_t curr_time = GetMonotonicTime();
+	uintptr_t index = Addr2PageIndex(start);
+	for(size_t i = 0; i < (size >> log2PAGE_SIZE); i++)
+		lastMergeTime[index + i] = curr_time;
+}
 
-	if((currTime - lastMergeTime[index]) < mergeCostPerPage *10){
-		isMergeable = false;
+/* Updates merge profile. */
+void UpdateMergeHist(void *pageAddr, uint64_t currTime){
+	uintptr_t index = Addr2PageIndex(pageAddr);
+	mergeSuccHist[index] >>= 1;
+	if((currTime - lastMergeTime[index]) < (uint64_t)mergeStableMs * 1000)
+		mergeSuccHist[index] |= 0x80; /* bit-OR 1 to indicate unstable merge */
+	lastMergeTime[index] = currTime; /* update split time so that in next merge we can use it */
+}
+
+/* Zeroes a span of a history array, whole pages are dropped instead of
+ * being faulted in */
+static void ClearHistSpan(void *start, size_t len){
+	char *p = (char *)start;
+	char *end = p + len;
+	char *lo = (char *)(((uintptr_t)p + PAGE_SIZE - 1) & ~((uintptr_t)PAGE_SIZE - 1));
+	char *hi = (char *)((uintptr_t)end & ~((uintptr_t)PAGE_SIZE - 1));
+	if(lo >= hi){
+		memset(p, 0, len);
+		return;
 	}
-	else{
-#if PROF_MERGE_VERSION > 0
-		uint32_t mergeTime = 10* mergeCostPerPage;
-		uint32_t total_merge_time = mergeTime;
-
-		uint8_t hist = mergeSuccHist[index];
-		while(hist){
-			if(hist & 0x80){
-				total_merge_time += mergeTime;
-#if PROF_MERGE_VERSION == 2
-				mergeTime <<= 1; /* double it */
-			}else {
-				if(mergeTime > 1)
-					mergeTime >>= 1; /* 1/2 it */
-#endif /* PROF_MERGE_VERSION == 2 */
+	int saved_errno = errno;
+	memset(p, 0, lo - p);
+	if(madvise(lo, hi - lo, MADV_DONTNEED) != 0)
+		memset(lo, 0, hi - lo);
+	memset(hi, 0, end - hi);
+	errno = saved_errno;
+}
+
+/* Forgets merge profile of a freed region */
+void ResetMergeHist(void *start, size_t size){
+	uintptr_t index = Addr2PageIndex(start);
+	size_t num_pages = size >> log2PAGE_SIZE;
+	ClearHistSpan(mergeSuccHist + index, num_pages);
+	ClearHistSpan(lastMergeTime + index, num_pages * sizeof(uint64_t));
+}
+
+/*===============================================================================*/
+/*                                  Merge profile                                */
+/*===============================================================================*/
+/*
+ * With PROFILE_MODE=1, pages of a region that are still merged when it is
+ * freed (or at MPI_Finalize()) are recorded as runs relative to the start of
+ * the region, under its allocation site. The table is written in binary to
+ * mergeprofile.<rank>:
+ *   header: uint32 magic, version, page size, number of sites
+ *   site  : uint64 key, scanned pages, merged pages; uint32 number of runs,
+ *           policy; ProfRun runs[number of runs]
+ * With PROFILE_MODE=2 the table is loaded. Regions from sites that never
+ * merged are not scanned, and only the recorded runs of other profiled sites
+ * are, without waiting for the merge threshold.
+ */
+
+/* Maps the profile table and loads it if it is used */
+void InitMergeProfile(){
+	int saved_errno = errno;
+	errno = 0;
+	profSites = (ProfSite *) SH_MMAP(NULL, MAX_PROF_SITES * sizeof(ProfSite), PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+	ASSERTX(profSites != MAP_FAILED);
+
+	if(profileMode == USE_PROF){
+		char file_name[32];
+		uint32_t header[4];
+		sprintf(file_name, "mergeprofile.%d", myRank);
+		FILE *fp = fopen(file_name, "rb");
+		bool valid = (fp != NULL);
+
+		if(valid){
+			valid = (fread(header, sizeof(header), 1, fp) == 1 &&
+					header[0] == PROF_MAGIC && header[1] == PROF_VERSION &&
+					header[2] == (uint32_t)PAGE_SIZE);
+		}
+		for(uint32_t i = 0; valid && i < header[3]; i++){
+			ProfSite site;
+			valid = (fread(&site, offsetof(ProfSite, runs), 1, fp) == 1 &&
+					site.numRuns <= MAX_PROF_RUNS &&
+					fread(site.runs, sizeof(ProfRun), site.numRuns, fp) == site.numRuns);
+			int index = (valid? FindProfSite(site.key, true): -1);
+			if(index < 0)
+				continue;
+			memcpy(profSites + index, &site, offsetof(ProfSite, runs) + site.numRuns * sizeof(ProfRun));
+			profSites[index].policy = (site.mergedPages? POLICY_EAGER: POLICY_SKIP);
+		}
+		if(fp)
+			fclose(fp);
+		if(!valid){
+			warn("could not use merge profile, merging as usual\n");
+			memset(profSites, 0, MAX_PROF_SITES * sizeof(ProfSite));
+			profileMode = NONE;
+		}
+	}
+	errno = saved_errno;
+}
+
+/* Finds the profile key of an allocation site */
+uint64_t SiteKey(uintptr_t creator){
+	Dl_info info;
+	uint64_t key = 14695981039346656037ULL; /* FNV-1a */
+	uintptr_t offset = creator;
+
+	if(creator && dladdr((void *)creator, &info) && info.dli_fname){
+		const char *name = strrchr(info.dli_fname, '/');
+		for(name = (name? name + 1: info.dli_fname); *name; name++){
+			key ^= (uint8_t)*name;
+			key *= 1099511628211ULL;
+		}
+		offset = creator - (uintptr_t)info.dli_fbase;
+	}
+	for(int i = 0; i < 8; i++){
+		key ^= (offset >> (8 * i)) & 0xff;
+		key *= 1099511628211ULL;
+	}
+	return (key? key: 1); /* 0 marks an unused entry */
+}
+
+/* Finds the profile entry of a site */
+int FindProfSite(uint64_t key, bool create){
+	int index = (int)(key & (MAX_PROF_SITES - 1));
+	for(int i = 0; i < MAX_PROF_SITES; i++, index = (index + 1) & (MAX_PROF_SITES - 1)){
+		if(profSites[index].key == key)
+			return index;
+		if(profSites[index].key == 0){
+			if(!create)
+				return -1;
+			profSites[index].key = key;
+			return index;
+		}
+	}
+	return -1; /* table is full */
+}
+
+/* Sorts and coalesces runs of a site, keeping at most max_runs of them */
+void CompactProfRuns(ProfSite *site, uint32_t max_runs){
+	ProfRun *runs = site->runs;
+	uint32_t n = site->numRuns;
+	if(n == 0)
+		return;
+
+	for(uint32_t i = 1; i < n; i++){ /* few runs, insertion sort */
+		ProfRun r = runs[i];
+		uint32_t j = i;
+		for(; j > 0 && runs[j-1].startPage > r.startPage; j--)
+			runs[j] = runs[j-1];
+		runs[j] = r;
+	}
+
+	uint32_t last = 0;
+	for(uint32_t i = 1; i < n; i++){
+		uint32_t end = runs[last].startPage + runs[last].numPages;
+		if(runs[i].startPage <= end){ /* overlapping or adjacent */
+			uint32_t i_end = runs[i].startPage + runs[i].numPages;
+			if(i_end > end)
+				runs[last].numPages = i_end - runs[last].startPage;
+		}else{
+			runs[++last] = runs[i];
+		}
+	}
+	n = last + 1;
+
+	/* profile is a hint, scanning a few more pages is fine */
+	while(n > max_runs){
+		uint32_t k = 0, min_gap = (uint32_t)(-1);
+		for(uint32_t i = 0; i + 1 < n; i++){
+			uint32_t gap = runs[i+1].startPage - (runs[i].startPage + runs[i].numPages);
+			if(gap < min_gap){
+				min_gap = gap;
+				k = i;
 			}
-#if PROF_MERGE_VERSION == 1
-			mergeTime >>= 1;
-#endif /* PROF_MERGE_VERSION == 1*/
-			hist <<= 1;
+		}
+		runs[k].numPages = runs[k+1].startPage + runs[k+1].numPages - runs[k].startPage;
+		memmove(runs + k + 1, runs + k + 2, (n - k - 2) * sizeof(ProfRun));
+		n--;
+	}
+	site->numRuns = n;
+}
 
+/* Records which pages of a region are merged */
+void RecordMergeProfile(uintptr_t start, size_t size, uintptr_t creator){
+	int index = FindProfSite(SiteKey(creator), true);
+	if(index < 0)
+		return;
+	ProfSite *site = profSites + index;
+	uint32_t num_pages = size >> log2PAGE_SIZE;
+	uint32_t run_start = 0;
+	bool in_run = false;
+
+	site->scannedPages += num_pages;
+	for(uint32_t i = 0; i <= num_pages; i++){
+		bool is_merged = false;
+		if(i < num_pages){
+			char *p = (char *)offset2ptr(start + ((uintptr_t)i << log2PAGE_SIZE));
+			is_merged = (GetBit(zeroPagesBV, p) || GetSharingBit(p));
 		}
-		if((currTime - lastMergeTime[index]) < total_merge_time){
-			isMergeable = false;
+		if(is_merged && !in_run){
+			run_start = i;
+			in_run = true;
+		}else if(!is_merged && in_run){
+			if(site->numRuns == MAX_PROF_RUNS)
+				CompactProfRuns(site, MAX_PROF_RUNS/2);
+			site->runs[site->numRuns].startPage = run_start;
+			site->runs[site->numRuns].numPages = i - run_start;
+			site->numRuns++;
+			site->mergedPages += i - run_start;
+			in_run = false;
 		}
+	}
+}
 
-#endif /* PROF_MERGE_VERSION > 0 */
+/* Records merge profile of a region while traversing the AVL tree */
+void RecordProfNode(const void *key, const void *value, const void *data, void *isDirty){
+	if(POLICY_OF(((const AVLTreeNode *)data)->policy) == POLICY_ARENA)
+		return; /* not allocated by the application */
+	if(((const AVLTreeNode *)data)->stackId == UNKNOWN_STACK_ID)
+		return; /* site not known */
+	RecordMergeProfile(ptr2offset(key), (size_t)ptr2offset(value), LookupCallStack(((const AVLTreeNode *)data)->stackId)->creator);
+}
+
+/* Writes profile table to mergeprofile.<rank> */
+void WriteMergeProfile(){
+	int saved_errno = errno;
+	errno = 0;
+	char file_name[32];
+	sprintf(file_name, "mergeprofile.%d", myRank);
+	FILE *fp = fopen(file_name, "wb");
+	if(!fp){
+		warn("could not write merge profile\n");
+		errno = saved_errno;
+		return;
 	}
 
-	if(isMergeable)
-		lastMergeTime[index] = currTime; 
-	return isMergeable;
+	uint32_t header[4] = {PROF_MAGIC, PROF_VERSION, (uint32_t)PAGE_SIZE, 0};
+	for(int i = 0; i < MAX_PROF_SITES; i++)
+		if(profSites[i].key)
+			header[3]++;
+	fwrite(header, sizeof(header), 1, fp);
+
+	for(int i = 0; i < MAX_PROF_SITES; i++){
+		ProfSite *site = profSites + i;
+		if(!site->key)
+			continue;
+		CompactProfRuns(site, MAX_PROF_RUNS);
+		site->policy = (site->mergedPages? POLICY_EAGER: POLICY_SKIP);
+		fwrite(site, offsetof(ProfSite, runs), 1, fp);
+		fwrite(site->runs, sizeof(ProfRun), site->numRuns, fp);
+	}
+	fclose(fp);
+	errno = saved_errno;
 }
 
-/* Updates merge profile. */
-void UpdateMergeHist(void *pageAddr, uint32_t currTime){
-	int index = Addr2PageIndex(pageAddr);
-	mergeSuccHist[index] >>= 1;
-	if((currTime - lastMergeTime[index]) < mergeCostPerPage * 10)
-		mergeSuccHist[index] |= 0x80; /* bit-OR 1 to indicate unstable merge */
-	lastMergeTime[index] = currTime; /* update split time so that in next merge we can use it */
+/* Merges the profiled runs of pages of a part of a region */
+int MergeProfRuns(const AVLTreeNode *node, uintptr_t addr, size_t size){
+	uintptr_t region_addr = ptr2offset(node->key);
+	uint32_t begin = (addr - region_addr) >> log2PAGE_SIZE;
+	uint32_t end = begin + (size >> log2PAGE_SIZE);
+	const ProfSite *site = profSites + POLICY_SITE(node->policy);
+	int merged_pages = 0;
+
+	for(uint32_t r = 0; r < site->numRuns; r++){ /* runs are sorted */
+		uint32_t first = site->runs[r].startPage;
+		uint32_t last = first + site->runs[r].numPages;
+		if(first >= end)
+			break;
+		if(first < begin)
+			first = begin;
+		if(last > end)
+			last = end;
+		if(first >= last)
+			continue;
+		merged_pages += MergeManyPages(region_addr + ((uintptr_t)first << log2PAGE_SIZE),
+				(size_t)(last - first) << log2PAGE_SIZE, LookupCallStack(node->stackId)->frames[0]);
+	}
+	return merged_pages;
 }
 
-#endif /* PROFILE_BASED_MERGE */
+/* Merges regions with eager policy */
+void MergeEagerRegions(){
+	for(int i = 0; i < numEagerRegions; i++){
+		AVLTreeNode *node = (AVLTreeNode *)AspaceAvlSearchRangeWrapper(eagerRegions[i]);
+		if(node && ptr2offset(node->key) == eagerRegions[i])
+			MergeNode2(node->key, node->value, node, NULL);
+	}
+}
 
 
 /*===============================================================================*/
@@ -1696,10 +3488,7 @@ void MergeByALLOC_FREQUENCY(){
 
 		/* merge all pages */
 		{
-			/* if the mode is profiling or none */
-#ifdef ENABLE_PROFILER
-			if(profileMode != USE_PROF)
-#endif /* ENABLE_PROFILER */
+			/* merge policies of the profile are applied in MergeNode2() */
 			{
 #ifdef PART_BLOCK_MERGE_STAT
 				localDiffPageCount = 0;
@@ -1723,34 +3512,13 @@ void MergeByALLOC_FREQUENCY(){
 						/* print part mergeable stats: end */
 #endif /* !PART_BLOCK_MERGE_STAT */
 #ifdef SHARED_STATS		
-						fprintf(profFile, " %d", *sharedPageCount);
+						fprintf(profFile, " %d", NodeTotal(sharedPageCount));
 						fprintf(profFile, "\n");
 #endif /* !SHARED_STATS	*/
 					}
 				}
 #endif /* ENABLE_PROFILER */
 			}
-#ifdef ENABLE_PROFILER
-			else{
-				/* else if the mode is profile guided merging */
-				uintptr_t aAddr;
-				int32_t status;
-				while(true){
-					if(profFile){
-						fscanf(profFile, "%lx", &aAddr);
-						if(!aAddr)
-							break; /* end of one epoch */
-
-						fscanf(profFile, "%d", &status);
-						if(AspaceAvlSearchRangeWrapper(aAddr))
-							MergePages((void*)aAddr, 0);
-						else 
-							fprintf(stderr, ".");
-					}else
-						break;
-				}
-			}
-#endif /* ENABLE_PROFILER */
 		}
 		mallocRefCounter=0;
 		StoreMemUsageStat();
@@ -1761,6 +3529,133 @@ void MergeByALLOC_FREQUENCY(){
 /*                               Threshold based merge                           */
 /*===============================================================================*/
 
+/* Merges regions from mergeCursor on until the budget is used up */
+bool MergeSlice(long budget_pages, long budget_usec){
+	uint64_t start_time = (budget_usec > 0? GetMonotonicTime(): 0);
+	long pages = 0;
+
+	while(true){
+		AVLTreeNode *node = (AVLTreeNode *)AspaceAvlSearchRangeWrapper(mergeCursor);
+		if(!node)
+			node = (AVLTreeNode *)FindNextAVL((AVLTree *)allocRecord, offset2ptr(mergeCursor));
+		if(!node){ /* went past the last region, pass is complete */
+			mergeCursor = 0;
+			return true;
+		}
+
+		uintptr_t addr = ptr2offset(node->key);
+		uintptr_t end = addr + ptr2offset(node->value);
+		if(end == addr){ /* arena segment unmapped during the pass */
+			mergeCursor = addr + 1;
+			continue;
+		}
+		if(mergeCursor > addr)
+			addr = mergeCursor; /* resume in the middle of the region */
+		size_t size = end - addr;
+		uintptr_t busy_end;
+		if(IsMPIBufferBusy(addr, &size, &busy_end)){
+			mergeCursor = busy_end; /* MPI may be accessing it */
+			continue;
+		}
+		if(budget_usec > 0 && size > (size_t)MERGE_SLICE_CHUNK * PAGE_SIZE)
+			size = (size_t)MERGE_SLICE_CHUNK * PAGE_SIZE; /* check time every chunk */
+		if(budget_pages > 0 && size > (size_t)(budget_pages - pages) * PAGE_SIZE)
+			size = (size_t)(budget_pages - pages) * PAGE_SIZE;
+
+		MergeRegion(node, addr, size);
+		mergeCursor = addr + size;
+		pages += size >> log2PAGE_SIZE;
+
+		if(budget_pages > 0 && pages >= budget_pages)
+			return false;
+		if(budget_usec > 0 && (GetMonotonicTime() - start_time) >= (uint64_t)budget_usec)
+			return false;
+	}
+}
+
+/* Runs a slice of merge pass, returns true if the pass is complete */
+bool RunMergePass(long budget_pages, long budget_usec){
+#ifdef MICROTIME_STAT
+	MicroTimer mt;
+	mt.Start();
+#endif /*MICROTIME_STAT */
+
+	SyncArenaSegments();
+	if(mergeCursor == 0){ /* new pass */
+		StoreMemUsageStat();
+#ifdef REPORT_MERGES
+		numDirtyPages = numCleanPages = 0;
+		totalProcessedPages = newlyMovedPages = newZeroPages = newlyMergedPages = 0;
+#endif /* REPORT_MERGES */
+
+#ifdef PART_BLOCK_MERGE_STAT
+		localDiffPageCount = 0;
+		localComparedPageCount = 0;
+		localSharedPageCount = 0;
+		localPageCount = 0;
+		localZeroPageCount=0;
+		// reset stats
+		memset(partBlockStat, 0, 8*sizeof(int32_t));
+
+#endif /* !PART_BLOCK_MERGE_STAT */
+	}
+
+	passScannedPages = passMergedPages = 0;
+	bool is_complete = MergeSlice(budget_pages, budget_usec);
+
+#ifdef MICROTIME_STAT
+	mt.Stop();
+	fprintf(stderr, "time taken %lu\n", mt.GetDiff());
+	mergeTime+= (mt.GetDiff()?mt.GetDiff():1);
+#endif /*MICROTIME_STAT */
+	if(!is_complete)
+		return false;
+	if(domainInfo)
+		PromoteDomainSlots();
+	
+#ifdef REPORT_MERGES
+	fprintf(stderr, "dirty: %d, clean %d ", numDirtyPages, numCleanPages);
+	fprintf(stderr, "mov: %d, zer: %d, mer: %d, tot: %d\n", newlyMovedPages, newZeroPages, newlyMergedPages, totalProcessedPages);
+#endif /* REPORT_MERGES */
+
+#ifdef ENABLE_PROFILER
+	if(profileMode == CREATE_PROF){
+		if(profFile){
+			fprintf(profFile, "0");
+			fprintf(profFile, " %d", NodeTotal(sharedPageCount));
+#ifdef PART_BLOCK_MERGE_STAT
+			fprintf(profFile, " %d %d %d", localSharedPageCount, localZeroPageCount, localPageCount);
+//				fprintf(profFile, " %d %d", localDiffPageCount, localComparedPageCount);
+
+			/* print part mergeable stats: begin */
+			for(int32_t p_index = 0; p_index < 8; p_index++)
+				fprintf(profFile, " %d", partBlockStat[p_index]);
+			/* print part mergeable stats: end */
+#endif /* !PART_BLOCK_MERGE_STAT */
+			fprintf(profFile, "\n");
+		}
+	}
+#endif /* ENABLE_PROFILER */
+	return true;
+}
+
+/* Checks if a merge pass is in progress or the heap grew past the threshold */
+bool IsMergeDue(){
+	if(mergeCursor != 0) /* pass in progress */
+		return true;
+#ifdef SHARED_STATS
+	long pending_pages = 0;
+#ifdef COLLECT_MALLOC_STAT
+	pending_pages = lazyPendingPages; /* not accounted until a merge pass finds them */
+#endif /* COLLECT_MALLOC_STAT */
+	if((NodeTotal(allProcPrivatePageCount) + NodeTotal(sharedPageCount) + pending_pages) >= mergeMinMemTh){
+		mergeMinMemTh = (NodeTotal(allProcPrivatePageCount) + NodeTotal(sharedPageCount) + pending_pages);
+		return true;
+	}
+#endif /* SHARED_STATS */
+	return false;
+}
+
 /* Merges pages based on threshold */
 void MergeByTHRESHOLD(){
 
@@ -1771,71 +3666,216 @@ void MergeByTHRESHOLD(){
 	else 
 		return;
 
+	if(memPressureTrigger && MergeByPRESSURE())
+		return;
 
 #ifdef SHARED_STATS
-	if(
-			((*allProcPrivatePageCount + *sharedPageCount) >= mergeMinMemTh)
-	  )
-	{
+	if(IsMergeDue()){
+		RunMergePass(mergeSlicePages, mergeSliceUsec);
+	}else if(profileMode == USE_PROF){
+		/* regions known to merge well do not wait for threshold */
+		MergeEagerRegions();
+	}
+#endif /* !SHARED_STATS */
+}
 
-		mergeMinMemTh = (*allProcPrivatePageCount + *sharedPageCount);
 
-#ifdef MICROTIME_STAT
-		MicroTimer mt;
-		mt.Start();
-#endif /*MICROTIME_STAT */
+/*===============================================================================*/
+/*                               Adaptive merge                                  */
+/*===============================================================================*/
 
-		StoreMemUsageStat();
-#ifdef REPORT_MERGES
-		numDirtyPages = numCleanPages = 0;
-		totalProcessedPages = newlyMovedPages = newZeroPages = newlyMergedPages = 0;
-#endif /* REPORT_MERGES */
+/* Merges pages when it is due, keeping merge time a fraction of run time */
+void MergeByADAPTIVE(){
+	static uint64_t nextMergeTime = 0; 	/* when next pass is due */
+	static double costPerPage = 0; 		/* EWMA of pass time per scanned page, usec */
+	static double scannedPerPass = 0; 	/* EWMA of scanned pages per pass */
+	static int backoff = 1; 			/* gap multiplier while yield is low */
+
+	uint64_t now = GetMonotonicTime();
+	if(now < nextMergeTime)
+		return;
+	if(memPressureTrigger && MergeByPRESSURE()){
+		nextMergeTime = now + ADAPTIVE_MIN_GAP_USEC;
+		return;
+	}
+
+#ifdef SHARED_STATS
+	long pending_pages = 0;
+#ifdef COLLECT_MALLOC_STAT
+	pending_pages = lazyPendingPages; /* not accounted until a merge pass finds them */
+#endif /* COLLECT_MALLOC_STAT */
+	if(mergeCursor == 0 && (NodeTotal(allProcPrivatePageCount) + NodeTotal(sharedPageCount) + pending_pages) < mergeMinMemTh){
+		nextMergeTime = now + ADAPTIVE_MIN_GAP_USEC;
+		return;
+	}
+#endif /* SHARED_STATS */
+
+	RunMergePass(mergeSlicePages, mergeSliceUsec);
+
+	uint64_t end = GetMonotonicTime();
+	double duration = (double)(end - now);
+	if(passScannedPages){
+		costPerPage = (costPerPage? 0.75 * costPerPage + 0.25 * (duration / passScannedPages)
+				: duration / passScannedPages);
+	}
+	scannedPerPass = 0.75 * scannedPerPass + 0.25 * passScannedPages;
+
+	/* yield of a pass is the fraction of scanned pages it saved */
+	if(passScannedPages && passMergedPages * 100 >= (long)passScannedPages * ADAPTIVE_LOW_YIELD_PCT)
+		backoff = 1;
+	else if(backoff < ADAPTIVE_MAX_BACKOFF)
+		backoff <<= 1;
+
+	/* merge for d usec, then wait d * (100 - pct) / pct usec */
+	double expected = costPerPage * scannedPerPass;
+	if(expected < duration)
+		expected = duration;
+	uint64_t gap = (uint64_t)(expected * (100 - mergeOverheadPct) / mergeOverheadPct) * backoff;
+	if(gap < ADAPTIVE_MIN_GAP_USEC)
+		gap = ADAPTIVE_MIN_GAP_USEC;
+	nextMergeTime = end + gap;
+}
+
+/*===============================================================================*/
+/*                             Memory pressure merge                             */
+/*===============================================================================*/
+/* Opens cgroup v2 memory files of the task */
+void InitMemPressure(){
+	int saved_errno = errno;
+	char cgroup[PATH_MAX] = "";
+	char path[PATH_MAX + 64];
+	char buf[64];
+
+	/* cgroup v2 has a single line "0::<path>" */
+	FILE *cgroup_file = fopen("/proc/self/cgroup", "r");
+	if(cgroup_file){
+		char line[PATH_MAX + 8];
+		while(fgets(line, sizeof(line), cgroup_file)){
+			if(strncmp(line, "0::", 3) == 0){
+				sscanf(line + 3, "%4095s", cgroup);
+				break;
+			}
+		}
+		fclose(cgroup_file);
+	}
+
+	if(cgroup[0]){
+		snprintf(path, sizeof(path), "/sys/fs/cgroup%s/memory.max", cgroup);
+		int fd = open(path, O_RDONLY);
+		if(fd >= 0){
+			ssize_t len = read(fd, buf, sizeof(buf) - 1);
+			close(fd);
+			if(len > 0){
+				buf[len] = '\0';
+				memLimit = atoll(buf); /* 0 for "max" */
+			}
+		}
+		if(memLimit > 0){
+			snprintf(path, sizeof(path), "/sys/fs/cgroup%s/memory.current", cgroup);
+			memCurrentFd = open(path, O_RDONLY);
+		}
+
+		snprintf(path, sizeof(path), "/sys/fs/cgroup%s/memory.pressure", cgroup);
+		psiFd = open(path, O_RDWR | O_NONBLOCK);
+		if(psiFd >= 0 && write(psiFd, PSI_TRIGGER, strlen(PSI_TRIGGER) + 1) < 0){
+			close(psiFd); /* no PSI support or permission */
+			psiFd = -1;
+		}
+	}
+
+	if(memCurrentFd < 0){ /* no limit for the job, use the node */
+		memLimit = 0;
+		memCurrentFd = open("/proc/meminfo", O_RDONLY);
+		if(memCurrentFd < 0){
+			warn("unable to find memory usage, disabling pressure trigger");
+			memPressureTrigger = 0;
+		}
+	}
+	errno = saved_errno;
+}
 
-#ifdef PART_BLOCK_MERGE_STAT
-		localDiffPageCount = 0;
-		localComparedPageCount = 0;
-		localSharedPageCount = 0;
-		localPageCount = 0;
-		localZeroPageCount=0;
-		// reset stats
-		memset(partBlockStat, 0, 8*sizeof(int32_t));
+/* Reads memory usage and limit */
+bool ReadMemUsage(long long *used, long long *limit){
+	char buf[2048];
+	ssize_t len = pread(memCurrentFd, buf, sizeof(buf) - 1, 0);
+	if(len <= 0)
+		return false;
+	buf[len] = '\0';
 
-#endif /* !PART_BLOCK_MERGE_STAT */
+	if(memLimit){
+		*used = atoll(buf);
+		*limit = memLimit;
+		return true;
+	}
 
-		TraverseAVL((AVLTree* )allocRecord, MergeNode2);
-		
-#ifdef REPORT_MERGES
-		fprintf(stderr, "dirty: %d, clean %d ", numDirtyPages, numCleanPages);
-		fprintf(stderr, "mov: %d, zer: %d, mer: %d, tot: %d\n", newlyMovedPages, newZeroPages, newlyMergedPages, totalProcessedPages);
-#endif /* REPORT_MERGES */
+	char *total = strstr(buf, "MemTotal:");
+	char *available = strstr(buf, "MemAvailable:");
+	if(!total || !available)
+		return false;
+	*limit = atoll(total + strlen("MemTotal:")) * 1024;
+	*used = *limit - atoll(available + strlen("MemAvailable:")) * 1024;
+	return true;
+}
 
-#ifdef MICROTIME_STAT
-		mt.Stop();
-		fprintf(stderr, "time taken %lu\n", mt.GetDiff());
-		mergeTime+= (mt.GetDiff()?mt.GetDiff():1);
-#endif /*MICROTIME_STAT */
-#ifdef ENABLE_PROFILER
-		if(profileMode == CREATE_PROF){
-			if(profFile){
-				fprintf(profFile, "0");
-				fprintf(profFile, " %d", *sharedPageCount);
-#ifdef PART_BLOCK_MERGE_STAT
-				fprintf(profFile, " %d %d %d", localSharedPageCount, localZeroPageCount, localPageCount);
-//				fprintf(profFile, " %d %d", localDiffPageCount, localComparedPageCount);
+/* Finds memory pressure of the job */
+int GetMemPressure(){
+	static uint64_t lastCheckTime = 0;
+	static int pressureLevel = PRESSURE_NORMAL;
 
-				/* print part mergeable stats: begin */
-				for(int32_t p_index = 0; p_index < 8; p_index++)
-					fprintf(profFile, " %d", partBlockStat[p_index]);
-				/* print part mergeable stats: end */
-#endif /* !PART_BLOCK_MERGE_STAT */
-				fprintf(profFile, "\n");
-			}
-		}
-#endif /* ENABLE_PROFILER */
+	uint64_t now = GetMonotonicTime();
+	if(now - lastCheckTime < PRESSURE_CHECK_USEC)
+		return pressureLevel;
+	lastCheckTime = now;
+
+	int saved_errno = errno;
+	long long used, limit;
+	pressureLevel = PRESSURE_NORMAL;
+	if(ReadMemUsage(&used, &limit) && limit > 0){
+		if(used * 100 >= limit * pressureHighPct)
+			pressureLevel = PRESSURE_HIGH;
+		else if(used * 100 < limit * pressureLowPct)
+			pressureLevel = PRESSURE_LOW;
 	}
-#endif /* !SHARED_STATS */
+
+	if(psiFd >= 0){
+		struct pollfd pfd = { psiFd, POLLPRI, 0 };
+		if(poll(&pfd, 1, 0) > 0 && (pfd.revents & POLLPRI))
+			pressureLevel = PRESSURE_HIGH; /* tasks are stalling on memory */
+	}
+	errno = saved_errno;
+	return pressureLevel;
 }
 
+/* Applies memory pressure to a merge metric */
+bool MergeByPRESSURE(){
+	static uint64_t lastPressureMerge = 0;
+	static int backoff = 1; 			/* gap multiplier while yield is low */
+
+	int pressure = GetMemPressure();
+	if(pressure == PRESSURE_LOW)
+		return (mergeCursor == 0); /* let a pass in progress finish */
+	if(pressure == PRESSURE_NORMAL){
+		backoff = 1;
+		return false;
+	}
+
+	uint64_t now = GetMonotonicTime();
+	if(now - lastPressureMerge >= (uint64_t)PRESSURE_CHECK_USEC * backoff){
+		RunMergePass(mergeSlicePages, mergeSliceUsec);
+		lastPressureMerge = GetMonotonicTime();
+
+		/* merging more does not relieve pressure if little is saved */
+		if(passScannedPages && passMergedPages * 100 >= (long)passScannedPages * ADAPTIVE_LOW_YIELD_PCT)
+			backoff = 1;
+		else if(backoff < ADAPTIVE_MAX_BACKOFF)
+			backoff <<= 1;
+#ifdef SHARED_STATS
+		if(mergeCursor == 0) /* pass complete */
+			mergeMinMemTh = NodeTotal(allProcPrivatePageCount) + NodeTotal(sharedPageCount);
+#endif /* SHARED_STATS */
+	}
+	return true;
+}
 
 /*===============================================================================*/
 /*                       Page Permission Modifier Routines                       */
@@ -1899,7 +3939,7 @@ void MergeNode(const void *key, const void *value, const void *data){
 #endif
 		{
 			//			if(t < (3*1024*1024*1024L))
-			MergePages((void*) t, *((uintptr_t *)data)); /* pass creator's address */
+			MergePages((void*) t, (uintptr_t)LookupCallStack(((const AVLTreeNode *)data)->stackId)->frames[0]); /* pass creator's address */
 		}
 	}
 //	fprintf(stderr, " Done\n");
@@ -1909,9 +3949,11 @@ void MergeNode(const void *key, const void *value, const void *data){
 /* a node corresponding to <key, value> pair is checked so that identical data
  * pages can be merged. Merges many pages at once. */
 void MergeNode2(const void *key, const void *value, const void *data, void *isDirty){
-	uintptr_t addr = ptr2offset(key);
-	uintptr_t size = ptr2offset(value);
+	MergeRegion((const AVLTreeNode *)data, ptr2offset(key), (size_t)ptr2offset(value));
+}
 
+/* Merges identical pages of a part of a region */
+void MergeRegion(const AVLTreeNode *node, uintptr_t addr, size_t size){
 	if(! TranslateMmapAddr(addr)){
 		warn("allocated more than 3 GB???");
 		return;
@@ -1926,7 +3968,7 @@ void MergeNode2(const void *key, const void *value, const void *data, void *isDi
 #ifdef PART_BLOCK_MERGE_STAT
 	if(true)
 #else
-	if(isDirty && *((int *)isDirty))
+	if(TestAndResetMultiBits(dirtyPagesBV, (char *)addr, (size_t)size))
 #endif /*PART_BLOCK_MERGE_STAT*/
 
 #endif /* COLLECT_MALLOC_STAT */
@@ -1938,22 +3980,42 @@ void MergeNode2(const void *key, const void *value, const void *data, void *isDi
 #ifdef ENABLE_PROFILER
 		fprintf(profFile, "1 BEGIN MERGE\n");
 #endif /* ENABLE_PROFILER */
-		int merged_pages = MergeManyPages(addr, (size_t)size, ((void**)data)[0]); /* pass creator's address */
+		bool has_untouched_pages = false;
+#ifdef COLLECT_MALLOC_STAT
+		if(lazyTouchStat)
+			has_untouched_pages = SyncTouchedPages(addr, (size_t)size);
+#endif /* COLLECT_MALLOC_STAT */
+		int merged_pages = 0;
+		passScannedPages += size/PAGE_SIZE;
+		switch(POLICY_OF(node->policy)){
+			case POLICY_SKIP: /* never merged in profiling runs */
+				break;
+			case POLICY_EAGER:
+				merged_pages = MergeProfRuns(node, addr, size);
+				break;
+			default:
+				merged_pages = MergeManyPages(addr, (size_t)size, LookupCallStack(node->stackId)->frames[0]); /* pass creator's address */
+				break;
+		}
+		passMergedPages += merged_pages;
 #ifdef ENABLE_PROFILER
 		fprintf(profFile, "1 END MERGE %lu\n", (unsigned long)time(NULL));
 
 		if( enableBacktrace && profFile && merged_pages){
 			fprintf(profFile, "1 %d", merged_pages);
 			fprintf(profFile, "; %p %p; ", (void*)addr, (void*)(addr+size) );
+			const CallStack *stack = LookupCallStack(node->stackId);
 			for(int i = 0; i < MAX_STACK_DEPTH; i++){
-				fprintf(profFile, " %p ", ((void**)data)[i]);
+				fprintf(profFile, " %p ", stack->frames[i]);
 			}
 			fprintf(profFile, "\n");
 		}
 #endif /* ENABLE_PROFILER */
 
 #ifdef COLLECT_MALLOC_STAT
-		*((int*)isDirty) = 0;
+		/* writes to untouched pages of a writable region do not fault */
+		if(has_untouched_pages)
+			SetMultiBits(dirtyPagesBV, (char *)addr, (size_t)size);
 	}else{
 #ifdef REPORT_MERGES
 		numCleanPages+=size/PAGE_SIZE;
@@ -1977,6 +4039,53 @@ void MergeNode2(const void *key, const void *value, const void *data, void *isDi
 
 
 
+#ifdef COLLECT_MALLOC_STAT
+/* Finds pages of a writable region touched since last pass and accounts them */
+bool SyncTouchedPages(uintptr_t start_addr, size_t size){
+	int saved_errno = errno;
+	errno = 0;
+	unsigned char vec[1024];
+	size_t chunk = sizeof(vec) * PAGE_SIZE;
+	int newly_touched = 0;
+	bool has_untouched = false;
+
+	for(size_t s = 0; s < size; s += chunk){
+		size_t len = (size - s < chunk)? (size - s): chunk;
+		if(mincore(offset2ptr(start_addr + s), len, vec) != 0){
+			/* cannot tell, so consider every page as touched */
+			memset(vec, 1, sizeof(vec));
+		}
+		for(size_t i = 0; i < len/PAGE_SIZE; i++){
+			char *p = (char *)offset2ptr(start_addr + s + i*PAGE_SIZE);
+			if(!(vec[i] & 0x01)){
+				has_untouched = true;
+			}else if(!SetAndReturnBit(initializedPagesBV, p)){
+				newly_touched++;
+			}
+		}
+	}
+
+	if(newly_touched){
+		lazyPendingPages -= newly_touched;
+#ifdef SHARED_STATS
+		AcquireSharedLock();
+		(*allProcPrivatePageCount) 	+= newly_touched;
+		(*baseCaseTotalPageCount) 	+= newly_touched;
+#ifdef PRINT_STATS
+		if(myRank == 0){
+			if(NodeTotal(baseCaseTotalPageCount) - maxBaseCaseTotalPageCount > 1000){
+				maxBaseCaseTotalPageCount = NodeTotal(baseCaseTotalPageCount) + ((ptmalloc_get_mem_usage() - arenaSegBytes) * (*aliveProcs))/PAGE_SIZE;
+			}
+		}
+#endif /* PRINT_STATS */
+		ReleaseSharedLock();
+#endif /* SHARED_STATS */
+	}
+	errno = saved_errno;
+	return has_untouched;
+}
+#endif /* COLLECT_MALLOC_STAT */
+
 /* Frees up a node corresponding to <key, value> pair */
 inline void FreeNode(const void *key, const void *value, const void *data, void *isDirty){
 	int saved_errno = errno;
@@ -2014,7 +4123,7 @@ void *GetSharedRegion(void* addr, bool isFixed, size_t size){
 				PROT_READ  | PROT_WRITE, 
 				MAP_SHARED | (isFixed? MAP_FIXED: 0), 
 				sharedFileDescr, 
-				page_address);
+				slotFileBase + page_address);
 		if(ptr == MAP_FAILED){
 			warn("mmap failed. If any other library uses mmap anymore, it might fail");
 			/* mmap failed, so if the other library uses mmap anymore, it might fail. */
@@ -2039,7 +4148,7 @@ void *GetSharedRegion(void* addr, bool isFixed, size_t size){
 				PROT_READ | PROT_WRITE, 
 				MAP_SHARED|MAP_FIXED, 
 				sharedFileDescr, 
-				TranslateMmapAddr((uintptr_t)ptr));
+				slotFileBase + TranslateMmapAddr((uintptr_t)ptr));
 		ASSERTX(ptr != MAP_FAILED);
 	}
 	errno = saved_errno;
@@ -2065,10 +4174,26 @@ void CleanUpSharedData(){
 	fprintf(stderr, "sighandler op time = %lu\n", sigHandlerTime);
 #endif /* MICROTIME_STAT*/
 
-#ifdef PROFILE_BASED_MERGE
-	ASSERTX(SH_UNMAP(mergeSuccHist, 0x03 << (30 - log2PAGE_SIZE)) == 0);
-	ASSERTX(SH_UNMAP(lastMergeTime, 0x03 << (30 - log2PAGE_SIZE + 2)) == 0);
-#endif /* PROFILE_BASED_MERGE */
+	StopMergeThreads();
+	if(memCurrentFd >= 0){
+		close(memCurrentFd);
+		memCurrentFd = -1;
+	}
+	if(psiFd >= 0){
+		close(psiFd);
+		psiFd = -1;
+	}
+
+	if(mergeSuccHist){
+		ASSERTX(SH_UNMAP(mergeSuccHist, 0x03UL << (30 - log2PAGE_SIZE)) == 0);
+		ASSERTX(SH_UNMAP(lastMergeTime, 0x03UL << (30 - log2PAGE_SIZE + 3)) == 0);
+		mergeSuccHist = NULL;
+		lastMergeTime = NULL;
+	}
+	if(hotTable){
+		ASSERTX(SH_UNMAP(hotTable, (0x03UL << (30 - HOT_BLOCK_SHIFT)) * sizeof(uint32_t)) == 0);
+		hotTable = NULL;
+	}
 //	return;
 
 
@@ -2085,8 +4210,12 @@ void CleanUpSharedData(){
 
 
 	WaitSem(mutex);
+	/* Fatal() may be called while holding the shared lock */
+	if(sharedLock && !isSharedLockHeld)
+		AcquireSharedLock();
 	if(aliveProcs)
 		--(*aliveProcs);
+	DetachMergeDaemon();
 
 #ifdef PRINT_DEBUG_MSG
 	printf("aliveProcs decremented to %d ... ", *aliveProcs);
@@ -2097,27 +4226,56 @@ void CleanUpSharedData(){
 #endif /* PRINT_DEBUG_MSG */
 //	TraverseAVL((AVLTree* )allocRecord, FreeNode);
 	DestroyAVL((AVLTree*)allocRecord);
+	allocRecord = NULL; /* frees from later exit handlers must not see it */
 
 #ifdef PRINT_DEBUG_MSG
 	printf("destroyed AVL tree ... ");
 #endif /* PRINT_DEBUG_MSG */
 #ifdef ENABLE_PROFILER
-	if(profileMode > NONE ){
+	if(profFile){
 		fclose(profFile);
 		profFile = NULL;
 	}
 #endif /* ENABLE_PROFILER */
+	if(profSites){
+		ASSERTX(SH_UNMAP(profSites, MAX_PROF_SITES * sizeof(ProfSite)) == 0);
+		profSites = NULL;
+	}
+	if(callStacks){
+		ASSERTX(SH_UNMAP(callStacks, MAX_CALL_STACKS * sizeof(CallStack)) == 0);
+		callStacks = NULL;
+	}
 
 	int alive_procs = (aliveProcs? *aliveProcs: 0);
 
 	if(sharingProcessesInfo){
-		ASSERTX(SH_UNMAP(sharingProcessesInfo, 3 * 1024 * 1024) == 0);
+		ASSERTX(SH_UNMAP(sharingProcessesInfo, SharingInfoSize()) == 0);
 		sharingProcessesInfo = NULL;
 	}
+	if(slotHome){
+		ASSERTX(SH_UNMAP(slotHome, 2 * SLOTS_PER_TIER) == 0);
+		slotHome = NULL;
+	}
+	for(int d = 0; d < MAX_MERGE_DOMAINS; d++){
+		if(domainViews[d]){
+			SH_UNMAP(domainViews[d], 0xc0000000);
+			domainViews[d] = NULL;
+		}
+		if(domainBits[d]){
+			SH_UNMAP(domainBits[d], DomainBitsSize(d));
+			domainBits[d] = NULL;
+		}
+	}
+	if(nodeView){
+		SH_UNMAP(nodeView, 0xc0000000);
+		nodeView = NULL;
+	}
 
 #ifdef PRINT_DEBUG_MSG
 	printf("unmapped shared region ... ");
 #endif /* PRINT_DEBUG_MSG */
+	if(sharedLock && isSharedLockHeld)
+		ReleaseSharedLock();
 	SignalSem(mutex);
 
 
@@ -2126,13 +4284,15 @@ void CleanUpSharedData(){
 	allProcPrivatePageCount = NULL;
 	baseCaseTotalPageCount = NULL;
 #endif /* !SHARED_STATS */
+	CloseSharedFileSocket();
 	/* all the other processes have cleared, so clean up stuff */
 	if(!alive_procs){
 		if(sharedFileDescr >= 0){
 			ftruncate64(sharedFileDescr, 0);
 			close(sharedFileDescr);
 		}
-		shm_unlink("/PSMallocTest");
+		if(!isSharedMemfd)
+			shm_unlink("/" SHARED_FILE_NAME);
 		sem_close(mutex);
 		sem_unlink(semName);
 	}else{
@@ -2224,7 +4384,7 @@ inline int compare_pages(void *a, void *b){
 		return diff;
 }
 #else
-#define compare_pages(a, b) memcmp((const void*) a, (const void*) b, PAGE_SIZE)
+#define compare_pages(a, b) memcmp((const void*) (a), (const void*) (b), PAGE_SIZE)
 #endif /* !MICROTIME_STAT */
 
 #endif /* !PART_BLOCK_MERGE_STAT */
@@ -2241,7 +4401,7 @@ void GetCallStack(void **stack, int depth){
 		return ;
 	nptrs = backtrace(stack, depth);
 	for(i = 0; i < nptrs; i++){
-	 	addr = *(uintptr_t *)(stack[i]);
+	 	addr = (uintptr_t)(stack[i]);
 		if(addr < lowLoadAddr || addr >= highLoadAddr)
 			break;
 	}
@@ -2266,7 +4426,7 @@ uintptr_t GetBacktrace() {
 
 	nptrs = backtrace(buffer, SIZE);
 	for(j = 0; j < nptrs; j++){
-	 	addr = *(uintptr_t *)(buffer[j]);
+	 	addr = (uintptr_t)(buffer[j]);
 		if(addr < lowLoadAddr || addr >= highLoadAddr){
 			return addr;
 		}
@@ -2274,6 +4434,51 @@ uintptr_t GetBacktrace() {
 	return 0;
 }
 
+/* Interns the call stack of the allocation being recorded */
+uint32_t InternCallStack(){
+	if(!callStacks)
+		return 0;
+
+	CallStack stack;
+	stack.creator = GetBacktrace();
+	GetCallStack(stack.frames, MAX_STACK_DEPTH);
+	uint64_t hash = 14695981039346656037ULL; /* FNV-1a */
+	for(int i = -1; i < MAX_STACK_DEPTH; i++){
+		uintptr_t addr = (i < 0? stack.creator: (uintptr_t)stack.frames[i]);
+		for(int j = 0; j < 8; j++){
+			hash ^= (addr >> (8 * j)) & 0xff;
+			hash *= 1099511628211ULL;
+		}
+	}
+	stack.hash = (hash? hash: 1); /* 0 marks an unused entry */
+
+	uint32_t index = (uint32_t)(stack.hash & (MAX_CALL_STACKS - 1));
+	for(int i = 0; i < MAX_STACK_PROBES; i++, index = (index + 1) & (MAX_CALL_STACKS - 1)){
+		CallStack *entry = callStacks + index;
+		if(entry->hash == 0){
+			*entry = stack;
+			return index + 1;
+		}
+		if(entry->hash == stack.hash && entry->creator == stack.creator 
+				&& memcmp(entry->frames, stack.frames, sizeof(stack.frames)) == 0)
+			return index + 1;
+	}
+	static bool warned = false;
+	if(!warned){
+		warned = true;
+		warn("call stack table is crowded, new allocation sites are not profiled");
+	}
+	return UNKNOWN_STACK_ID;
+}
+
+/* Finds an interned call stack */
+const CallStack *LookupCallStack(uint32_t id){
+	static const CallStack no_stack = {0, 0, {NULL}};
+	if(!id || id == UNKNOWN_STACK_ID || !callStacks)
+		return &no_stack;
+	return callStacks + id - 1;
+}
+
 /* Copies and maps pages from private region to shared space */
 int CopyAndRemapRegion(void *start, size_t size){
 	static int moved_mem = 0;
@@ -2294,7 +4499,10 @@ int CopyAndRemapRegion(void *start, size_t size){
 		return -1;
 	}
 
+	if(numaInfo)
+		NumaPreferHome(p0, size);
 	memcpy(p0, start, size);
+	sharedLock->slotFills++;
 	p0 = mremap(p0, size, size, MREMAP_MAYMOVE | MREMAP_FIXED, start);
 	ASSERTX(p0 != MAP_FAILED);
 #else
@@ -2327,7 +4535,9 @@ int CopyAndRemapRegion(void *start, size_t size){
 		SetSharingBit(p);
 //		fprintf(stderr, "%d:%p *\n", myRank, p);
 	}
+	NumaPlaceRegion(start, size, true);
 	MakeReadOnlyWrapper(start, size);
+	RecordMergeTime(start, size);
 	errno = saved_errno;
 	return 0;
 }
@@ -2361,7 +4571,9 @@ int RemapRegion(void *start, size_t size){
 #endif
 		SetSharingBit(p);
 	}
+	NumaPlaceRegion(start, size, false);
 	MakeReadOnlyWrapper(start, size); /* FIX 03/05/2009 */
+	RecordMergeTime(start, size);
 	errno = saved_errno;
 	return 0;
 }
@@ -2404,6 +4616,7 @@ int RemapToZero(void *start, size_t size){
 		SetMultiBits(zeroPagesBV, (char*) start, size);
 	else
 		SetBit(zeroPagesBV, (char *)start);
+	RecordMergeTime(start, size);
 
 	errno = saved_errno;
 	return 0;
@@ -2446,173 +4659,567 @@ void PRINT_PROFILE_DATA(void *start,  void *end, uintptr_t caddr) {
 	start = NULL;\
 }
 
-/*! Maximum size of the buffer used for mapping and managing pages in bulk */
-#define MMAP_BUFFER_SIZE (4*1024*1024)
+/* Classifies pages for merging, does not change any mapping */
+void ClassifyPages(uintptr_t start_addr, size_t num_pages, char *shared_view, uint8_t *classes, uint64_t curr_time){
+	for(size_t i = 0; i < num_pages; i++){
+		void *p = offset2ptr(start_addr + (i << log2PAGE_SIZE));
+		classes[i] = PAGE_SKIP;
 
-/* Merges many pages starting from address start_addr for length size */
-int MergeManyPages(uintptr_t start_addr, size_t size, const void* data){
+#ifdef COLLECT_MALLOC_STAT
+		if(!GetBit(initializedPagesBV, (char *)p))
+			continue;
+#endif /* COLLECT_MALLOC_STAT */
+		if(GetBit(zeroPagesBV, (char *)p))
+			continue;
+		if(GetSharingBit(p))
+			continue;
+		if(hotTable && IsHotPage(p, curr_time))
+			continue;
+		if(mergeSuccHist && !CheckIfMergeable(p, curr_time))
+			continue;
 
-	ASSERTX(sharingProcessesInfo);
+		if(compare_pages(p, zeroPage) == 0)
+			classes[i] = PAGE_ZERO;
+		else if(!IsOtherSharing(p))
+			classes[i] = PAGE_MOVEABLE;
+		else if(compare_pages(shared_view + (i << log2PAGE_SIZE), p) == 0)
+			classes[i] = PAGE_SHAREABLE;
+	}
+}
 
-	int counter_pages_merged = 0;
+/* Takes chunks of the posted window until none is left */
+void ClassifyChunks(){
+	int chunk;
+	while((chunk = __sync_fetch_and_add(&mergeJob.nextChunk, 1)) < mergeJob.numChunks){
+		size_t first = (size_t)chunk * MERGE_CHUNK_PAGES;
+		size_t num_pages = mergeJob.numPages - first;
+		if(num_pages > MERGE_CHUNK_PAGES)
+			num_pages = MERGE_CHUNK_PAGES;
+		ClassifyPages(mergeJob.startAddr + (first << log2PAGE_SIZE), num_pages,
+				mergeJob.sharedView + (first << log2PAGE_SIZE), pageClass + first, mergeJob.currTime);
+	}
+}
 
-	uintptr_t creator_addr = (uintptr_t)data;
-	WaitSem(mutex);
-	void *p;
-//	void *q;
+/* Main loop of a merge thread */
+void *MergeWorker(void *arg){
+	uint64_t generation = 0;
 
-	bool last_page_zero 		= false; /* was last pages containing zeros? map to zero page */
-	bool last_page_moveable 	= false; /* need to copy data */
-	bool last_page_shareable 	= false; /* no data copy needed, just remap */
-	void *mergeable_start_addr 	= NULL;
+	/* merging is done by the main thread, which handles the signals */
+	sigset_t set;
+	sigfillset(&set);
+	pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+	pthread_mutex_lock(&mergeJob.mutex);
+	while(true){
+		while(!mergeJob.quit && mergeJob.generation == generation)
+			pthread_cond_wait(&mergeJob.start, &mergeJob.mutex);
+		if(mergeJob.quit)
+			break;
+		generation = mergeJob.generation;
+		pthread_mutex_unlock(&mergeJob.mutex);
 
-	int  index = 0;
-	char *mmap_buffer = NULL;
-	void *curr_page_ptr = NULL;
+		ClassifyChunks();
 
-	int saved_errno = errno;
-	errno = 0;
+		pthread_mutex_lock(&mergeJob.mutex);
+		if(--mergeJob.pending == 0)
+			pthread_cond_signal(&mergeJob.done);
+	}
+	pthread_mutex_unlock(&mergeJob.mutex);
+	return NULL;
+}
 
-#ifdef PROFILE_BASED_MERGE
-	struct timeval tv;
-	struct timezone tz;
-	if(gettimeofday(&tv, &tz) == -1)
-		die("gettimeofday");
-	uint32_t time = (uint32_t)(tv.tv_sec * 1000000 + tv.tv_usec);
-#endif /* PROFILE_BASED_MERGE */
+/* Classifies a window of pages into pageClass */
+void ClassifyWindow(uintptr_t start_addr, size_t num_pages, char *shared_view, uint64_t curr_time){
+	if(numMergeWorkers == 0 || num_pages <= MERGE_CHUNK_PAGES){
+		ClassifyPages(start_addr, num_pages, shared_view, pageClass, curr_time);
+		return;
+	}
 
-	for(size_t s =0; s < size; s += PAGE_SIZE){
-		if(IsCloseToMmapLimit()){
-			if(mmap_buffer)
-				SH_UNMAP(mmap_buffer, MMAP_BUFFER_SIZE); /* free previously allocated 4MB buffer */
-			warn("close to mmap limit");
-			SignalSem(mutex);
-			errno = saved_errno;
-//			return -1; /* pretty close to limit*/
-			return counter_pages_merged;
+	pthread_mutex_lock(&mergeJob.mutex);
+	mergeJob.startAddr 	= start_addr;
+	mergeJob.numPages 	= num_pages;
+	mergeJob.sharedView = shared_view;
+	mergeJob.currTime 	= curr_time;
+	mergeJob.numChunks 	= (num_pages + MERGE_CHUNK_PAGES - 1) / MERGE_CHUNK_PAGES;
+	mergeJob.nextChunk 	= 0;
+	mergeJob.pending 	= numMergeWorkers;
+	mergeJob.generation++;
+	pthread_cond_broadcast(&mergeJob.start);
+	pthread_mutex_unlock(&mergeJob.mutex);
+
+	ClassifyChunks(); /* work along with the merge threads */
+
+	pthread_mutex_lock(&mergeJob.mutex);
+	while(mergeJob.pending)
+		pthread_cond_wait(&mergeJob.done, &mergeJob.mutex);
+	pthread_mutex_unlock(&mergeJob.mutex);
+}
+
+/* Starts merge threads */
+void StartMergeThreads(){
+	int saved_errno = errno;
+	while(numMergeWorkers < mergeThreads - 1){
+		if(pthread_create(&mergeWorkers[numMergeWorkers], NULL, MergeWorker, NULL) != 0){
+			warn("unable to create merge thread");
+			break;
 		}
+		numMergeWorkers++;
+	}
+	errno = saved_errno;
+}
 
-		p = offset2ptr(start_addr + s);
+/* Stops merge threads */
+void StopMergeThreads(){
+	if(numMergeWorkers == 0)
+		return;
+	pthread_mutex_lock(&mergeJob.mutex);
+	mergeJob.quit = true;
+	pthread_cond_broadcast(&mergeJob.start);
+	pthread_mutex_unlock(&mergeJob.mutex);
+	for(int i = 0; i < numMergeWorkers; i++)
+		pthread_join(mergeWorkers[i], NULL);
+	numMergeWorkers = 0;
+}
 
-		/* maintain a 4MB buffer */
-		if(index == 0 || index == 4*1024*1024){
-			index = 0;
-			if(mmap_buffer)
-				SH_UNMAP(mmap_buffer, MMAP_BUFFER_SIZE); /* free previously allocated 4MB buffer */
-			mmap_buffer = (char *)GetSharedRegion(p, false, MMAP_BUFFER_SIZE);
-		}
-		curr_page_ptr = (void *)(mmap_buffer + index);
-		index += PAGE_SIZE;
+/*===============================================================================*/
+/*                                  Merge daemon                                 */
+/*===============================================================================*/
+/* Forks the process becoming the merge daemon, before MPI is initialized */
+void ForkMergeDaemon(){
+	char *value = getenv("MERGE_DAEMON");
+	if(!value || atoi(value) <= 0)
+		return;
 
-		/* check */
-		if(mergeable_start_addr){
-			ASSERTX(last_page_zero || last_page_shareable || last_page_moveable);
-			ASSERTX(!(
-						(last_page_zero 		&& 	last_page_shareable) ||
-						(last_page_zero 		&& 	last_page_moveable) ||
-						(last_page_shareable 	&& 	last_page_moveable)
-					 ));
+	int saved_errno = errno;
+	int socks[2];
+	if(socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, socks) != 0){
+		warn("unable to fork merge daemon");
+		errno = saved_errno;
+		return;
+	}
+	pid_t pid = fork();
+	if(pid == 0){
+		/* the first task of the node passes the shared file, the others
+		 * close the socket */
+		close(socks[0]);
+		int fd = ReceiveFd(socks[1]);
+		close(socks[1]);
+		if(fd == -1)
+			_exit(0);
+		sharedFileDescr = fd;
+		MergeDaemonMain(); /* never returns */
+	}
+	close(socks[1]);
+	if(pid == -1){
+		warn("unable to fork merge daemon");
+		close(socks[0]);
+	}else{
+		daemonChild = pid;
+		daemonSocket = socks[0];
+	}
+	errno = saved_errno;
+}
 
-		}else{
-			ASSERTX(!last_page_zero);
-			ASSERTX(!last_page_shareable);
-			ASSERTX(!last_page_moveable);
-		}
+/* Lets the forked child become the merge daemon, or exit, returns its pid if
+ * it became the daemon */
+static pid_t ReleaseDaemonChild(bool become_daemon){
+	pid_t pid = 0;
+	if(daemonSocket == -1)
+		return 0;
+	if(become_daemon && SendFd(daemonSocket, sharedFileDescr) == 0)
+		pid = daemonChild;
+	close(daemonSocket);
+	daemonSocket = -1;
+	if(!pid) /* the child exits on seeing the socket closed */
+		while(waitpid(daemonChild, NULL, 0) == -1 && errno == EINTR);
+	daemonChild = 0;
+	return pid;
+}
 
+/* Attaches to the merge daemon of the node, the first task starts it */
+void AttachMergeDaemon(bool init_shared){
+	int saved_errno = errno;
+	MergeDaemonArea *area = (MergeDaemonArea *)SH_MMAP(NULL, sizeof(MergeDaemonArea), 
+			PROT_READ | PROT_WRITE, MAP_SHARED, sharedFileDescr, DAEMON_AREA_OFFSET);
+	if(area == MAP_FAILED){
+		warn("unable to map merge daemon area");
+		ReleaseDaemonChild(false);
+		errno = saved_errno;
+		return;
+	}
 
-		bool is_initialized_page 	= true;
-#ifdef COLLECT_MALLOC_STAT
-		is_initialized_page 		= GetBit(initializedPagesBV, (char *)p);
-		if(!is_initialized_page){
-			FLUSH_OUTSTANDING_MERGES(mergeable_start_addr, p, last_page_shareable, last_page_moveable, last_page_zero, creator_addr);
-			continue;
+	if(init_shared){
+		/* the file is new, the area reads as zeros */
+		ASSERTX(sem_init(&area->work, 1, 0) == 0);
+		for(int i = 0; i < MAX_DAEMON_TASKS; i++)
+			ASSERTX(sem_init(&area->boxes[i].done, 1, 0) == 0);
+		area->attached = 1;
+		area->pid = ReleaseDaemonChild(true);
+		if(!area->pid){
+			warn("unable to start merge daemon");
+			area->attached = 0;
 		}
-#endif /* COLLECT_MALLOC_STAT */
+	}else{
+		ReleaseDaemonChild(false);
+		if(area->pid && myRank < MAX_DAEMON_TASKS)
+			__sync_fetch_and_add(&area->attached, 1);
+	}
 
-		bool is_zero_page 			= GetBit(zeroPagesBV, (char *)p);
-		if(is_zero_page){
-			FLUSH_OUTSTANDING_MERGES(mergeable_start_addr, p, last_page_shareable, last_page_moveable, last_page_zero, creator_addr);
-			continue;
-		}
+	if(area->pid == 0 || myRank >= MAX_DAEMON_TASKS){ /* no daemon running */
+		if(myRank >= MAX_DAEMON_TASKS)
+			warn("too many tasks for merge daemon");
+		ASSERTX(SH_UNMAP(area, sizeof(MergeDaemonArea)) == 0);
+		errno = saved_errno;
+		return;
+	}
 
-		bool is_shared_page 		= GetSharingBit(p);
-		if(is_shared_page){
-			FLUSH_OUTSTANDING_MERGES(mergeable_start_addr, p, last_page_shareable, last_page_moveable, last_page_zero, creator_addr);
+	/* allow the daemon to read our pages even if ptrace is restricted */
+	prctl(PR_SET_PTRACER, area->pid, 0, 0, 0);
+	area->boxes[myRank].state = MAILBOX_IDLE;
+	area->boxes[myRank].pid = getpid();
+	daemonArea = area;
+	errno = saved_errno;
+}
+
+/* Detaches from the merge daemon */
+void DetachMergeDaemon(){
+	ReleaseDaemonChild(false); /* MPI_Init() did not get as far */
+	if(daemonArea){
+		daemonArea->boxes[myRank].pid = 0;
+		__sync_fetch_and_sub(&daemonArea->attached, 1);
+		sem_post(&daemonArea->work); /* let the daemon notice */
+		ASSERTX(SH_UNMAP(daemonArea, sizeof(MergeDaemonArea)) == 0);
+		daemonArea = NULL;
+	}
+}
+
+/* Main loop of the merge daemon */
+void MergeDaemonMain(){
+	/* only the forking thread exists in the daemon */
+	numMergeWorkers = 0;
+	PAGE_SIZE = sysconf(_SC_PAGESIZE);
+	log2PAGE_SIZE = CeilLog2(PAGE_SIZE);
+	InitEnv();
+	signal(SIGSEGV, SIG_DFL);
+	signal(SIGBUS, SIG_DFL); /* the last task truncates the shared file */
+	signal(SIGINT, SIG_IGN); /* tasks are interrupted, the daemon follows them */
+	prctl(PR_SET_NAME, "sbll-merged", 0, 0, 0);
+	if(mergeDaemonCpu >= 0){
+		cpu_set_t cpus;
+		CPU_ZERO(&cpus);
+		CPU_SET(mergeDaemonCpu, &cpus);
+		if(sched_setaffinity(0, sizeof(cpus), &cpus) == -1)
+			warn("unable to pin merge daemon");
+	}
+	daemonArea = (MergeDaemonArea *)SH_MMAP(NULL, sizeof(MergeDaemonArea), 
+			PROT_READ | PROT_WRITE, MAP_SHARED, sharedFileDescr, DAEMON_AREA_OFFSET);
+	if(daemonArea == MAP_FAILED)
+		_exit(0);
+
+	while(daemonArea->attached > 0){
+		struct timespec ts;
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec += 1;
+		if(sem_timedwait(&daemonArea->work, &ts) == -1){
+			/* exit if every task died without detaching */
+			bool any_alive = false;
+			for(int i = 0; i < MAX_DAEMON_TASKS; i++){
+				pid_t pid = daemonArea->boxes[i].pid;
+				if(pid && (kill(pid, 0) == 0 || errno != ESRCH))
+					any_alive = true;
+			}
+			if(!any_alive)
+				break;
 			continue;
 		}
 
-#ifdef PROFILE_BASED_MERGE
-		{
-			if(!CheckIfMergeable(p, time)){
-				FLUSH_OUTSTANDING_MERGES(mergeable_start_addr, p, last_page_shareable, last_page_moveable, last_page_zero, creator_addr);
+		for(int i = 0; i < MAX_DAEMON_TASKS; i++){
+			MergeMailbox *box = &daemonArea->boxes[i];
+			/* the task may have taken all chunks and withdrawn the request */
+			if(!__sync_bool_compare_and_swap(&box->state, MAILBOX_REQUEST, MAILBOX_SERVING))
 				continue;
-			}
+			box->state = (ServeMailbox(box)? MAILBOX_DONE: MAILBOX_FAILED);
+			sem_post(&box->done);
 		}
-#endif /* PROFILE_BASED_MERGE */
+	}
+	_exit(0);
+}
+
+/* Compares candidate pages of the chunks of a mailbox request it takes */
+bool ServeMailbox(MergeMailbox *box){
+	static char *page_buffer = NULL; /* pages read from the task, a batch at a time */
+	static char *zero_buffer = NULL;
+	static struct iovec local_iov[MERGE_DAEMON_BATCH_PAGES];
+	static struct iovec remote_iov[MERGE_DAEMON_BATCH_PAGES];
+
+	if(!page_buffer){
+		page_buffer = (char *)SH_MMAP(NULL, (size_t)MERGE_DAEMON_BATCH_PAGES << log2PAGE_SIZE, 
+				PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		zero_buffer = (char *)SH_MMAP(NULL, PAGE_SIZE, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if(page_buffer == MAP_FAILED || zero_buffer == MAP_FAILED){
+			page_buffer = NULL;
+			return false;
+		}
+	}
 
+	/* slots are mapped through the shared file, not copied */
+	size_t window_size = box->numPages << log2PAGE_SIZE;
+	char *shared_view = (char *)SH_MMAP(NULL, window_size, PROT_READ, MAP_SHARED, sharedFileDescr, box->fileOffset);
+	if(shared_view == MAP_FAILED)
+		return false;
 
-		if(compare_pages(p, zeroPage) == 0){ 
-			if(mergeable_start_addr){
-				if(last_page_zero){
+	bool is_read = true;
+	int chunk;
+	while(is_read && (chunk = __sync_fetch_and_add(&box->nextChunk, 1)) < box->numChunks){
+		size_t first = (size_t)chunk * MERGE_CHUNK_PAGES;
+		size_t end = first + MERGE_CHUNK_PAGES;
+		if(end > box->numPages)
+			end = box->numPages;
+
+		for(size_t i = first; i < end && is_read; ){
+			/* read a batch of candidate pages, compared while in cache */
+			size_t batch[MERGE_DAEMON_BATCH_PAGES];
+			int num_pages = 0, num_iov = 0;
+			for(; i < end && num_pages < MERGE_DAEMON_BATCH_PAGES; i++){
+				if(box->classes[i] == PAGE_SKIP)
 					continue;
+				char *local = page_buffer + ((size_t)num_pages << log2PAGE_SIZE);
+				char *remote = (char *)(box->pageAddr + (i << log2PAGE_SIZE));
+				if(num_iov && (char *)remote_iov[num_iov - 1].iov_base + remote_iov[num_iov - 1].iov_len == remote){
+					local_iov[num_iov - 1].iov_len += PAGE_SIZE;
+					remote_iov[num_iov - 1].iov_len += PAGE_SIZE;
 				}else{
-					FLUSH_OUTSTANDING_MERGES(mergeable_start_addr, p, last_page_shareable, last_page_moveable, last_page_zero, creator_addr);
+					local_iov[num_iov].iov_base = local;
+					remote_iov[num_iov].iov_base = remote;
+					local_iov[num_iov].iov_len = remote_iov[num_iov].iov_len = PAGE_SIZE;
+					num_iov++;
 				}
+				batch[num_pages++] = i;
+			}
+			if(!num_pages)
+				break;
+			if(process_vm_readv(box->pid, local_iov, num_iov, remote_iov, num_iov, 0) != ((ssize_t)num_pages << log2PAGE_SIZE)){
+				is_read = false;
+				break;
+			}
+
+			for(int k = 0; k < num_pages; k++){
+				size_t j = batch[k];
+				char *page = page_buffer + ((size_t)k << log2PAGE_SIZE);
+				if(memcmp(page, zero_buffer, PAGE_SIZE) == 0)
+					box->classes[j] = PAGE_ZERO;
+				else if(box->classes[j] == PAGE_SHAREABLE && memcmp(page, shared_view + (j << log2PAGE_SIZE), PAGE_SIZE) != 0)
+					box->classes[j] = PAGE_SKIP;
 			}
-			mergeable_start_addr 	= p;
-			last_page_zero 		= true;
-			continue;
 		}
+	}
+	SH_UNMAP(shared_view, window_size);
+	return is_read;
+}
 
+/* Has the merge daemon classify a window of pages, along with the task */
+bool ClassifyByDaemon(uintptr_t start_addr, size_t num_pages, char *shared_view, uint64_t curr_time){
+	MergeMailbox *box = &daemonArea->boxes[myRank];
 
-		if(!IsOtherSharing(p)){ 
-			if(mergeable_start_addr){
-				if(last_page_moveable){
-					continue;
-				}else{
-					FLUSH_OUTSTANDING_MERGES(mergeable_start_addr, p, last_page_shareable, last_page_moveable, last_page_zero, creator_addr);
-				}
-			}
-			mergeable_start_addr 	= p;
-			last_page_moveable 		= true;
+	/* bitvector checks are cheap, the daemon only compares candidates */
+	for(size_t i = 0; i < num_pages; i++){
+		void *p = offset2ptr(start_addr + (i << log2PAGE_SIZE));
+		box->classes[i] = PAGE_SKIP;
+#ifdef COLLECT_MALLOC_STAT
+		if(!GetBit(initializedPagesBV, (char *)p))
+			continue;
+#endif /* COLLECT_MALLOC_STAT */
+		if(GetBit(zeroPagesBV, (char *)p) || GetSharingBit(p))
 			continue;
+		if(hotTable && IsHotPage(p, curr_time))
+			continue;
+		if(mergeSuccHist && !CheckIfMergeable(p, curr_time))
+			continue;
+		box->classes[i] = (IsOtherSharing(p)? PAGE_SHAREABLE: PAGE_MOVEABLE);
+	}
+
+	box->pageAddr 	= (uintptr_t)offset2ptr(start_addr);
+	box->fileOffset = slotFileBase + TranslateMmapAddr((uintptr_t)offset2ptr(start_addr));
+	box->numPages 	= num_pages;
+	box->numChunks 	= (int)((num_pages + MERGE_CHUNK_PAGES - 1) / MERGE_CHUNK_PAGES);
+	box->nextChunk 	= 0;
+	__sync_synchronize();
+	box->state 		= MAILBOX_REQUEST;
+	sem_post(&daemonArea->work);
+
+	/* classify chunks along with the daemon instead of waiting for it */
+	int chunk;
+	while((chunk = __sync_fetch_and_add(&box->nextChunk, 1)) < box->numChunks){
+		size_t first = (size_t)chunk * MERGE_CHUNK_PAGES;
+		size_t chunk_pages = num_pages - first;
+		if(chunk_pages > MERGE_CHUNK_PAGES)
+			chunk_pages = MERGE_CHUNK_PAGES;
+		ClassifyPages(start_addr + (first << log2PAGE_SIZE), chunk_pages,
+				shared_view + (first << log2PAGE_SIZE), box->classes + first, curr_time);
+	}
+
+	bool is_done = true;
+	if(!__sync_bool_compare_and_swap(&box->state, MAILBOX_REQUEST, MAILBOX_IDLE)){
+		/* the daemon took part of the window, wait for it */
+		struct timespec ts;
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec += MERGE_DAEMON_TIMEOUT;
+		int ret_val;
+		while((ret_val = sem_timedwait(&box->done, &ts)) == -1 && errno == EINTR);
+		if(ret_val == -1){
+			warn("merge daemon does not respond, merging without it");
+			DetachMergeDaemon();
+			return false;
+		}
+		is_done = (box->state == MAILBOX_DONE);
+		box->state = MAILBOX_IDLE;
+	}
+	if(!is_done)
+		return false;
+	memcpy(pageClass, box->classes, num_pages);
+	return true;
+}
+
+/* Drops classes of a window that other tasks invalidated while it was
+ * classified without the lock */
+void RevalidateWindow(uintptr_t start_addr, size_t num_pages, char *shared_view, bool slots_filled){
+	for(size_t i = 0; i < num_pages; i++){
+		void *p = offset2ptr(start_addr + (i << log2PAGE_SIZE));
+		switch(pageClass[i]){
+			case PAGE_MOVEABLE: /* another task filled the slot */
+				if(IsOtherSharing(p))
+					pageClass[i] = PAGE_SKIP;
+				break;
+			case PAGE_SHAREABLE: /* the slot was left, or left and filled again */
+				if(!IsOtherSharing(p) 
+						|| (slots_filled && compare_pages(shared_view + (i << log2PAGE_SIZE), p) != 0))
+					pageClass[i] = PAGE_SKIP;
+				break;
+			default:
+				break;
+		}
+	}
+}
+
+/* Merges many pages starting from address start_addr for length size */
+int MergeManyPages(uintptr_t start_addr, size_t size, const void* data){
+
+	ASSERTX(sharingProcessesInfo);
+
+	int counter_pages_merged = 0;
+
+	uintptr_t creator_addr = (uintptr_t)data;
+	AcquireSharedLock();
+	void *p;
+
+	bool last_page_zero 		= false; /* was last pages containing zeros? map to zero page */
+	bool last_page_moveable 	= false; /* need to copy data */
+	bool last_page_shareable 	= false; /* no data copy needed, just remap */
+	void *mergeable_start_addr 	= NULL;
+
+	int saved_errno = errno;
+	errno = 0;
+
+	uint64_t curr_time = ((mergeSuccHist || hotTable)? GetMonotonicTime(): 0);
+	size_t window_pages = (size_t)(daemonArea? MAX_MERGE_THREADS: numMergeWorkers + 1) * MERGE_CHUNK_PAGES;
+	size_t num_pages = size >> log2PAGE_SIZE;
+
+	for(size_t w = 0; w < num_pages; w += window_pages){
+		size_t curr_pages = num_pages - w;
+		if(curr_pages > window_pages)
+			curr_pages = window_pages;
+		uintptr_t window_addr = start_addr + (w << log2PAGE_SIZE);
+
+		/* classify the pages of the window, in parallel if enabled */
+		char *shared_view = (char *)GetSharedRegion(offset2ptr(window_addr), false, curr_pages << log2PAGE_SIZE);
+		if(shared_view == MAP_FAILED){
+			p = offset2ptr(window_addr);
+			FLUSH_OUTSTANDING_MERGES(mergeable_start_addr, p, last_page_shareable, last_page_moveable, last_page_zero, creator_addr);
+			ReleaseSharedLock();
+			errno = saved_errno;
+			return counter_pages_merged;
+		}
+		if(daemonArea){
+			/* compare without the lock, other tasks merge meanwhile */
+			p = offset2ptr(window_addr);
+			FLUSH_OUTSTANDING_MERGES(mergeable_start_addr, p, last_page_shareable, last_page_moveable, last_page_zero, creator_addr);
+			unsigned long slot_fills = sharedLock->slotFills;
+			ReleaseSharedLock();
+			bool is_classified = ClassifyByDaemon(window_addr, curr_pages, shared_view, curr_time);
+			AcquireSharedLock();
+			if(is_classified)
+				RevalidateWindow(window_addr, curr_pages, shared_view, sharedLock->slotFills != slot_fills);
+			else
+				ClassifyWindow(window_addr, curr_pages, shared_view, curr_time);
 		}else{
-			if(!last_page_shareable){
+			ClassifyWindow(window_addr, curr_pages, shared_view, curr_time);
+		}
+		ASSERTX(SH_UNMAP(shared_view, curr_pages << log2PAGE_SIZE) == 0);
+
+		/* remap runs of pages of the same class in order */
+		for(size_t i = 0; i < curr_pages; i++){
+			p = offset2ptr(window_addr + (i << log2PAGE_SIZE));
+			if(IsCloseToMmapLimit()){
 				FLUSH_OUTSTANDING_MERGES(mergeable_start_addr, p, last_page_shareable, last_page_moveable, last_page_zero, creator_addr);
+				warn("close to mmap limit");
+				ReleaseSharedLock();
+				errno = saved_errno;
+				return counter_pages_merged;
 			}
 
-			// if contents match, we can mark it as mergeable 
-//			q  = GetSharedPage(p, false); /* map the shared page here */
-//			ASSERTX(q != MAP_FAILED);
-//			int diff = compare_pages(q, p);
-			int diff = compare_pages(curr_page_ptr, p);
-			CheckForError();
-//			ASSERTX(SH_UNMAP(q, PAGE_SIZE) == 0);
+			/* check */
+			if(mergeable_start_addr){
+				ASSERTX(last_page_zero || last_page_shareable || last_page_moveable);
+				ASSERTX(!(
+							(last_page_zero 		&& 	last_page_shareable) ||
+							(last_page_zero 		&& 	last_page_moveable) ||
+							(last_page_shareable 	&& 	last_page_moveable)
+						 ));
 
-			if(diff == 0){ 
-				//				fprintf(stderr, "%d:shareable page %p\n", myRank, p);
-				if(!mergeable_start_addr){
-					mergeable_start_addr = p;
-					last_page_shareable = true;
-				}
-				continue;
 			}else{
-				// else move any outstanding movable reagion and mark as non-movable
+				ASSERTX(!last_page_zero);
+				ASSERTX(!last_page_shareable);
+				ASSERTX(!last_page_moveable);
+			}
 
-				FLUSH_OUTSTANDING_MERGES(mergeable_start_addr, p, last_page_shareable, last_page_moveable, last_page_zero, creator_addr);
+			switch(pageClass[i]){
+				case PAGE_ZERO:
+					if(mergeable_start_addr){
+						if(last_page_zero)
+							continue;
+						FLUSH_OUTSTANDING_MERGES(mergeable_start_addr, p, last_page_shareable, last_page_moveable, last_page_zero, creator_addr);
+					}
+					mergeable_start_addr 	= p;
+					last_page_zero 		= true;
+					break;
+				case PAGE_MOVEABLE:
+					if(mergeable_start_addr){
+						if(last_page_moveable)
+							continue;
+						FLUSH_OUTSTANDING_MERGES(mergeable_start_addr, p, last_page_shareable, last_page_moveable, last_page_zero, creator_addr);
+					}
+					mergeable_start_addr 	= p;
+					last_page_moveable 		= true;
+					break;
+				case PAGE_SHAREABLE:
+					if(!last_page_shareable){
+						FLUSH_OUTSTANDING_MERGES(mergeable_start_addr, p, last_page_shareable, last_page_moveable, last_page_zero, creator_addr);
+						mergeable_start_addr = p;
+						last_page_shareable = true;
+					}
+					break;
+				default:
+					FLUSH_OUTSTANDING_MERGES(mergeable_start_addr, p, last_page_shareable, last_page_moveable, last_page_zero, creator_addr);
+					break;
 			}
 		}
 	}
 
-	if(mmap_buffer)
-		SH_UNMAP(mmap_buffer, MMAP_BUFFER_SIZE); /* free previously allocated 4MB buffer */
-
 	p = offset2ptr(start_addr + size);
 	FLUSH_OUTSTANDING_MERGES(mergeable_start_addr, p, last_page_shareable, last_page_moveable, last_page_zero, creator_addr);
 
 	errno = saved_errno;
-	SignalSem(mutex);
-	//return 0;
+	ReleaseSharedLock();
 	return counter_pages_merged;
 }
 
@@ -2629,13 +5236,13 @@ int MergePages(void *p, uintptr_t creator_addr){
 #endif
 	ASSERTX(sharingProcessesInfo);
 	
-	WaitSem(mutex);
+	AcquireSharedLock();
 	if(GetSharingBit(p)){/* it is already shared, don't try to merge */
 #if 0
 		fprintf(stderr, "not done\n");
 		fflush(stderr);
 #endif
-		SignalSem(mutex);
+		ReleaseSharedLock();
 		return 0;
 	}
 	
@@ -2675,7 +5282,7 @@ int MergePages(void *p, uintptr_t creator_addr){
 		fprintf(stderr, "moved\n");
 		fflush(stderr);
 #endif
-		SignalSem(mutex);
+		ReleaseSharedLock();
 		errno = saved_errno;
 		return 0;
 	} else { /* if someone is sharing it already */
@@ -2735,7 +5342,7 @@ int MergePages(void *p, uintptr_t creator_addr){
 			fprintf(stderr, "done\n");
 			fflush(stderr);
 #endif
-			SignalSem(mutex);
+			ReleaseSharedLock();
 			ASSERTX(p0 != MAP_FAILED);
 			errno = saved_errno;
 			return 1;
@@ -2753,7 +5360,7 @@ int MergePages(void *p, uintptr_t creator_addr){
 	fprintf(stderr, "not done\n");
 	fflush(stderr);
 #endif
-	SignalSem(mutex);
+	ReleaseSharedLock();
 	return 0;
 }
 
@@ -2780,6 +5387,8 @@ void * ShmMallocWrapper(size_t sz){
 	}
 
 
+	SyncArenaSegments(); /* before a stale arena region can clash with the new one */
+
 	void *ptr;
 	size_t size = ((sz + PAGE_SIZE -1 )/PAGE_SIZE)*PAGE_SIZE; // faster than bitwise AND
 //	size_t size = ((sz + PAGE_SIZE -1 ) >> log2PAGE_SIZE) << log2PAGE_SIZE;
@@ -2788,14 +5397,19 @@ void * ShmMallocWrapper(size_t sz){
 		case ALLOC_FREQUENCY:
 			MergeByALLOC_FREQUENCY();
 			break;
-#ifndef COLLECT_MALLOC_STAT
 		case THRESHOLD:
-			MergeByTHRESHOLD();
-			break;
+#ifdef COLLECT_MALLOC_STAT
+			if(lazyTouchStat) /* first writes do not fault, so check here */
 #endif /* COLLECT_MALLOC_STAT */
+				MergeByTHRESHOLD();
+			break;
+		case ADAPTIVE:
+			MergeByADAPTIVE();
+			break;
 		default: /* No merging */
 			break;
 	}
+	RefillPagePool();
 #ifdef MICROTIME_STAT
 	MicroTimer mt;
 	mt.Start();
@@ -2811,7 +5425,7 @@ void * ShmMallocWrapper(size_t sz){
 	else
 		ptr = (void *) SH_MMAP(NULL, size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
 #endif /*0*/
-	ptr = (void *) SH_MMAP(NULL, size, PROT_READ, 			 MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	ptr = (void *) SH_MMAP(NULL, size, (lazyTouchStat? PROT_READ|PROT_WRITE: PROT_READ), MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
 #else
 	ptr = (void *) SH_MMAP(NULL, size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
 #endif /* COLLECT_MALLOC_STAT */
@@ -2824,13 +5438,30 @@ void * ShmMallocWrapper(size_t sz){
 	AspaceAvlInsertWrapper(ptr2offset(ptr), size);
 //	TranslateMmapAddr(ptr2offset(ptr));
 
+	if(profileMode == USE_PROF){
+		AVLTreeNode *n = (AVLTreeNode *)AspaceAvlSearchRangeWrapper(ptr2offset(ptr));
+		int index = (n && n->stackId != UNKNOWN_STACK_ID? FindProfSite(SiteKey(LookupCallStack(n->stackId)->creator), false): -1);
+		if(index >= 0)
+			n->policy = MAKE_POLICY(profSites[index].policy, index);
+		if(index >= 0 && profSites[index].policy == POLICY_EAGER && numEagerRegions < MAX_EAGER_REGIONS)
+			eagerRegions[numEagerRegions++] = ptr2offset(ptr);
+	}
+
+#ifdef COLLECT_MALLOC_STAT
+	if(lazyTouchStat){
+		/* the region is written without faults, let next pass look at it */
+		SetMultiBits(dirtyPagesBV, (char *)ptr, size);
+		lazyPendingPages += size/PAGE_SIZE;
+	}
+#endif /* COLLECT_MALLOC_STAT */
+
 
 #ifdef SHARED_STATS
 #ifndef COLLECT_MALLOC_STAT
-	WaitSem(mutex);
+	AcquireSharedLock();
 	(*allProcPrivatePageCount) += (size/PAGE_SIZE);
 	(*baseCaseTotalPageCount) += (size/PAGE_SIZE);
-	SignalSem(mutex);
+	ReleaseSharedLock();
 #endif /* !COLLECT_MALLOC_STAT */
 #endif /* !SHARED_STATS */
 
@@ -2860,7 +5491,7 @@ void * ShmReallocWrapper(void * ptr, size_t size){
 	int saved_errno = errno;
 	errno = 0;
 	/* find current size */
-	old_size = AspaceAvlSearchWrapper(ptr2offset(ptr));
+	old_size = (arenaMerge && IsArenaChunk(ptr)? 0: AspaceAvlSearchWrapper(ptr2offset(ptr)));
 	CheckForError();
 	if(old_size <= 0){
 		/* it is allocated by small allocator. Let it handle this */
@@ -2898,32 +5529,21 @@ void * ShmReallocWrapper(void * ptr, size_t size){
 size_t ShmGetSizeWrapper(void *ptr){
 	if(!CheckMPIInitialized())
 		return 0;
+	if(arenaMerge && IsArenaChunk(ptr))
+		return 0;
 
 	return AspaceAvlSearchWrapper(ptr2offset(ptr));
 }
 /*-------------------------------------------------------------------------------*/
-/* public interface for freeing shared pages */
-int ShmFreeWrapper(void *ptr){
-	if(!CheckMPIInitialized())
-		return -1;
-
-	intptr_t size = AspaceAvlRemoveWrapper(ptr2offset(ptr));
-	if(size <= 0)
-		return -1; /* element not found */
-
-//	fprintf(stderr, "free %p %ld\n", ptr, size);
-
-#ifdef MICROTIME_STAT
-	MicroTimer mt;
-	mt.Start();
-#endif /*MICROTIME_STAT */
-
-	int saved_errno = errno;
-	errno = 0;
-	ASSERTX(SH_UNMAP(ptr, size) == 0); 
-	CheckForError();
+/* Updates counters and bit vectors for the pages of an unmapped region */
+void ReleaseRegionPages(void *ptr, intptr_t size){
+#ifdef COLLECT_MALLOC_STAT
+	TestAndResetMultiBits(dirtyPagesBV, (char *)ptr, size);
+#endif /* COLLECT_MALLOC_STAT */
+	if(mergeSuccHist)
+		ResetMergeHist(ptr, size);
 
-	WaitSem(mutex);
+	AcquireSharedLock();
 
 //	int old_mmap_count = mmapCount;
 	bool last_page_shared = false;
@@ -2994,7 +5614,10 @@ int ShmFreeWrapper(void *ptr){
 					}
 #endif /* ENABLE_PROFILER */
 					last_page_shared = true;
+					NumaLeavePage(SlotIndex(p), myRank);
 					UnsetSharingBit(p);
+					if(domainInfo)
+						ResetAndReturnBit(nodeTierBV, (char *)p);
 				}else{ /* just change the counter */
 					(*allProcPrivatePageCount)--;
 					last_page_shared = false;
@@ -3004,6 +5627,10 @@ int ShmFreeWrapper(void *ptr){
 					mmapCount -=1;
 					last_page_shared = false;
 				}
+#ifdef COLLECT_MALLOC_STAT
+				if(lazyTouchStat) /* never found touched, so never accounted */
+					lazyPendingPages--;
+#endif /* COLLECT_MALLOC_STAT */
 			}
 
 
@@ -3035,18 +5662,627 @@ int ShmFreeWrapper(void *ptr){
 	}
 
 //	fprintf(stderr, " ******** MMAP COUNT REDUCED BY: %d\n", old_mmap_count - mmapCount);
-	SignalSem(mutex);
+	ReleaseSharedLock();
+}
+
+/*-------------------------------------------------------------------------------*/
+/* public interface for freeing shared pages */
+int ShmFreeWrapper(void *ptr){
+	if(!CheckMPIInitialized())
+		return -1;
+	if(arenaMerge && IsArenaChunk(ptr))
+		return -1; /* chunk of the small object allocator */
+
+	if(profileMode == CREATE_PROF){ /* before the merged pages are forgotten */
+		AVLTreeNode *n = (AVLTreeNode *)AspaceAvlSearchRangeWrapper(ptr2offset(ptr));
+		if(n && n->key == ptr && n->stackId != UNKNOWN_STACK_ID)
+			RecordMergeProfile(ptr2offset(ptr), (size_t)ptr2offset(n->value), LookupCallStack(n->stackId)->creator);
+	}
+
+	intptr_t size = AspaceAvlRemoveWrapper(ptr2offset(ptr));
+	if(size <= 0)
+		return -1; /* element not found */
+
+	for(int i = 0; i < numEagerRegions; i++){
+		if(eagerRegions[i] == ptr2offset(ptr)){
+			eagerRegions[i] = eagerRegions[--numEagerRegions];
+			break;
+		}
+	}
+
+//	fprintf(stderr, "free %p %ld\n", ptr, size);
+
+#ifdef MICROTIME_STAT
+	MicroTimer mt;
+	mt.Start();
+#endif /*MICROTIME_STAT */
+
+	int saved_errno = errno;
+	errno = 0;
+	ASSERTX(SH_UNMAP(ptr, size) == 0); 
+	CheckForError();
+
+	ReleaseRegionPages(ptr, size);
 #ifdef MICROTIME_STAT
 	mt.Stop();
 	freeTime += (mt.GetDiff()?mt.GetDiff():1);
 #endif /*MICROTIME_STAT */
 
-#ifndef COLLECT_MALLOC_STAT
+#ifdef COLLECT_MALLOC_STAT
+	if(mergeMetric == THRESHOLD && lazyTouchStat)
+#else /* COLLECT_MALLOC_STAT */
 	if(mergeMetric == THRESHOLD)
+#endif /* !COLLECT_MALLOC_STAT */
 		MergeByTHRESHOLD();
-#endif /* COLLECT_MALLOC_STAT */
+	else if(mergeMetric == ADAPTIVE)
+		MergeByADAPTIVE();
 	
 	errno = saved_errno;
 	return 1;
 }
 
+
+/*===============================================================================*/
+/*                      Arena Segments in the Shared Heap                        */
+/*===============================================================================*/
+/* Locks the arena segment table */
+inline void LockArenaSegs(){
+	while(__sync_lock_test_and_set(&arenaSegLock, 1))
+		sched_yield();
+}
+
+/* Unlocks the arena segment table */
+inline void UnlockArenaSegs(){
+	__sync_lock_release(&arenaSegLock);
+}
+
+/* Size of the mergeable region of an arena segment, 0 if it is all header and footer */
+inline size_t ArenaRegionSize(const ArenaSeg *seg){
+	return (seg->size > seg->headSize + seg->tailSize? seg->size - seg->headSize - seg->tailSize: 0);
+}
+
+/* Updates the AVL tree for arena segments mapped or unmapped since last call.
+ * The table is not locked while the tree allocates or frees nodes, as that
+ * may map or unmap segments. */
+void SyncArenaSegments(){
+	if(!arenaSegsChanged || inFaultHandler)
+		return; /* nodes cannot be allocated with an arena locked */
+	arenaSegsChanged = 0;
+
+	for(int i = 0; i < numArenaSlots; i++){
+		ArenaSeg *seg = &arenaSegs[i];
+		LockArenaSegs();
+		uintptr_t region_start = seg->start + seg->headSize;
+		size_t region_size = ArenaRegionSize(seg);
+		bool remove = (seg->state == ARENA_SEG_STALE || (seg->state == ARENA_SEG_ACTIVE && !region_size));
+		bool insert = (seg->state == ARENA_SEG_PENDING && region_size);
+		if(seg->state == ARENA_SEG_STALE)
+			seg->state = ARENA_SEG_FREE;
+		else if(remove)
+			seg->state = ARENA_SEG_PENDING; /* footer moved into the header */
+		else if(insert)
+			seg->state = ARENA_SEG_ACTIVE;
+		UnlockArenaSegs();
+
+		if(remove)
+			AspaceAvlRemoveWrapper(region_start);
+		if(insert){
+			AspaceAvlInsertWrapper(region_start, region_size);
+			AVLTreeNode *node = (AVLTreeNode *)AspaceAvlSearchRangeWrapper(region_start);
+			LockArenaSegs();
+			if(node && node->key == offset2ptr(region_start)){
+				node->policy = MAKE_POLICY(POLICY_ARENA, 0);
+				/* the segment may have shrunk while the node was allocated */
+				node->value = offset2ptr(seg->state == ARENA_SEG_ACTIVE? ArenaRegionSize(seg): 0);
+			}
+			UnlockArenaSegs();
+		}
+	}
+}
+
+/* Checks whether ptr is a chunk in the region of an arena segment */
+bool IsArenaChunk(void *ptr){
+	AVLTreeNode *node = (AVLTreeNode *)AspaceAvlSearchRangeWrapper(ptr2offset(ptr));
+	return (node && POLICY_OF(node->policy) == POLICY_ARENA);
+}
+
+/*-------------------------------------------------------------------------------*/
+/* public interface for mapping arena segments in the shared heap. Called with
+ * an arena locked, so neither allocates nor merges. */
+void * ShmArenaMmapWrapper(size_t sz, size_t head, size_t tail){
+	if(!arenaMerge || !CheckMPIInitialized() || isMPIFinalized || IsCloseToMmapLimit(0))
+		return mmap(NULL, sz, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+
+	int saved_errno = errno;
+	errno = 0;
+	size_t size = ((sz + PAGE_SIZE -1 )/PAGE_SIZE)*PAGE_SIZE;
+
+	LockArenaSegs();
+	int slot = 0;
+	while(slot < numArenaSlots && arenaSegs[slot].state != ARENA_SEG_FREE)
+		slot++;
+	if(slot == MAX_ARENA_SEGS){ /* table full, not merged */
+		UnlockArenaSegs();
+		errno = saved_errno;
+		return mmap(NULL, sz, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	}
+
+#ifdef COLLECT_MALLOC_STAT
+	void *ptr = (void *) SH_MMAP(NULL, size, (lazyTouchStat? PROT_READ|PROT_WRITE: PROT_READ), MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+#else
+	void *ptr = (void *) SH_MMAP(NULL, size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+#endif /* COLLECT_MALLOC_STAT */
+	if(ptr == MAP_FAILED){
+		UnlockArenaSegs();
+		warn("mmap failed for arena segment");
+		errno = saved_errno;
+		return MAP_FAILED;
+	}
+
+	if(slot == numArenaSlots)
+		numArenaSlots++;
+	ArenaSeg *seg = &arenaSegs[slot];
+	seg->start = ptr2offset(ptr);
+	seg->size = size;
+	seg->headSize = ((head + PAGE_SIZE -1 )/PAGE_SIZE)*PAGE_SIZE;
+	seg->tailSize = ((tail + PAGE_SIZE -1 )/PAGE_SIZE)*PAGE_SIZE;
+	seg->state = ARENA_SEG_PENDING;
+	arenaSegBytes += size;
+	arenaSegsChanged = 1;
+	UnlockArenaSegs();
+
+#ifdef COLLECT_MALLOC_STAT
+	if(lazyTouchStat){
+		SetMultiBits(dirtyPagesBV, (char *)ptr, size);
+		lazyPendingPages += size/PAGE_SIZE;
+	}
+#endif /* COLLECT_MALLOC_STAT */
+
+#ifdef SHARED_STATS
+#ifndef COLLECT_MALLOC_STAT
+	AcquireSharedLock();
+	(*allProcPrivatePageCount) += (size/PAGE_SIZE);
+	(*baseCaseTotalPageCount) += (size/PAGE_SIZE);
+	ReleaseSharedLock();
+#endif /* !COLLECT_MALLOC_STAT */
+#endif /* !SHARED_STATS */
+
+	errno = saved_errno;
+	return ptr;
+}
+
+/*-------------------------------------------------------------------------------*/
+/* public interface for unmapping arena segments. ptmalloc joins adjacent
+ * segments, so the range may span several of them, and gives back whole
+ * segments or their tails only. */
+int ShmArenaMunmapWrapper(void *ptr, size_t sz){
+	if(!arenaMerge)
+		return munmap(ptr, sz);
+
+	int saved_errno = errno;
+	errno = 0;
+	uintptr_t addr = ptr2offset(ptr);
+	uintptr_t end = addr + ((sz + PAGE_SIZE -1 )/PAGE_SIZE)*PAGE_SIZE;
+	size_t released = 0;
+
+	LockArenaSegs();
+	for(int i = 0; i < numArenaSlots; i++){
+		ArenaSeg *seg = &arenaSegs[i];
+		if(seg->state != ARENA_SEG_PENDING && seg->state != ARENA_SEG_ACTIVE)
+			continue;
+		if(seg->start + seg->size <= addr || seg->start >= end)
+			continue;
+		ASSERTX(seg->start + seg->size <= end); /* a tail */
+
+		uintptr_t region_start = seg->start + seg->headSize;
+		AVLTreeNode *node = NULL;
+		if(seg->state == ARENA_SEG_ACTIVE){
+			node = (AVLTreeNode *)AspaceAvlSearchRangeWrapper(region_start);
+			if(node && node->key != offset2ptr(region_start))
+				node = NULL;
+		}
+		size_t size = seg->start + seg->size - (addr > seg->start? addr: seg->start);
+		seg->size -= size;
+		if(node) /* pages past the new footer are not merged anymore */
+			node->value = offset2ptr(ArenaRegionSize(seg));
+		if(!seg->size)
+			seg->state = (seg->state == ARENA_SEG_ACTIVE? ARENA_SEG_STALE: ARENA_SEG_FREE);
+		released += size;
+	}
+	arenaSegBytes -= released;
+	arenaSegsChanged = 1;
+	int ret;
+	if(released){
+		ASSERTX(released == end - addr); /* not mapped by ShmArenaMmapWrapper() otherwise */
+		ret = SH_UNMAP(ptr, end - addr);
+	}else{ /* mapped before MPI_Init() or not in the shared heap */
+		ret = munmap(ptr, sz);
+	}
+	UnlockArenaSegs();
+	CheckForError();
+
+	if(released)
+		ReleaseRegionPages(ptr, released);
+	errno = saved_errno;
+	return ret;
+}
+
+
+/*===============================================================================*/
+/*                     Checkpoint Images of the Shared Heap                      */
+/*===============================================================================*/
+/* Lowest rank of the tasks of the node, naming its node image so that nodes
+ * writing to the same path do not overwrite each other */
+static int CkptNode(){
+	return (nodeId && *nodeId > 0? *nodeId - 1: 0);
+}
+
+/* Names the node image of path, or the image of a task if rank >= 0 */
+static void CkptFileName(char *name, const char *path, int rank){
+	if(rank < 0)
+		snprintf(name, PATH_MAX, "%s.shared.%d", path, CkptNode());
+	else
+		snprintf(name, PATH_MAX, "%s.%d", path, rank);
+}
+
+/* Rank naming the image of the current task, the same in every run unlike
+ * the order tasks attach to the shared file in */
+static int CkptRank(){
+	int rank = myRank;
+	if(isMPIInitialized && !isMPIFinalized)
+		PMPI_Comm_rank(MPI_COMM_WORLD, &rank);
+	return rank;
+}
+
+/* Writes a list of buffers completely, returns false on error */
+static bool CkptWrite(int fd, struct iovec *iov, int count){
+	while(count > 0){
+		ssize_t n = writev(fd, iov, count);
+		if(n < 0){
+			if(errno == EINTR)
+				continue;
+			return false;
+		}
+		for(; count > 0 && (size_t)n >= iov->iov_len; iov++, count--)
+			n -= iov->iov_len;
+		if(count > 0){
+			iov->iov_base = (char *)iov->iov_base + n;
+			iov->iov_len -= n;
+		}
+	}
+	return true;
+}
+
+/* Writes or reads len bytes at offset, returns false on error or end of file */
+static bool CkptTransfer(int fd, char *buf, size_t len, off64_t offset, bool write){
+	while(len > 0){
+		ssize_t n = (write? pwrite64(fd, buf, len, offset): pread64(fd, buf, len, offset));
+		if(n < 0 && errno == EINTR)
+			continue;
+		if(n <= 0){
+			if(n == 0)
+				errno = EIO;
+			return false;
+		}
+		buf += n;
+		len -= n;
+		offset += n;
+	}
+	return true;
+}
+
+/* Offset of the slot of page p in the node image, the same as in the shared file */
+static inline off64_t CkptSlotOffset(void *p, uint8_t page_class, int domain){
+	off64_t base = ((page_class == CKPT_SHARED && domain >= 0)? DOMAIN_FILE_BASE(domain): 0);
+	return base + TranslateMmapAddr((uintptr_t)p);
+}
+
+/* Writes a record of num_pages pages from start_addr. The private pages are
+ * streamed to fd with the record, the shared slots whose lowest sharing rank
+ * is the current task go to shared_fd. */
+static bool CheckpointRecord(int fd, int shared_fd, uintptr_t start_addr, size_t num_pages){
+	CkptRecord record = {start_addr, (uint32_t)num_pages, 0};
+	uint8_t classes[CKPT_RECORD_PAGES];
+	bool owned[CKPT_RECORD_PAGES];
+	struct iovec iov[CKPT_RECORD_PAGES/2 + 3];
+	int count = 2;
+
+#ifdef COLLECT_MALLOC_STAT
+	if(lazyTouchStat) /* pages written since the last pass are not marked yet */
+		SyncTouchedPages(start_addr, num_pages << log2PAGE_SIZE);
+#endif /* COLLECT_MALLOC_STAT */
+	bool shared = (sharingProcessesInfo && mergeMetric != MERGE_DISABLED);
+	if(shared)
+		AcquireSharedLock();
+	for(size_t i = 0; i < num_pages; i++){
+		char *p = (char *)offset2ptr(start_addr + (i << log2PAGE_SIZE));
+		owned[i] = false;
+		classes[i] = CKPT_PRIVATE;
+#ifdef COLLECT_MALLOC_STAT
+		if(!GetBit(initializedPagesBV, p)){ /* never written */
+			classes[i] = CKPT_ZERO;
+			continue;
+		}
+#endif /* COLLECT_MALLOC_STAT */
+		if(shared && GetBit(zeroPagesBV, p)){
+			classes[i] = CKPT_ZERO;
+		}else if(shared && GetSharingBit(p)){
+			uintptr_t index = SlotIndex(p);
+			unsigned long x = GetSharingBits(index);
+			classes[i] = (index >= SLOTS_PER_TIER? CKPT_NODE_SHARED: CKPT_SHARED);
+			owned[i] = ((x & -x) == TaskBit(index));
+		}else if(zeroPage && compare_pages(p, zeroPage) == 0){
+			classes[i] = CKPT_ZERO;
+		}else if(i > 0 && classes[i - 1] == CKPT_PRIVATE){ /* extends the run */
+			iov[count - 1].iov_len += PAGE_SIZE;
+			record.privatePages++;
+		}else{
+			iov[count].iov_base = p;
+			iov[count++].iov_len = PAGE_SIZE;
+			record.privatePages++;
+		}
+	}
+	if(shared)
+		ReleaseSharedLock();
+
+	iov[0].iov_base = &record;
+	iov[0].iov_len = sizeof(record);
+	iov[1].iov_base = classes;
+	iov[1].iov_len = num_pages;
+	if(!CkptWrite(fd, iov, count))
+		return false;
+
+	/* runs of owned slots of the same tier are contiguous in the node image */
+	for(size_t i = 0; i < num_pages; ){
+		if(!owned[i]){
+			i++;
+			continue;
+		}
+		size_t j = i + 1;
+		while(j < num_pages && owned[j] && classes[j] == classes[i])
+			j++;
+		char *p = (char *)offset2ptr(start_addr + (i << log2PAGE_SIZE));
+		if(!CkptTransfer(shared_fd, p, (j - i) << log2PAGE_SIZE, CkptSlotOffset(p, classes[i], (domainInfo? myDomain: -1)), true))
+			return false;
+		i = j;
+	}
+	return true;
+}
+
+/* Maps page p of the current task to the slot holding data, copying it to a
+ * free slot if no other task restored it yet. Pages whose slot holds other
+ * data stay private. */
+static void RestoreSharedPage(char *p, const char *data, bool node_tier){
+	AcquireSharedLock();
+	bool restored = (GetSharingBit(p) && compare_pages(p, (void *)data) == 0);
+	ReleaseSharedLock();
+	if(restored)
+		return;
+
+	memcpy(p, data, PAGE_SIZE); /* unmerges the page if needed */
+
+	node_tier = (node_tier && domainInfo);
+	AcquireSharedLock();
+	if(node_tier)
+		AcquireNodeLock();
+	if(!GetBit(zeroPagesBV, p) && !GetSharingBit(p) && !IsCloseToMmapLimit()){
+		int ret_val = -1;
+		if(node_tier){
+			SetBit(nodeTierBV, p);
+			slotFileBase = 0;
+		}
+		if(!IsOtherSharing(p)){
+			ret_val = CopyAndRemapRegion(p, PAGE_SIZE);
+		}else{
+			void *p0 = GetSharedPage(p, false);
+			if(p0 != MAP_FAILED){
+				if(compare_pages(p0, p) == 0)
+					ret_val = RemapRegion(p, PAGE_SIZE);
+				ASSERTX(SH_UNMAP(p0, PAGE_SIZE) == 0);
+			}
+		}
+		if(node_tier){
+			slotFileBase = DOMAIN_FILE_BASE(myDomain);
+			if(ret_val != 0)
+				ResetAndReturnBit(nodeTierBV, p);
+		}
+	}
+	if(node_tier)
+		ReleaseNodeLock();
+	ReleaseSharedLock();
+}
+
+/* Restores the next record of fd. buf holds the private pages of the record,
+ * followed by its shared pages read from shared_fd. */
+static bool RestoreRecord(int fd, int shared_fd, const CkptHeader *header, char *buf, off64_t *offset){
+	CkptRecord record;
+	uint8_t classes[CKPT_RECORD_PAGES];
+
+	if(!CkptTransfer(fd, (char *)&record, sizeof(record), *offset, false))
+		return false;
+	*offset += sizeof(record);
+	if(record.numPages > CKPT_RECORD_PAGES || record.privatePages > record.numPages){
+		errno = EINVAL;
+		return false;
+	}
+	if(!CkptTransfer(fd, (char *)classes, record.numPages, *offset, false))
+		return false;
+	*offset += record.numPages;
+
+	/* the region must be allocated again */
+	size_t size = (size_t)record.numPages << log2PAGE_SIZE;
+	AVLTreeNode *node = (AVLTreeNode *)AspaceAvlSearchRangeWrapper(record.start);
+	if(!node || record.start + size > ptr2offset(node->key) + ptr2offset(node->value) + PAGE_SIZE - 1){
+		errno = EINVAL;
+		return false;
+	}
+
+	size_t private_size = (size_t)record.privatePages << log2PAGE_SIZE;
+	if(!CkptTransfer(fd, buf, private_size, *offset, false))
+		return false;
+	*offset += private_size;
+
+	char *shared_buf = buf + ((size_t)CKPT_RECORD_PAGES << log2PAGE_SIZE);
+	for(size_t i = 0; i < record.numPages; ){
+		if(classes[i] != CKPT_SHARED && classes[i] != CKPT_NODE_SHARED){
+			i++;
+			continue;
+		}
+		size_t j = i + 1;
+		while(j < record.numPages && classes[j] == classes[i])
+			j++;
+		if(shared_fd < 0){
+			errno = ENOENT;
+			return false;
+		}
+		void *p = offset2ptr(record.start + (i << log2PAGE_SIZE));
+		if(!CkptTransfer(shared_fd, shared_buf + (i << log2PAGE_SIZE), (j - i) << log2PAGE_SIZE, 
+					CkptSlotOffset(p, classes[i], header->domain), false))
+			return false;
+		i = j;
+	}
+
+	bool shared = (sharingProcessesInfo && mergeMetric != MERGE_DISABLED);
+	char *data = buf;
+	for(size_t i = 0; i < record.numPages; i++){
+		char *p = (char *)offset2ptr(record.start + (i << log2PAGE_SIZE));
+		switch(classes[i]){
+			case CKPT_PRIVATE:
+				memcpy(p, data, PAGE_SIZE);
+				data += PAGE_SIZE;
+				break;
+			case CKPT_ZERO:
+				if(!GetBit(zeroPagesBV, p) && (!zeroPage || compare_pages(p, zeroPage) != 0))
+					memset(p, 0, PAGE_SIZE);
+				break;
+			case CKPT_SHARED:
+			case CKPT_NODE_SHARED:
+				if(shared)
+					RestoreSharedPage(p, shared_buf + (i << log2PAGE_SIZE), classes[i] == CKPT_NODE_SHARED);
+				else
+					memcpy(p, shared_buf + (i << log2PAGE_SIZE), PAGE_SIZE);
+				break;
+			default:
+				errno = EINVAL;
+				return false;
+		}
+	}
+	return true;
+}
+
+/*-------------------------------------------------------------------------------*/
+/* public interface for writing a checkpoint image of the shared heap */
+int ShmCheckpoint(const char *path){
+	if(!path){
+		errno = EINVAL;
+		return -1;
+	}
+
+	int saved_errno = errno;
+	char name[PATH_MAX];
+	CkptFileName(name, path, CkptRank());
+	int fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if(fd < 0)
+		return -1;
+	int shared_fd = -1;
+	if(sharingProcessesInfo){ /* written by all tasks of the node, never truncated */
+		CkptFileName(name, path, -1);
+		shared_fd = open(name, O_WRONLY | O_CREAT, 0600);
+		if(shared_fd < 0){
+			close(fd);
+			return -1;
+		}
+	}
+
+	CkptHeader header = {CKPT_MAGIC, CKPT_VERSION, CkptRank(), (domainInfo? myDomain: -1), CkptNode(), sharedHeapBottom, 0};
+	bool ok = CkptTransfer(fd, (char *)&header, sizeof(header), 0, true);
+	if(ok && lseek(fd, sizeof(header), SEEK_SET) < 0)
+		ok = false;
+
+	SyncArenaSegments();
+	uintptr_t addr = 0;
+	AVLTreeNode *node;
+	while(ok && allocRecord && (node = (AVLTreeNode *)FindNextAVL((AVLTree *)allocRecord, offset2ptr(addr)))){
+		addr = ptr2offset(node->key);
+		size_t region_pages = (ptr2offset(node->value) + PAGE_SIZE - 1) >> log2PAGE_SIZE;
+		if(POLICY_OF(node->policy) == POLICY_ARENA || !region_pages){
+			/* segments of the small object allocator are not restored
+			 * with their allocator state, stale nodes are empty */
+			addr += PAGE_SIZE;
+			continue;
+		}
+		for(size_t i = 0; ok && i < region_pages; i += CKPT_RECORD_PAGES){
+			size_t num_pages = region_pages - i;
+			if(num_pages > CKPT_RECORD_PAGES)
+				num_pages = CKPT_RECORD_PAGES;
+			ok = CheckpointRecord(fd, shared_fd, addr + (i << log2PAGE_SIZE), num_pages);
+			header.numRecords++;
+		}
+		addr += region_pages << log2PAGE_SIZE; /* the next region starts here or later */
+	}
+	if(ok)
+		ok = CkptTransfer(fd, (char *)&header, sizeof(header), 0, true);
+
+	int err = (ok? saved_errno: errno);
+	if(close(fd) != 0 && ok){
+		ok = false;
+		err = errno;
+	}
+	if(shared_fd >= 0 && close(shared_fd) != 0 && ok){
+		ok = false;
+		err = errno;
+	}
+	errno = err;
+	return (ok? 0: -1);
+}
+
+/*-------------------------------------------------------------------------------*/
+/* public interface for restoring the shared heap from a checkpoint image */
+int ShmRestore(const char *path){
+	if(!path){
+		errno = EINVAL;
+		return -1;
+	}
+
+	int saved_errno = errno;
+	char name[PATH_MAX];
+	CkptFileName(name, path, CkptRank());
+	int fd = open(name, O_RDONLY);
+	if(fd < 0)
+		return -1;
+	CkptFileName(name, path, -1);
+	int shared_fd = open(name, O_RDONLY); /* missing if no page was shared */
+
+	CkptHeader header;
+	bool ok = CkptTransfer(fd, (char *)&header, sizeof(header), 0, false);
+	if(ok && (header.magic != CKPT_MAGIC || header.version != CKPT_VERSION 
+				|| header.rank != CkptRank() || header.node != CkptNode()
+				|| header.heapBottom != sharedHeapBottom)){
+		errno = EINVAL;
+		ok = false;
+	}
+
+	size_t buf_size = (size_t)2 * CKPT_RECORD_PAGES << log2PAGE_SIZE;
+	char *buf = NULL;
+	if(ok){
+		buf = (char *) SH_MMAP(NULL, buf_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if(buf == MAP_FAILED){
+			buf = NULL;
+			ok = false;
+		}
+	}
+
+	SyncArenaSegments();
+	off64_t offset = sizeof(header);
+	for(long r = 0; ok && r < header.numRecords; r++)
+		ok = RestoreRecord(fd, shared_fd, &header, buf, &offset);
+
+	int err = (ok? saved_errno: errno);
+	if(buf)
+		ASSERTX(SH_UNMAP(buf, buf_size) == 0);
+	close(fd);
+	if(shared_fd >= 0)
+		close(shared_fd);
+	errno = err;
+	return (ok? 0: -1);
+}
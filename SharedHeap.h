@@ -16,6 +16,7 @@
 #include <inttypes.h>
 #include <math.h>
 #include <mpi.h>
+#include <pthread.h>
 #include <semaphore.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -36,7 +37,16 @@
 #if defined(linux)
 #include <fcntl.h>
 #include <signal.h>
+#include <dlfcn.h>
 #include <sys/mman.h>
+#include <limits.h>
+#include <poll.h>
+#include <sys/prctl.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <sched.h>
 #include <syscall.h>
 #include <unistd.h>
 #endif /* linux */
@@ -204,6 +214,7 @@ enum _MERGE_METRICS {
 	ALLOC_FREQUENCY, /**< 1:Frequency based merging */ 
 	THRESHOLD, /**< 2:Threshold based merging (recommended) */
 	BUFFERED, /**< 3:Buffered merging (\b EXPERIMENTAL, please do not use) */
+	ADAPTIVE, /**< 4:Merging paced by measured cost and yield of passes */
 	NUM_METRIC /**< Number of merge policies */
 };
 
@@ -211,10 +222,63 @@ enum _MERGE_METRICS {
 enum _PROFILE_MODES {
 	NONE, /**< No profiling */
 	CREATE_PROF,  /**< Create merge profile */
-	USE_PROF,  /**< Use profiles for merging (\b NOT SUPPORTED) */
+	USE_PROF,  /**< Use profiles for merging */
 	NUM_MODES /**< Num profiling modes */
 };
 
+/*! @brief Merge policy of a region, decided by the merge profile of its
+ * allocation site. Kept in the low bits of \c AVLTreeNode::policy, the rest
+ * holds index of the site in the profile table. */
+enum _MERGE_POLICIES {
+	POLICY_DEFAULT, /**< Site not in profile, merged as usual */
+	POLICY_SKIP, /**< Site never merged in profiling runs, not scanned */
+	POLICY_EAGER, /**< Only profiled runs are scanned, even below threshold */
+	POLICY_ARENA /**< Segment of a ptmalloc arena, not an allocation of the application */
+};
+
+#define POLICY_BITS 2
+#define POLICY_OF(p) ((p) & ((0x01 << POLICY_BITS) - 1))
+#define POLICY_SITE(p) ((p) >> POLICY_BITS)
+#define MAKE_POLICY(policy, site) (((site) << POLICY_BITS) | (policy))
+
+/*! @brief Max number of allocation sites in a merge profile, power of 2 */
+#define MAX_PROF_SITES 1024
+/*! @brief Max number of regions with \c POLICY_EAGER merged below threshold,
+ * the others wait for the threshold like the rest */
+#define MAX_EAGER_REGIONS 256
+/*! @brief Max number of merged page runs kept for an allocation site */
+#define MAX_PROF_RUNS 128
+/*! @brief Merge profile file header magic and version */
+#define PROF_MAGIC 0x504d4253 /* "SBMP" */
+#define PROF_VERSION 1
+
+/*! @brief Max number of distinct call stacks interned, power of 2 */
+#define MAX_CALL_STACKS 16384
+/*! @brief Max number of entries of the call stack table probed for a stack */
+#define MAX_STACK_PROBES 64
+
+/*! @brief Id of the call stacks not interned because the entries probed for
+ * them were taken, regions having it are left out of merge profiles */
+#define UNKNOWN_STACK_ID ((uint32_t)(-1))
+
+/*! @brief Run of merged pages, relative to the start of the region */
+typedef struct ProfRun{
+	uint32_t startPage; /**< first page of the run in the region */
+	uint32_t numPages; /**< number of pages */
+}ProfRun;
+
+/*! @brief Merge profile of an allocation site.
+ * A site is the first return address outside this library, kept relative to
+ * the loaded object so that it is the same for every run of the binary. */
+typedef struct ProfSite{
+	uint64_t key; /**< hash of object name and relative call site, 0 if unused */
+	uint64_t scannedPages; /**< pages of all regions from this site */
+	uint64_t mergedPages; /**< pages still merged when the regions were freed */
+	uint32_t numRuns; /**< number of runs */
+	int policy; /**< \c _MERGE_POLICIES, used with USE_PROF */
+	ProfRun runs[MAX_PROF_RUNS]; /**< sorted runs of merged pages */
+}ProfSite;
+
 /*! @brief The structure for storing merge info */
 typedef struct MemStatStruct{
 	long int totalPrivateMem; /**< Total memory as private pages */
@@ -224,7 +288,284 @@ typedef struct MemStatStruct{
 	long int totalUnmergedMem; /**< Memory footprint if merging is disabled */
 	long int totalMergedMem; /**< Memory footprint with merging enabled */
 	int mergeTimeinMicrosec; /**< Time used for merging in microsecond */
+	long int sharedRefs; /**< Mappings of shared pages by all tasks */
+	long int remoteRefs; /**< Mappings of shared pages on a remote NUMA node */
 }MemStatStruct;
+
+/*! @brief Offset of the \c SharedLock inside the page holding alive proc info */
+#define SHARED_LOCK_OFFSET 64
+
+/*! @brief Inter-process lock kept in the shared metadata page.
+ * A robust, process shared mutex is used so that the death of the task
+ * holding the lock is reported to the next task taking it (\c EOWNERDEAD)
+ * instead of blocking all tasks of the node forever. The counters are
+ * copied when the lock is taken so that the changes of a dead owner can be
+ * rolled back. */
+typedef struct SharedLock {
+	pthread_mutex_t mutex; /**< robust, process shared mutex */
+	int owner; /**< rank of the task holding the lock, -1 if free */
+	int sharedPageCount; /**< \c sharedPageCount when the lock was taken */
+	int allProcPrivatePageCount; /**< \c allProcPrivatePageCount when the lock was taken */
+	int baseCaseTotalPageCount; /**< \c baseCaseTotalPageCount when the lock was taken */
+	unsigned long slotFills; /**< slots filled with new contents, pages compared
+							   without the lock are compared again if it changed */
+}SharedLock;
+
+/*! @brief Maximum number of tasks of a node, one per sharing bit */
+#define MAX_NODE_TASKS 64
+
+/*! @brief Offset of the sharing bits in the shared file, after the other
+ * metadata so that up to \c MAX_NODE_TASKS bits per slot fit */
+#define SHARING_INFO_OFFSET (((off64_t)0x03 << 30) | ((off64_t)0x10 << 20))
+
+/*! @brief Offset of the node id inside the page holding alive proc info,
+ * 1 + the lowest MPI rank of the tasks of the node, 0 before MPI_Init */
+#define NODE_ID_OFFSET 32
+
+/*! @brief Offset of the \c SlotRange of each task inside the page holding
+ * alive proc info */
+#define TASK_SLOTS_OFFSET 2048
+
+/*! @brief Slots whose sharing bit a task has set so far, one range per tier
+ * of the sharing bits. Bounds the slots scanned for the bits of a task that
+ * died holding the lock. */
+typedef struct SlotRange {
+	uint32_t low; /**< first slot */
+	uint32_t high; /**< 1 + last slot, 0 if no bit was set */
+}SlotRange;
+
+/*! @brief Maximum number of threads classifying pages in a merge pass */
+#define MAX_MERGE_THREADS 16
+
+/*! @brief Pages classified by a merge thread at a time */
+#define MERGE_CHUNK_PAGES 1024
+
+/*! @brief What the merge pass can do with a page, found by \c ClassifyPages */
+enum _PAGE_CLASSES {
+	PAGE_SKIP, /**< Not mergeable now, ends a run */
+	PAGE_ZERO, /**< Contains zeros, mapped to the zero page */
+	PAGE_MOVEABLE, /**< Not shared by other tasks, data copied to shared region */
+	PAGE_SHAREABLE /**< Same as the shared copy, just remapped */
+};
+
+/*! @brief Window of pages handed to the merge threads. Each thread takes
+ * chunks of \c MERGE_CHUNK_PAGES pages until none is left. */
+typedef struct MergeJob {
+	pthread_mutex_t mutex; /**< guards the fields below except nextChunk */
+	pthread_cond_t start; /**< signalled when a window is posted */
+	pthread_cond_t done; /**< signalled when the last thread finishes */
+	uint64_t generation; /**< incremented for every posted window */
+	uintptr_t startAddr; /**< offset of the first page of the window */
+	size_t numPages; /**< number of pages in the window */
+	char *sharedView; /**< shared region mapped for the window */
+	uint64_t currTime; /**< time of the merge pass for merge history */
+	int numChunks; /**< number of chunks in the window */
+	int nextChunk; /**< next chunk to classify, taken atomically */
+	int pending; /**< threads still working on the window */
+	bool quit; /**< set to stop the threads */
+}MergeJob;
+
+/*! @brief Name of the shared file, also of the socket passing it if it is a memfd */
+#define SHARED_FILE_NAME "PSMallocTest"
+
+#ifndef MFD_CLOEXEC
+#define MFD_CLOEXEC 0x0001U
+#endif
+
+/*! @brief Maximum number of tasks per node served by the merge daemon */
+#define MAX_DAEMON_TASKS MAX_NODE_TASKS
+
+/*! @brief Seconds a task waits for the merge daemon before classifying
+ * pages itself */
+#define MERGE_DAEMON_TIMEOUT 5
+
+/*! @brief Pages the merge daemon reads from a task at a time, small enough
+ * for the copy to stay in cache while it is compared */
+#define MERGE_DAEMON_BATCH_PAGES 16
+
+/*! @brief Offset of the \c MergeDaemonArea in the shared file */
+#define DAEMON_AREA_OFFSET (((off64_t)0x03 << 30) | ((off64_t)0x08 << 20))
+
+/*! @brief States of a merge daemon mailbox */
+enum _MAILBOX_STATES {
+	MAILBOX_IDLE, /**< No request */
+	MAILBOX_REQUEST, /**< Request posted by the task */
+	MAILBOX_SERVING, /**< Daemon takes chunks of the request */
+	MAILBOX_DONE, /**< Classes filled in by the daemon */
+	MAILBOX_FAILED /**< Daemon could not read the pages */
+};
+
+/*! @brief Mailbox of a task in the merge daemon area. The task fills in
+ * candidate pages of a window, \c PAGE_MOVEABLE if no other task shares the
+ * page and \c PAGE_SHAREABLE otherwise, and the daemon turns them into the
+ * final \c _PAGE_CLASSES by comparing page contents. The task classifies
+ * chunks of the window too, chunks are taken atomically by both. */
+typedef struct MergeMailbox {
+	sem_t done; /**< posted by the daemon when the request is served */
+	volatile int state; /**< \c _MAILBOX_STATES */
+	pid_t pid; /**< pid of the task, 0 if not attached */
+	uintptr_t pageAddr; /**< address of the first page in the task */
+	off64_t fileOffset; /**< offset of the first page in the shared file */
+	size_t numPages; /**< number of pages in the window */
+	int numChunks; /**< number of chunks in the window */
+	int nextChunk; /**< next chunk to classify, taken atomically */
+	uint8_t classes[MAX_MERGE_THREADS * MERGE_CHUNK_PAGES]; /**< page classes of the window */
+}MergeMailbox;
+
+/*! @brief Shared area of the merge daemon of a node, kept in the shared file */
+typedef struct MergeDaemonArea {
+	sem_t work; /**< posted by tasks for every request */
+	pid_t pid; /**< pid of the daemon */
+	int attached; /**< number of attached tasks, the daemon exits at 0 */
+	MergeMailbox boxes[MAX_DAEMON_TASKS]; /**< one mailbox per task */
+}MergeDaemonArea;
+
+/*! @brief Maximum number of ptmalloc arena segments kept in the shared heap,
+ * segments are 64KB or larger */
+#define MAX_ARENA_SEGS 16384
+
+/*! @brief States of an arena segment slot */
+enum _ARENA_SEG_STATES {
+	ARENA_SEG_FREE, /**< Slot not used */
+	ARENA_SEG_PENDING, /**< Mapped, its region is not in the AVL tree yet */
+	ARENA_SEG_ACTIVE, /**< Mapped, its region is in the AVL tree */
+	ARENA_SEG_STALE /**< Unmapped, its region is still in the AVL tree */
+};
+
+/*! @brief Segment of a ptmalloc arena allocated in the shared heap.
+ * ptmalloc maps and unmaps segments with an arena locked, when the AVL tree
+ * cannot allocate nodes, so the region between the header and the footer of
+ * the segment is added to and removed from the tree later by
+ * \c SyncArenaSegments(). */
+typedef struct ArenaSeg {
+	uintptr_t start; /**< first page of the segment */
+	size_t size; /**< size of the segment, page aligned */
+	size_t headSize; /**< arena header at the start, page aligned, never merged */
+	size_t tailSize; /**< segment footer at the end, page aligned, never merged */
+	int state; /**< \c _ARENA_SEG_STATES */
+}ArenaSeg;
+
+/*! @brief Pages of the 3GB shared heap, i.e. slots of one tier of the sharing bits */
+#define SLOTS_PER_TIER (3 * 1024 * 256)
+
+/*! @brief Maximum number of merge domains in a node */
+#define MAX_MERGE_DOMAINS 8
+
+/*! @brief Offset of the slots of merge domain d in the shared file.
+ * Node wide slots are at offset 0, where all slots are without domains. */
+#define DOMAIN_FILE_BASE(d) (((off64_t)(d) + 1) << 32)
+
+/*! @brief Offset of the sharing bits of the slots of merge domain d, right
+ * after its 3GB of slots */
+#define DOMAIN_BITS_OFFSET(d) (DOMAIN_FILE_BASE(d) + ((off64_t)0x03 << 30))
+
+/*! @brief Offset of the \c DomainInfo inside the page holding alive proc info */
+#define DOMAIN_INFO_OFFSET 512
+
+/*! @brief Offset of the node each shared page lives on in the shared file */
+#define SLOT_HOME_OFFSET (((off64_t)0x03 << 30) | ((off64_t)0x04 << 20))
+
+/*! @brief Groups of tasks merging pages among themselves first */
+enum _MERGE_DOMAINS {
+	DOMAIN_NODE, /**< all tasks of the node */
+	DOMAIN_SOCKET, /**< tasks running on the same socket */
+	DOMAIN_L3, /**< tasks sharing the last level cache */
+	NUM_DOMAIN_KINDS
+};
+
+/*! @brief Merge domain in the shared metadata page.
+ * Tasks of a domain merge pages into slots of their own part of the shared
+ * file under their own lock, the counters are the part of the node wide ones
+ * changed by the domain. */
+typedef struct MergeDomain {
+	SharedLock lock; /**< guards the slots of the domain */
+	int id; /**< 1 + package or L3 cache id, 0 if not used */
+	int numTasks; /**< tasks attached so far, each has its bit in the domain */
+	int bitWidth; /**< sharing bits per slot of the domain, from its cpus */
+	int pageCounts[3]; /**< \c sharedPageCount, \c allProcPrivatePageCount and \c baseCaseTotalPageCount */
+}MergeDomain;
+
+/*! @brief Merge domains of the node.
+ * Slots identical across domains are promoted to node wide slots. Each domain
+ * has its own sharing bits, one per task of the domain, so they only grow
+ * with the domain; node wide slots have one bit per task of the node. */
+typedef struct DomainInfo {
+	int numDomains; /**< domains used so far */
+	long promotedPages; /**< pages moved from domain slots to node wide ones */
+	int8_t domainRank[MAX_NODE_TASKS]; /**< bit of each task in the sharing bits of its domain, by rank */
+	MergeDomain domains[MAX_MERGE_DOMAINS]; /**< the domains */
+}DomainInfo;
+
+/*! @brief Checkpoint image header magic and version */
+#define CKPT_MAGIC 0x54504b43 /* "CKPT" */
+#define CKPT_VERSION 2
+
+/*! @brief Max pages of a record of a checkpoint image */
+#define CKPT_RECORD_PAGES 1024
+
+/*! @brief How a page is stored in a checkpoint image */
+enum _CKPT_CLASSES {
+	CKPT_PRIVATE, /**< Data follows in the image of the task */
+	CKPT_ZERO, /**< Contains zeros, not stored */
+	CKPT_SHARED, /**< Stored once in the node image, at the offset of its slot */
+	CKPT_NODE_SHARED /**< Likewise for a node wide slot of merge domains */
+};
+
+/*! @brief Header of the checkpoint image of a task */
+typedef struct CkptHeader{
+	uint32_t magic; /**< \c CKPT_MAGIC */
+	uint32_t version; /**< \c CKPT_VERSION */
+	int rank; /**< rank of the task */
+	int domain; /**< merge domain of the task, -1 without domains */
+	int node; /**< lowest rank of the node, names its node image */
+	uintptr_t heapBottom; /**< start of the shared heap */
+	long numRecords; /**< records following the header */
+}CkptHeader;
+
+/*! @brief Record of a run of pages of a region in a checkpoint image,
+ * followed by the \c _CKPT_CLASSES of its pages and the data of the private
+ * ones */
+typedef struct CkptRecord{
+	uintptr_t start; /**< address of the first page */
+	uint32_t numPages; /**< number of pages, at most \c CKPT_RECORD_PAGES */
+	uint32_t privatePages; /**< pages whose data follows */
+}CkptRecord;
+
+/*! @brief Offset of the \c NumaInfo inside the page holding alive proc info */
+#define NUMA_INFO_OFFSET 256
+
+/*! @brief Maximum number of NUMA nodes pages are placed on */
+#define MAX_NUMA_NODES 64
+
+/*! @brief Maximum number of tasks whose node is recorded, one per sharing bit */
+#define MAX_NUMA_TASKS MAX_NODE_TASKS
+
+/*! @brief Pages passed to one \c move_pages() call */
+#define NUMA_MOVE_BATCH 64
+
+#ifndef MPOL_PREFERRED
+#define MPOL_PREFERRED 1
+#endif
+#ifndef MPOL_INTERLEAVE
+#define MPOL_INTERLEAVE 3
+#endif
+#ifndef MPOL_MF_MOVE
+#define MPOL_MF_MOVE (1 << 1)
+#endif
+#ifndef MPOL_MF_MOVE_ALL
+#define MPOL_MF_MOVE_ALL (1 << 2)
+#endif
+
+/*! @brief NUMA placement state shared by the tasks of a node.
+ * Every mapping of a shared page by a task is a reference. A reference is
+ * remote if the page lives on another node than the task runs on. The
+ * counters are changed under the shared lock. */
+typedef struct NumaInfo {
+	int8_t taskNode[MAX_NUMA_TASKS]; /**< node each task runs on, by rank */
+	long sharedRefs; /**< mappings of shared pages by all tasks */
+	long remoteRefs; /**< those mapping a page on another node */
+	long migratedPages; /**< shared pages moved to the node of most sharers */
+}NumaInfo;
 /*===============================================================================*/
 /*                         forward function declarations                         */ 
 /*===============================================================================*/
@@ -266,6 +607,146 @@ int MPI_Init(int *argc, char ***argv);
 /*! @brief Replaces the \c MPI_Finalize to call \c PMPI_Finalize() */
 int MPI_Finalize();
 
+/*! @brief Modes of merging while waiting in collectives */
+enum _PHASE_MODES {
+	PHASE_OFF, /**< Collectives are not intercepted */
+	PHASE_EVERY, /**< Merge in any collective once the threshold is crossed */
+	PHASE_LEARNED /**< Merge once per iteration, in the collective found to start it */
+};
+
+/*! @brief Maximum number of collective call sites tracked for phases */
+#define MAX_PHASE_SITES 64
+
+/*! @brief Iterations with the same period before a call site is trusted */
+#define PHASE_STABLE_COUNT 3
+
+/*! @brief Maximum number of buffers of a collective kept out of merging */
+#define MAX_MPI_BUFS 2
+
+/*! @brief A call site of collectives, used for learning iterations */
+typedef struct PhaseSite {
+	uintptr_t site; /**< return address of the collective call */
+	uint64_t lastSeq; /**< sequence number of its last call */
+	uint64_t period; /**< collectives between its last two calls */
+	int stable; /**< number of calls in a row with the same period */
+}PhaseSite;
+
+/*! @brief Decides whether a collective should merge while waiting. In
+ * learned mode a call site is the phase marker once it is called every
+ * \c period collectives for PHASE_STABLE_COUNT times; the stable site
+ * with the longest period marks the outermost iteration.
+ * @param site Return address of the collective call
+ * @return true if merge slices should be run in the collective */
+bool ShouldMergeInCollective(uintptr_t site);
+
+/*! @brief Whether collectives are posted nonblocking and waited for by
+ * \c WaitAndMerge(). Ranks decide on their own whether to merge, so the
+ * nonblocking form is used by all of them, MPI does not match blocking and
+ * nonblocking collectives.
+ * @return true if MPI_PHASE_MERGE is enabled between MPI_Init and MPI_Finalize */
+bool IsPhaseMergeEnabled();
+
+/*! @brief Runs merge slices until the collective completes or the pass is
+ * done, then waits for the rest. Only waits if no merge is due, see
+ * \c ShouldMergeInCollective(). Pages of buf1 and buf2 are not merged.
+ * @param req Request of the nonblocking collective
+ * @param site Return address of the collective call
+ * @param buf1 Buffer used by the collective, may be NULL
+ * @param len1 Length of buf1
+ * @param buf2 Buffer used by the collective, may be NULL
+ * @param len2 Length of buf2
+ * @return Result of PMPI_Wait */
+int WaitAndMerge(MPI_Request *req, uintptr_t site, const void *buf1, size_t len1, const void *buf2, size_t len2);
+
+/*! @brief Checks whether a range is used by a collective in progress
+ * @param addr Start of the range
+ * @param size Input length of the range, output clipped to the first buffer
+ * @param busy_end Output, end of the buffer if addr is inside one
+ * @return true if addr is inside a buffer */
+bool IsMPIBufferBusy(uintptr_t addr, size_t *size, uintptr_t *busy_end);
+
+/*! @brief Finds length of a buffer of count elements of datatype
+ * @return Length in bytes, 0 if unknown */
+size_t MPIBufferLength(int count, MPI_Datatype datatype);
+
+/*! @brief log2 of the size of a block of the hot buffer table */
+#define HOT_BLOCK_SHIFT 16
+
+/*! @brief Marks 64KB blocks of a buffer used by MPI as hot. Hot blocks are
+ * not merged until they are idle for HOT_BUFFER_MS, so that buffers used
+ * for every message are not merged and unmerged over and over.
+ * @param buf Start of the buffer, ignored if not in the shared heap
+ * @param len Length of the buffer */
+void MarkHotBuffer(const void *buf, size_t len);
+
+/*! @brief Checks whether a page is in a hot MPI buffer
+ * @param p Page address
+ * @param curr_time Time of the merge pass in usec
+ * @return true if the page was used by MPI within HOT_BUFFER_MS */
+bool IsHotPage(void *p, uint64_t curr_time);
+
+/*! @brief Replaces \c MPI_Send, marks the buffer hot */
+int MPI_Send(const void *buf, int count, MPI_Datatype datatype, int dest, int tag, MPI_Comm comm);
+
+/*! @brief Replaces \c MPI_Recv, marks the buffer hot */
+int MPI_Recv(void *buf, int count, MPI_Datatype datatype, int source, int tag, MPI_Comm comm, MPI_Status *status);
+
+/*! @brief Replaces \c MPI_Isend, marks the buffer hot */
+int MPI_Isend(const void *buf, int count, MPI_Datatype datatype, int dest, int tag, MPI_Comm comm, MPI_Request *request);
+
+/*! @brief Replaces \c MPI_Irecv, marks the buffer hot */
+int MPI_Irecv(void *buf, int count, MPI_Datatype datatype, int source, int tag, MPI_Comm comm, MPI_Request *request);
+
+/*! @brief Replaces \c MPI_Sendrecv, marks both buffers hot */
+int MPI_Sendrecv(const void *sendbuf, int sendcount, MPI_Datatype sendtype, int dest, int sendtag,
+		void *recvbuf, int recvcount, MPI_Datatype recvtype, int source, int recvtag, MPI_Comm comm, MPI_Status *status);
+
+/*! @brief Replaces \c MPI_Allgather, marks both buffers hot */
+int MPI_Allgather(const void *sendbuf, int sendcount, MPI_Datatype sendtype,
+		void *recvbuf, int recvcount, MPI_Datatype recvtype, MPI_Comm comm);
+
+/*! @brief Replaces \c MPI_Alltoall, marks both buffers hot */
+int MPI_Alltoall(const void *sendbuf, int sendcount, MPI_Datatype sendtype,
+		void *recvbuf, int recvcount, MPI_Datatype recvtype, MPI_Comm comm);
+
+/*! @brief Replaces \c MPI_Barrier, merging while waiting */
+int MPI_Barrier(MPI_Comm comm);
+
+/*! @brief Replaces \c MPI_Allreduce, merging while waiting */
+int MPI_Allreduce(const void *sendbuf, void *recvbuf, int count, MPI_Datatype datatype, MPI_Op op, MPI_Comm comm);
+
+/*! @brief Replaces \c MPI_Reduce, merging while waiting */
+int MPI_Reduce(const void *sendbuf, void *recvbuf, int count, MPI_Datatype datatype, MPI_Op op, int root, MPI_Comm comm);
+
+/*! @brief Replaces \c MPI_Bcast, merging while waiting. Large buffers are
+ * merged as soon as the broadcast completes.
+ * @see MergeReplicatedBuffer */
+int MPI_Bcast(void *buffer, int count, MPI_Datatype datatype, int root, MPI_Comm comm);
+
+/*! @brief Replaces \c MPI_File_read_all, merges large buffers at once */
+int MPI_File_read_all(MPI_File fh, void *buf, int count, MPI_Datatype datatype, MPI_Status *status);
+
+/*! @brief Replaces \c MPI_File_read_at_all, merges large buffers at once */
+int MPI_File_read_at_all(MPI_File fh, MPI_Offset offset, void *buf, int count, MPI_Datatype datatype, MPI_Status *status);
+
+/*! @brief Checks whether a buffer filled by a collective should be merged
+ * at once: it is in the shared heap and at least EAGER_MERGE_KB long
+ * @return true if the buffer should be merged */
+bool IsEagerMergeBuffer(const void *buf, size_t len);
+
+/*! @brief Merges whole pages of a buffer that likely holds the same data in
+ * every task of the node, without waiting for the next merge pass. The
+ * first task to get the shared lock moves its pages to the shared region,
+ * the others compare theirs with it and remap.
+ * @param buf Start of the buffer
+ * @param len Length of the buffer */
+void MergeReplicatedBuffer(const void *buf, size_t len);
+
+/*! @brief Finds the width of sharing bits for a number of tasks
+ * @param num_tasks Tasks having a bit
+ * @return 8, 16, 32 or \c MAX_NODE_TASKS bits per slot */
+int SharingBitsWidth(int num_tasks);
+
 /*! @brief Initializes shared region and sets segfault handler 
  * @return None
  */
@@ -280,6 +761,10 @@ void CleanUpSharedData();
  **/
 void AllocateSharedMetadata();
 
+/*! @brief Records the MPI rank of the task in the node id if it is the
+ * lowest of the node so far. Called once MPI is initialized. */
+void RecordNodeId();
+
 /*! @brief Aborts execution. Called upon encountering error. */
 void Fatal();
 
@@ -332,7 +817,9 @@ bool IsCloseToMmapLimit(int newRequest = 0);
 
 /*! @brief Initializes a \c POSIX semaphore after getting it 
  * In linux, semkey has to be an existing filename beginning with / but not
- * having more than 14 chars and more slashes 
+ * having more than 14 chars and more slashes.
+ * The semaphore only serializes startup and teardown, \c SharedLock guards
+ * the shared metadata afterwards.
  * @param SEMKEY Name of the semaphore
  * @param mutex The semaphore address
  * */
@@ -346,6 +833,26 @@ void SignalSem (sem_t *mutex);
  * @param mutex Address of the semaphore */
 void WaitSem (sem_t *mutex);
 
+/*! @brief Initializes the robust, process shared lock in the metadata page
+ * @param lock Address of the lock in shared memory */
+void InitSharedLock(SharedLock *lock);
+
+/*! @brief Takes the inter-process lock guarding shared metadata.
+ * If the previous owner died while holding it, the metadata it was changing
+ * is repaired before returning. Safe to call from the fault handler as the
+ * lock is futex based; taking it twice from the same task is reported
+ * instead of deadlocking. */
+void AcquireSharedLock();
+
+/*! @brief Releases the inter-process lock guarding shared metadata */
+void ReleaseSharedLock();
+
+/*! @brief Repairs shared metadata after the owner of the lock died.
+ * Rolls back the counters to their values when the dead task took the lock,
+ * drops the sharing bits of the dead task and recomputes the shared page count.
+ * @param deadRank Rank of the task that died while holding the lock */
+void RepairSharedMetadata(int deadRank);
+
 /*! @brief SIGSEGV signal handler.
  * Handles write faults for readonly marked shared pages. If the page was never
  * touched, the permission bit is changed and returned. Otherwise, a copy of
@@ -356,6 +863,32 @@ void WaitSem (sem_t *mutex);
  * */ 
 void SigSegvHandler(int signo, siginfo_t * si , void *sc);
 
+/*! @brief Finds the run of pages to unmerge on a write fault
+ * The run grows (1, 16, 64, 256 pages, up to FAULT_AROUND_MAX) while faults
+ * hit the page right after the previous run, and covers only pages of the
+ * same kind (zero or shared) as the faulting page.
+  * @param faultaddr Page address of the write fault
+  * @param is_zero_page Whether the faulting page is a zero page
+ * @return Number of pages to unmerge starting at faultaddr
+ * @see SigSegvHandler */
+int FaultAroundPages(char *faultaddr, bool is_zero_page);
+
+/*! @brief Takes a run of pre-faulted private pages from the page pool,
+  * called with the shared lock held
+  * @param num_pages Number of contiguous pages needed
+ * @return Start of the pages, NULL if the pool has fewer pages
+ * @see RefillPagePool */
+void *PopPoolPages(int num_pages);
+
+/*! @brief Refills the page pool once it is half empty
+ * The pool holds PAGE_POOL_SIZE pre-faulted private pages which the fault
+ * handler mremap()s in place of unmerged pages, so that the unmerge path
+ * does not need an mmap. It is refilled at malloc, outside the handler, and
+ * changed under the shared lock. Its pages are counted as private memory of
+ * the task.
+ * @return None */
+void RefillPagePool();
+
 /*!  @brief SIGBUS signal handler 
   * @see SigSegvHandler
  */
@@ -370,6 +903,12 @@ void SigIntHandler(int signo, siginfo_t *si, void *sc);
  * @return Page number */
 uintptr_t Addr2PageIndex(void *);
 
+/*! @brief Translates page address to the index of its sharing bits.
+ * Pages mapped to node wide slots have their bits after those of the domain
+ * slots.
+ * @return Index in the sharing bits */
+uintptr_t SlotIndex(void *);
+
 /*! @brief Counts the number of tasks sharing a page.
  * @param addr Address of the page
  * @return the Number of sharing processes */
@@ -419,6 +958,13 @@ void SetMultiBits(char *array, char *page_addr, size_t size);
 /*! @brief Resets and returns old value of bit in array corresponding to page address */
 bool ResetAndReturnBit(char *, char *);
 
+/*! @brief Resets bits corresponding to a region, more than 1 page from bitvector array 
+ * @param array Bit vector
+ * @param page_addr Start address of the region
+ * @param size Size of the region
+ * @return true if any of the bits was set */
+bool TestAndResetMultiBits(char *array, char *page_addr, size_t size);
+
 /*! @brief Sets and returns old value of bit in array corresponding to page address */
 bool SetAndReturnBit(char *, char *);
 /*------------------------------ misc routines ------------------------------*/
@@ -444,6 +990,22 @@ uintptr_t AspaceAvlSearchRangeWrapper(uintptr_t start_addr);
  * @return 0 if identical, otherwise the difference as 1 or -1 */
 int MyComparator(const void *key1, const void *key2);
 
+/*! @brief Updates the AVL tree for arena segments mapped or unmapped since
+ * the last call. Called before merge passes and shared allocations, never
+ * with an arena locked. */
+void SyncArenaSegments();
+
+/*! @brief Checks whether an address is in an arena segment, i.e. it is a
+ * chunk of the small object allocator and not a shared allocation
+ * @return true if it is in the region of an arena segment */
+bool IsArenaChunk(void *ptr);
+
+/*! @brief Updates counters and bit vectors for the pages of a region that
+ * is unmapped
+ * @param ptr Start of the region
+ * @param size Size of the region */
+void ReleaseRegionPages(void *ptr, intptr_t size);
+
 /*------------------------------ shm routines -------------------------------*/
 /*!  @brief Merges pages based on frequency of mallocs.
  * When the number of outstanding malloc/free becomes more than x where x is
@@ -456,6 +1018,79 @@ void MergeByALLOC_FREQUENCY();
  */
 void MergeByTHRESHOLD();
 
+/*! @brief Smallest gap between passes of adaptive merge, usec */
+#define ADAPTIVE_MIN_GAP_USEC 1000
+/*! @brief A pass saving less than this percentage of scanned pages has low yield */
+#define ADAPTIVE_LOW_YIELD_PCT 1
+/*! @brief Max multiplier of the gap between passes after passes with low yield */
+#define ADAPTIVE_MAX_BACKOFF 64
+
+/*!  @brief Merges pages based on measured cost and yield of merge passes
+ * A pass is run when due and heap is larger than MIN_MEM_TH. The next pass
+ * is scheduled so that passes take MERGE_OVERHEAD_PCT of run time, using
+ * the average time per scanned page. The gap doubles after every pass
+ * saving few pages, and is reset by a pass with good yield.
+ */
+void MergeByADAPTIVE();
+
+/*! @brief Memory pressure levels of the job found by \c GetMemPressure */
+enum _PRESSURE_LEVELS {
+	PRESSURE_LOW, /**< Plenty of headroom, merging is held back */
+	PRESSURE_NORMAL, /**< Merge metric decides */
+	PRESSURE_HIGH /**< Close to the limit, merged aggressively */
+};
+
+/*! @brief Minimum time between two checks of memory pressure */
+#define PRESSURE_CHECK_USEC 100000
+
+/*! @brief PSI trigger for memory stalls: 100 msec stall in a 1 sec window */
+#define PSI_TRIGGER "some 100000 1000000"
+
+/*! @brief Opens memory usage and limit files of the cgroup v2 of the task
+ * and sets a PSI trigger on its memory.pressure. Falls back to
+ * /proc/meminfo when the cgroup has no memory limit. */
+void InitMemPressure();
+
+/*! @brief Finds memory pressure of the job, at most once every
+ * PRESSURE_CHECK_USEC. Pressure is high when memory usage is above
+ * PRESSURE_HIGH_PCT of the limit or the PSI trigger fired, and low when it
+ * is below PRESSURE_LOW_PCT.
+ * @return One of \c _PRESSURE_LEVELS */
+int GetMemPressure();
+
+/*! @brief Reads memory usage and limit
+ * @param used Output, bytes used
+ * @param limit Output, bytes allowed
+ * @return false if they could not be read */
+bool ReadMemUsage(long long *used, long long *limit);
+
+/*! @brief Applies memory pressure to a merge metric. Under high pressure a
+ * slice of merge pass is run, at most once every PRESSURE_CHECK_USEC. The
+ * gap doubles after every slice saving few pages, like in adaptive merge.
+ * @return true if the merge metric should not run a pass now */
+bool MergeByPRESSURE();
+
+/*! @brief Pages merged between checks of the time budget of a slice */
+#define MERGE_SLICE_CHUNK 1024
+
+/*!  @brief Merges regions from the saved cursor on, page by page in address
+ * order, until the budget is used up. The cursor is saved for the next call.
+ * @param budget_pages Max pages to scan, 0 for no limit
+ * @param budget_usec Max time to spend, 0 for no limit
+ * @return true if the pass reached the end of the heap */
+bool MergeSlice(long budget_pages, long budget_usec);
+
+/*!  @brief Runs a slice of a merge pass and records statistics of the pass
+ * @param budget_pages Max pages to scan, usually MERGE_SLICE_PAGES
+ * @param budget_usec Max time to spend, usually MERGE_SLICE_USEC
+ * @return true if the pass is complete */
+bool RunMergePass(long budget_pages, long budget_usec);
+
+/*!  @brief Checks whether a merge pass is in progress or the heap grew past
+ * the threshold. Ratchets the threshold when a new pass is due.
+ * @return true if a merge pass should run */
+bool IsMergeDue();
+
 /*!  @brief merges pages when the buffer of dirty pages becomes full 
  * @warn Experimental. NOT EXTENSIVELY TESTED */
 void MergeByBUFFERED();
@@ -517,6 +1152,14 @@ void *GetSharedPage(void* addr, bool isFixed);
  */
 void MergeNode2(const void *key, const void *value, const void *data, void *isDirty);
 
+/*! @brief Merges identical pages of a part of a region, if any of its pages
+ * is dirty. Merge policy of the region from the merge profile is applied.
+  * @param node AVL node of the region
+  * @param addr Start address of the part, page aligned
+  * @param size Size of the part
+ * */
+void MergeRegion(const AVLTreeNode *node, uintptr_t addr, size_t size);
+
 /*!  @brief makes a region readonly 
   * @param addr Start address of the region
   * @param len Size of the region
@@ -539,6 +1182,11 @@ uintptr_t GetBacktrace();
  * @return None
  */
 void GetCallStack(void **stack, int depth);
+
+/*! @brief Finds an interned call stack
+ * @param id Id returned by \c InternCallStack
+ * @return The call stack, an empty one for id 0 and \c UNKNOWN_STACK_ID */
+const CallStack *LookupCallStack(uint32_t id);
 /*! @brief Copies and maps pages from private region to shared space
   * @param start Address of the start of the region
   * @param size Size of the region
@@ -552,6 +1200,60 @@ int CopyAndRemapRegion(void *start, size_t size);
  * @return -1 if failure, 0 if successful */ 
 int RemapRegion(void *start, size_t size);
 
+/*! @brief Records the NUMA node the current task runs on */
+void NumaAttachTask();
+
+/*! @brief Sets the placement of a fresh shared mapping before it is filled.
+ * Pages are preferred on the node most tasks run on, interleaved if several
+ * nodes run as many tasks.
+  * @param p0 Start of the shared mapping
+  * @param size Size of the mapping
+ */
+void NumaPreferHome(void *p0, size_t size);
+
+/*! @brief Accounts the current task as sharer of a merged region.
+ * Pages whose sharers mostly run on another node than the page lives on are
+ * moved there.
+  * @param start Address of the start of the region
+  * @param size Size of the region
+  * @param created Whether the current task copied the pages to the shared file
+ */
+void NumaPlaceRegion(void *start, size_t size, bool created);
+
+/*! @brief Drops a reference of a task to a shared page
+  * @param index Index of the page in the shared file
+  * @param rank Rank of the task unmapping the page
+ */
+void NumaLeavePage(uintptr_t index, int rank);
+
+/*! @brief Opens the shared file as a memfd.
+ * The first task of the node creates it and passes it to the others over a
+ * local socket in the abstract namespace, so nothing is left behind in
+ * /dev/shm and the kernel frees the file once the last task exits. Called with
+ * the semaphore held.
+ * @param init_shared Set if the file is created by the current task
+ * @return The file descriptor, -1 if memfds are not available
+ */
+int OpenSharedMemfd(bool *init_shared);
+
+/*! @brief Stops passing the shared file to tasks attaching later */
+void CloseSharedFileSocket();
+
+/*! @brief Puts the current task in the merge domain of the cpu it runs on */
+void AttachMergeDomain();
+
+/*! @brief Sums a page counter over the merge domains
+  * @param counter \c sharedPageCount, \c allProcPrivatePageCount or \c baseCaseTotalPageCount
+ * @return The node wide value of the counter
+ */
+int NodeTotal(int *counter);
+
+/*! @brief Moves the pages of the current task from slots of its merge domain
+ * to node wide slots where another domain holds the same contents.
+ * Run after each complete merge pass if merge domains are used.
+ */
+void PromoteDomainSlots();
+
 /*! @brief Remaps the pages to the zero page 
   * @param start Address of the start of the region
   * @param size Size of the region
@@ -570,22 +1272,187 @@ int RemapToZero(void *start, size_t size);
  * */
 int MergeManyPages(uintptr_t start_addr, size_t size, const void* data);
 
+/*! @brief Classifies pages for merging without changing any mapping, so
+ * that disjoint ranges can be classified by different threads. Finding zero
+ * pages and comparing with the shared copy are done here.
+  * @param start_addr Offset of the first page
+  * @param num_pages Number of pages
+  * @param shared_view Shared region mapped for these pages
+  * @param classes Output, one \c _PAGE_CLASSES per page
+  * @param curr_time Time of the merge pass for merge history
+ * @return None */
+void ClassifyPages(uintptr_t start_addr, size_t num_pages, char *shared_view, uint8_t *classes, uint64_t curr_time);
+
+/*! @brief Classifies a window of pages into \c pageClass, split across
+ * MERGE_THREADS threads including the caller
+ * @see ClassifyPages */
+void ClassifyWindow(uintptr_t start_addr, size_t num_pages, char *shared_view, uint64_t curr_time);
+
+/*! @brief Classifies chunks of the posted window until none is left */
+void ClassifyChunks();
+
+/*! @brief Main loop of a merge thread, waits for windows to classify */
+void *MergeWorker(void *arg);
+
+/*! @brief Starts MERGE_THREADS - 1 merge threads */
+void StartMergeThreads();
+
+/*! @brief Stops and joins merge threads */
+void StopMergeThreads();
+
+/*! @brief Forks the process becoming the merge daemon if MERGE_DAEMON is
+ * set. Called before MPI is initialized, so that the child does not inherit
+ * memory registered by the MPI library. The child waits for the shared file
+ * and exits if another task of the node forked the daemon. */
+void ForkMergeDaemon();
+
+/*! @brief Attaches to the merge daemon of the node. The first task sets up
+ * the daemon area in the shared file and passes the file to its forked
+ * child, which becomes the daemon. Called with the semaphore held.
+ * @param init_shared Whether this task initialized the shared metadata */
+void AttachMergeDaemon(bool init_shared);
+
+/*! @brief Detaches from the merge daemon, called at clean up */
+void DetachMergeDaemon();
+
+/*! @brief Main loop of the merge daemon. Serves mailboxes until all tasks
+ * are detached or dead, never returns. */
+void MergeDaemonMain();
+
+/*! @brief Compares pages of a task for a mailbox request, called by the
+ * daemon. Pages are read with \c process_vm_readv() a few at a time and
+ * compared while in cache.
+ * @return true if all candidate pages could be read */
+bool ServeMailbox(MergeMailbox *box);
+
+/*! @brief Has the merge daemon classify a window of pages into \c pageClass.
+ * Cheap bitvector checks are done by the task, page compares by the daemon
+ * and the task. Called without the shared lock, see \c RevalidateWindow().
+ * @param shared_view Shared region mapped for the window
+ * @return false if the daemon is not usable, the caller then classifies
+ * the pages itself */
+bool ClassifyByDaemon(uintptr_t start_addr, size_t num_pages, char *shared_view, uint64_t curr_time);
+
+/*! @brief Drops classes of a window classified without the shared lock
+ * which other tasks invalidated meanwhile. Called with the lock held.
+ * @param shared_view Shared region mapped for the window
+ * @param slots_filled Whether slots were filled since the lock was released,
+ * shareable pages are then compared again */
+void RevalidateWindow(uintptr_t start_addr, size_t num_pages, char *shared_view, bool slots_filled);
+
+#ifdef COLLECT_MALLOC_STAT
+/*! @brief Accounts pages of a writable region first touched since the last pass
+ * Used with LAZY_TOUCH_STAT, where first writes do not fault. Resident pages
+ * reported by mincore() are marked initialized and added to the shared counters.
+  * @param start_addr Address of the start of the region
+  * @param size Size of the region
+ * @return true if some pages of the region are still untouched
+ * */
+bool SyncTouchedPages(uintptr_t start_addr, size_t size);
+#endif /* COLLECT_MALLOC_STAT */
+
 /*------------------------------ Profile based merge routines -------------------------------*/
+/*! 
+ * @brief Returns current time of the monotonic clock in microseconds
+ * */
+uint64_t GetMonotonicTime();
+
 /*! 
  * @brief Checks merge profile to decide if the page should be merged
- * If the page is mergeable, updates time.
+ * After n consecutive failed merges, the page is not merged for
+ * MERGE_STABLE_MS * 2^n since its last split.
  * @param pageAddr Address of the page under consideration for merge.
- * @param currTime Current Time. lastMergeTime is updated if the page can be merged.
+ * @param currTime Current Time.
  * @return Whether the page is mergeable
  * */
-bool CheckIfMergeable(void *pageAddr, uint32_t currTime);
+bool CheckIfMergeable(void *pageAddr, uint64_t currTime);
+
+/*! 
+ * @brief Records the merge time of pages, called once they are remapped, so
+ * that pages found unequal or not shareable do not count as merged.
+ * @param start Address of the first page
+ * @param size Size of the pages
+ * */
+void RecordMergeTime(void *start, size_t size);
 
 /*! 
  * @brief Updates merge profile.
- * If the split is before a threshold of time, it is considered a failure.
+ * If the split is within MERGE_STABLE_MS of the merge, it is considered a failure.
  * @param pageAddr Address of the page having segfault.
  * @param currTime Current Time. lastMergeTime is compared with it to see if the last merge was successful.
  * */
-void UpdateMergeHist(void *pageAddr, uint32_t currTime);
+void UpdateMergeHist(void *pageAddr, uint64_t currTime);
+
+/*! 
+ * @brief Clears merge profile of a region, so that a new allocation at the
+ * same address does not inherit it.
+ * @param start Address of the start of the region
+ * @param size Size of the region
+ * */
+void ResetMergeHist(void *start, size_t size);
+
+/*------------------------------ Merge profile routines -------------------------------*/
+/*! 
+ * @brief Maps the profile table. With USE_PROF, loads the profile written
+ * by an earlier run with CREATE_PROF.
+ * */
+void InitMergeProfile();
+
+/*! 
+ * @brief Finds the profile key of an allocation site
+ * @param creator Return address of the allocation site
+ * @return Hash of name of the loaded object and the offset of creator in it
+ * */
+uint64_t SiteKey(uintptr_t creator);
+
+/*! 
+ * @brief Finds the profile entry of a site in the profile table
+ * @param key Key of the site from \c SiteKey()
+ * @param create Whether to add an entry if not found
+ * @return Index of the entry, -1 if not found or the table is full
+ * */
+int FindProfSite(uint64_t key, bool create);
+
+/*! 
+ * @brief Records which pages of a region are merged in profile of its site
+ * @param start Address of the start of the region
+ * @param size Size of the region
+ * @param creator Return address of the allocation site
+ * */
+void RecordMergeProfile(uintptr_t start, size_t size, uintptr_t creator);
+
+/*! 
+ * @brief Sorts and coalesces runs of a site, joins the runs across the
+ * smallest gaps until at most max_runs are left.
+ * @param site Profile entry
+ * @param max_runs Max number of runs to keep
+ * */
+void CompactProfRuns(ProfSite *site, uint32_t max_runs);
+
+/*! 
+ * @brief Writes profile table to mergeprofile.<rank>
+ * */
+void WriteMergeProfile();
+
+/*! 
+ * @brief Merges the profiled runs of pages of a part of a region
+ * @param node AVL node of the region
+ * @param addr Start address of the part
+ * @param size Size of the part
+ * @return Number of merged pages
+ * */
+int MergeProfRuns(const AVLTreeNode *node, uintptr_t addr, size_t size);
+
+/*! 
+ * @brief Merges the regions with \c POLICY_EAGER kept in the eager region
+ * list, without walking the whole allocation record
+ * */
+void MergeEagerRegions();
+
+/*! 
+ * @brief Records merge profile of a region while traversing the AVL tree,
+ * parameters are same as \c MergeNode2()
+ * */
+void RecordProfNode(const void *key, const void *value, const void *data, void *isDirty);
 
 #endif /* __SHAREDHEAP_H__ */
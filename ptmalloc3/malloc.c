@@ -1497,6 +1497,25 @@ static FORCEINLINE int win32munmap(void* ptr, size_t size) {
                                          (void)(nsz), (void)(mv),MFAIL)
 #endif /* HAVE_MMAP && HAVE_MREMAP */
 
+/*
+  Segments of an mspace may be mapped in the SBLLmalloc heap, so that the
+  pages of small chunks are merged too.  Segments are shrunk by unmapping
+  their tail there, as the heap has to see it.  Directly mmapped chunks
+  keep using CALL_MMAP.
+*/
+#ifdef ENABLE_SHM_MALLOC
+/* declared in Globals.h, which clashes with internal routines of this file */
+void* ShmArenaMmapWrapper(size_t sz, size_t head, size_t tail);
+int   ShmArenaMunmapWrapper(void *ptr, size_t sz);
+#define CALL_SEGMENT_MMAP(s)       ShmArenaMmapWrapper((s), 0, TOP_FOOT_SIZE)
+#define CALL_SEGMENT_MUNMAP(a, s)  ShmArenaMunmapWrapper((a), (s))
+#define CALL_SEGMENT_MREMAP(addr, osz, nsz, mv) MFAIL
+#else  /* ENABLE_SHM_MALLOC */
+#define CALL_SEGMENT_MMAP(s)       CALL_MMAP(s)
+#define CALL_SEGMENT_MUNMAP(a, s)  CALL_MUNMAP((a), (s))
+#define CALL_SEGMENT_MREMAP(addr, osz, nsz, mv) CALL_MREMAP((addr), (osz), (nsz), (mv))
+#endif /* ENABLE_SHM_MALLOC */
+
 #if HAVE_MORECORE
 #define CALL_MORECORE(S)     MORECORE(S)
 #else  /* HAVE_MORECORE */
@@ -3809,7 +3828,7 @@ static void* sys_alloc(mstate m, size_t nb) {
     size_t req = nb + TOP_FOOT_SIZE + SIZE_T_ONE;
     size_t rsize = granularity_align(req);
     if (rsize > nb) { /* Fail if wraps around zero */
-      char* mp = (char*)(CALL_MMAP(rsize));
+      char* mp = (char*)(CALL_SEGMENT_MMAP(rsize));
       if (mp != CMFAIL) {
         tbase = mp;
         tsize = rsize;
@@ -3936,7 +3955,7 @@ static size_t release_unused_segments(mstate m) {
         else {
           unlink_large_chunk(m, tp);
         }
-        if (CALL_MUNMAP(base, size) == 0) {
+        if (CALL_SEGMENT_MUNMAP(base, size) == 0) {
           released += size;
           m->footprint -= size;
           /* unlink obsoleted record */
@@ -3978,8 +3997,8 @@ static int sys_trim(mstate m, size_t pad) {
               !has_segment_link(m, sp)) { /* can't shrink if pinned */
             size_t newsize = sp->size - extra;
             /* Prefer mremap, fall back to munmap */
-            if ((CALL_MREMAP(sp->base, sp->size, newsize, 0) != MFAIL) ||
-                (CALL_MUNMAP(sp->base + newsize, extra) == 0)) {
+            if ((CALL_SEGMENT_MREMAP(sp->base, sp->size, newsize, 0) != MFAIL) ||
+                (CALL_SEGMENT_MUNMAP(sp->base + newsize, extra) == 0)) {
               released = extra;
             }
           }
@@ -4849,7 +4868,7 @@ size_t destroy_mspace(mspace msp) {
       flag_t flag = sp->sflags;
       sp = sp->next;
       if ((flag & IS_MMAPPED_BIT) && !(flag & EXTERN_BIT) &&
-          CALL_MUNMAP(base, size) == 0)
+          CALL_SEGMENT_MUNMAP(base, size) == 0)
         freed += size;
     }
   }
@@ -44,6 +44,9 @@ PERFORMANCE OF THIS SOFTWARE.
 #include <malloc-machine.h>
 
 #include "malloc-2.8.3.h"
+#ifdef ENABLE_SHM_MALLOC
+#include <Globals.h>
+#endif /*ENABLE_SHM_MALLOC*/
 
 /* ----------------------------------------------------------------------- */
 
@@ -186,7 +189,7 @@ void *(*__morecore)(ptrdiff_t) = __default_morecore;
 /*----------------------------------------------------------------------*/
 
 /* Arenas */
-static tsd_key_t arena_key;
+static TSD_KEY_STORAGE tsd_key_t arena_key;
 static mutex_t list_lock;
 
 /* Arena structure */
@@ -201,6 +204,11 @@ struct malloc_arena {
   /* Linked list */
   struct malloc_arena *next;
 
+  /* Chunks freed by threads not caching this arena, linked through
+     their first word.  Pushed without locking, freed by the next
+     thread that locks the arena. */
+  void * volatile remote_free;
+
   /* Space for mstate.  The size is just the minimum such that
      create_mspace_with_base can be successfully called.  */
   char buf_[pad_request(sizeof(struct malloc_state)) + TOP_FOOT_SIZE +
@@ -214,9 +222,12 @@ struct malloc_arena {
 #define chunk_non_main_arena(p) ((p)->head & NON_MAIN_ARENA)
 
 static struct malloc_arena* _int_new_arena(size_t size);
+static struct malloc_arena* arena_get_new(size_t size);
 
-/* Buffer for the main arena. */
-static struct malloc_arena main_arena;
+/* Buffer for the main arena.  Aligned like the chunks, as the mspace
+   starts at a fixed offset in it. */
+static struct malloc_arena main_arena
+  __attribute__ ((aligned (MALLOC_ALIGNMENT)));
 
 /* For now, store arena in footer.  This means typically 4bytes more
    overhead for each non-main-arena chunk, but is fast and easy to
@@ -262,12 +273,61 @@ static struct malloc_arena main_arena;
     ptr = arena_get2(ptr, (size)); \
 } while(0)
 
+/* A thread that has no arena yet, or finds its arena locked, moves to
+   the arena of the cpu it runs on, so that threads on different cpus
+   do not contend for arenas and a thread keeps its arena until it is
+   contended.  The table is filled as arenas are created, cpus beyond
+   its size share slots. */
+
+#if !defined NO_THREADS && defined __linux__
+# define ARENA_PER_CPU 1
+#endif
+
+#ifdef ARENA_PER_CPU
+
+#ifndef ARENA_CPU_SLOTS
+# define ARENA_CPU_SLOTS 256
+#endif
+
+static struct malloc_arena* volatile cpu_arenas[ARENA_CPU_SLOTS];
+
+/* Returns the locked arena of the current cpu, creates it if there is
+   none yet, or returns 0 if it is locked by another thread. */
+static struct malloc_arena*
+arena_get_cpu(struct malloc_arena* a_tsd, size_t size)
+{
+  struct malloc_arena* a;
+  int cpu = sched_getcpu();
+
+  if(cpu < 0)
+    return 0;
+  a = cpu_arenas[cpu % ARENA_CPU_SLOTS];
+  if(a) {
+    if(a == a_tsd || mutex_trylock(&a->mutex))
+      return 0;
+    THREAD_STAT(++(a->stat_lock_loop));
+    tsd_setspecific(arena_key, (void *)a);
+    return a;
+  }
+  a = arena_get_new(size);
+  if(a) /* if another thread filled the slot first, keep this one anyway */
+    __sync_bool_compare_and_swap(&cpu_arenas[cpu % ARENA_CPU_SLOTS],
+                                 (struct malloc_arena*)0, a);
+  return a;
+}
+
+#endif /* ARENA_PER_CPU */
+
 static struct malloc_arena*
 arena_get2(struct malloc_arena* a_tsd, size_t size)
 {
   struct malloc_arena* a;
-  int err;
 
+#ifdef ARENA_PER_CPU
+  a = arena_get_cpu(a_tsd, size);
+  if(a)
+    return a;
+#endif
   if(!a_tsd)
     a = a_tsd = &main_arena;
   else {
@@ -302,6 +362,16 @@ arena_get2(struct malloc_arena* a_tsd, size_t size)
   (void)mutex_unlock(&list_lock);
 
   /* Nothing immediately available, so generate a new arena.  */
+  return arena_get_new(size);
+}
+
+/* Creates a new arena, binds it to the thread and returns it locked. */
+static struct malloc_arena*
+arena_get_new(size_t size)
+{
+  struct malloc_arena* a;
+  int err;
+
   a = _int_new_arena(size);
   if(!a)
     return 0;
@@ -337,7 +407,14 @@ _int_new_arena(size_t size)
     mmap_sz = ARENA_SIZE_MIN;
   /* conservative estimate for page size */
   mmap_sz = (mmap_sz + 8191) & ~(size_t)8191;
+#ifdef ENABLE_SHM_MALLOC
+  /* the arena header and the segment footer are written all the time */
+  a = ShmArenaMmapWrapper(mmap_sz,
+			  MSPACE_OFFSET + pad_request(sizeof(struct malloc_state)),
+			  TOP_FOOT_SIZE);
+#else /*ENABLE_SHM_MALLOC*/
   a = CALL_MMAP(mmap_sz);
+#endif /*ENABLE_SHM_MALLOC*/
   if ((char*)a == (char*)-1)
     return 0;
 
@@ -346,7 +423,11 @@ _int_new_arena(size_t size)
 			      0);
 
   if (!m) { 
+#ifdef ENABLE_SHM_MALLOC
+    ShmArenaMunmapWrapper(a, mmap_sz);
+#else /*ENABLE_SHM_MALLOC*/
     CALL_MUNMAP(a, mmap_sz);
+#endif /*ENABLE_SHM_MALLOC*/
     a = 0;
   } else {
     /*a->next = NULL;*/
@@ -631,6 +712,214 @@ ptmalloc_unlock_all2(void)
 
 #endif /* !defined NO_THREADS */
 
+/*------------------------ Thread caches. ------------------------------*/
+
+/* Small chunks freed by a thread are kept in a per-thread cache and
+   handed out again without locking an arena.  Bins are bounded: an
+   empty bin is refilled, and an overfull bin is flushed, with a batch
+   of chunks under a single arena lock.  All chunks in a cache belong
+   to the arena it was last refilled from.  Chunks of other arenas,
+   e.g. allocated by another thread, go to the remote-free list of
+   their arena. */
+
+#ifndef USE_TCACHE
+# if defined _PTHREAD_MALLOC_MACHINE_H && defined __GNUC__
+#  define USE_TCACHE 1
+# else
+#  define USE_TCACHE 0
+# endif
+#endif
+
+#if USE_TCACHE
+
+#define TCACHE_QUANTUM   16  /* size classes are this far apart */
+#define TCACHE_BINS      32  /* size classes, up to 512 bytes */
+#ifndef TCACHE_BIN_MAX
+# define TCACHE_BIN_MAX  32  /* chunks kept per bin */
+#endif
+#define TCACHE_BATCH     (TCACHE_BIN_MAX/2) /* chunks moved in one lock */
+
+/* States of a thread cache */
+#define TCACHE_UNUSED    0
+#define TCACHE_ACTIVE    1
+#define TCACHE_DEAD      2   /* thread exiting, nothing is cached */
+
+struct tcache {
+  struct malloc_arena* arena;   /* arena of the cached chunks */
+  int state;
+  int counts[TCACHE_BINS];
+  void* bins[TCACHE_BINS];      /* chunks linked through their first word */
+};
+
+static __thread struct tcache tcache
+  __attribute__ ((tls_model ("initial-exec")));
+static pthread_key_t tcache_key; /* to flush the cache at thread exit */
+
+/* Usable size of an in-use chunk, without the arena footer. */
+static size_t
+tcache_usable(mchunkptr p)
+{
+  size_t sz = chunksize(p) - overhead_for(p);
+  return chunk_non_main_arena(p) ? sz - FOOTER_OVERHEAD : sz;
+}
+
+/* Pushes a chunk on the remote-free list of its arena. */
+static void
+arena_push_remote(struct malloc_arena* ar_ptr, void* mem)
+{
+  void* head;
+
+  do {
+    head = ar_ptr->remote_free;
+    *(void**)mem = head;
+  } while(!__sync_bool_compare_and_swap(&ar_ptr->remote_free, head, mem));
+}
+
+/* Frees the chunks on the remote-free list of a locked arena.  The
+   whole list is taken at once, so pushes never see a popped head. */
+static void
+arena_drain_remote(struct malloc_arena* ar_ptr)
+{
+  void *mem, *next;
+
+  if(!ar_ptr->remote_free)
+    return;
+  mem = __sync_lock_test_and_set(&ar_ptr->remote_free, (void*)0);
+  for(; mem; mem = next) {
+    next = *(void**)mem;
+    mspace_free(arena_to_mspace(ar_ptr), mem);
+  }
+}
+
+/* Frees chunks of a bin to the cache arena until `keep' are left. */
+static void
+tcache_flush(struct tcache* tc, int bin, int keep)
+{
+  struct malloc_arena* ar_ptr = tc->arena;
+  void* mem;
+
+  (void)mutex_lock(&ar_ptr->mutex);
+  arena_drain_remote(ar_ptr);
+  while(tc->counts[bin] > keep) {
+    mem = tc->bins[bin];
+    tc->bins[bin] = *(void**)mem;
+    tc->counts[bin]--;
+    mspace_free(arena_to_mspace(ar_ptr), mem);
+  }
+  (void)mutex_unlock(&ar_ptr->mutex);
+}
+
+/* Allocates a batch of chunks for an empty bin and returns one of
+   them.  If the thread got another arena, the cached chunks of the
+   old one are handed back through its remote-free list. */
+static void*
+tcache_refill(struct tcache* tc, int bin)
+{
+  struct malloc_arena* ar_ptr;
+  size_t bytes = (size_t)(bin + 1)*TCACHE_QUANTUM;
+  void *victim, *mem;
+  int i;
+
+  arena_get(ar_ptr, bytes + FOOTER_OVERHEAD);
+  if(!ar_ptr)
+    return 0;
+  if(ar_ptr != tc->arena) {
+    for(i = 0; i < TCACHE_BINS; i++) {
+      for(mem = tc->bins[i]; mem; mem = victim) {
+	victim = *(void**)mem;
+	arena_push_remote(tc->arena, mem);
+      }
+      tc->bins[i] = 0;
+      tc->counts[i] = 0;
+    }
+    tc->arena = ar_ptr;
+  }
+  arena_drain_remote(ar_ptr);
+  if(ar_ptr != &main_arena)
+    bytes += FOOTER_OVERHEAD;
+  victim = mspace_malloc(arena_to_mspace(ar_ptr), bytes);
+  if(victim && ar_ptr != &main_arena)
+    set_non_main_arena(victim, ar_ptr);
+  for(i = 1; victim && i < TCACHE_BATCH; i++) {
+    mem = mspace_malloc(arena_to_mspace(ar_ptr), bytes);
+    if(!mem)
+      break;
+    if(ar_ptr != &main_arena)
+      set_non_main_arena(mem, ar_ptr);
+    *(void**)mem = tc->bins[bin];
+    tc->bins[bin] = mem;
+    tc->counts[bin]++;
+  }
+  (void)mutex_unlock(&ar_ptr->mutex);
+  return victim;
+}
+
+/* Allocates a chunk of at most TCACHE_BINS*TCACHE_QUANTUM bytes. */
+static void*
+tcache_malloc(size_t bytes)
+{
+  struct tcache* tc = &tcache;
+  int bin = bytes ? (int)((bytes - 1)/TCACHE_QUANTUM) : 0;
+  void* mem = tc->bins[bin];
+
+  if(mem) {
+    tc->bins[bin] = *(void**)mem;
+    tc->counts[bin]--;
+    return mem;
+  }
+  if(tc->state == TCACHE_UNUSED) {
+    tc->state = TCACHE_ACTIVE;
+    pthread_setspecific(tcache_key, tc);
+  }
+  return tcache_refill(tc, bin);
+}
+
+/* Caches a freed chunk, or returns 0 if it is not cached. */
+static int
+tcache_free(void* mem, mchunkptr p)
+{
+  struct tcache* tc = &tcache;
+  struct malloc_arena* ar_ptr;
+  size_t usable;
+  int bin;
+
+  if(tc->state != TCACHE_ACTIVE)
+    return 0;
+  usable = tcache_usable(p);
+  if(usable < TCACHE_QUANTUM || usable >= (TCACHE_BINS + 1)*TCACHE_QUANTUM)
+    return 0;
+  ar_ptr = arena_for_chunk(p);
+  if(ar_ptr != tc->arena) {
+    arena_push_remote(ar_ptr, mem);
+    return 1;
+  }
+  bin = (int)(usable/TCACHE_QUANTUM) - 1;
+  *(void**)mem = tc->bins[bin];
+  tc->bins[bin] = mem;
+  if(++tc->counts[bin] > TCACHE_BIN_MAX)
+    tcache_flush(tc, bin, TCACHE_BIN_MAX - TCACHE_BATCH);
+  return 1;
+}
+
+/* Thread exit: give all cached chunks back. */
+static void
+tcache_destroy(void* arg)
+{
+  struct tcache* tc = (struct tcache*)arg;
+  int bin;
+
+  tc->state = TCACHE_DEAD;
+  for(bin = 0; bin < TCACHE_BINS; bin++)
+    if(tc->counts[bin])
+      tcache_flush(tc, bin, 0);
+}
+
+#else /* USE_TCACHE */
+
+#define arena_drain_remote(ar_ptr) do ; while(0)
+
+#endif /* USE_TCACHE */
+
 /*---------------------------------------------------------------------*/
 
 #if !(USE_STARTER & 2)
@@ -677,6 +966,9 @@ ptmalloc_init(void)
   mutex_init(&list_lock);
   tsd_key_create(&arena_key, NULL);
   tsd_setspecific(arena_key, (void *)&main_arena);
+#if USE_TCACHE
+  pthread_key_create(&tcache_key, tcache_destroy);
+#endif
   thread_atfork(ptmalloc_lock_all, ptmalloc_unlock_all, ptmalloc_unlock_all2);
 #ifndef NO_THREADS
 # if USE_STARTER & 1
@@ -718,9 +1010,6 @@ ptmalloc_init(void)
 
 /*------------------------ Public wrappers. --------------------------------*/
 #include <internal-routines.h>
-#ifdef ENABLE_SHM_MALLOC
-#include <Globals.h>
-#endif /*ENABLE_SHM_MALLOC*/
 
 void*
 public_mALLOc(size_t bytes)
@@ -750,9 +1039,14 @@ internal_malloc(size_t bytes)
   if (hook != NULL)
     return (*hook)(bytes, RETURN_ADDRESS (0));
 
+#if USE_TCACHE
+  if (bytes <= TCACHE_BINS*TCACHE_QUANTUM && tcache.state != TCACHE_DEAD)
+    return tcache_malloc(bytes);
+#endif
   arena_get(ar_ptr, bytes + FOOTER_OVERHEAD);
   if (!ar_ptr)
     return 0;
+  arena_drain_remote(ar_ptr);
   if (ar_ptr != &main_arena)
     bytes += FOOTER_OVERHEAD;
   victim = mspace_malloc(arena_to_mspace(ar_ptr), bytes);
@@ -798,6 +1092,10 @@ void internal_free(void* mem)
     return;
   }
 
+#if USE_TCACHE
+  if (tcache_free(mem, p))
+    return;
+#endif
   ar_ptr = arena_for_chunk(p);
 #if THREAD_STATS
   if(!mutex_trylock(&ar_ptr->mutex))
@@ -809,6 +1107,7 @@ void internal_free(void* mem)
 #else
   (void)mutex_lock(&ar_ptr->mutex);
 #endif
+  arena_drain_remote(ar_ptr);
   mspace_free(arena_to_mspace(ar_ptr), mem);
   (void)mutex_unlock(&ar_ptr->mutex);
 }
@@ -868,6 +1167,7 @@ internal_realloc(void* oldmem, size_t bytes)
 #else
   (void)mutex_lock(&ar_ptr->mutex);
 #endif
+  arena_drain_remote(ar_ptr);
 
 #ifndef NO_THREADS
   /* As in malloc(), remember this arena for the next allocation. */
@@ -919,6 +1219,7 @@ void* internal_memalign(size_t alignment, size_t bytes)
 	    bytes + FOOTER_OVERHEAD + alignment + MIN_CHUNK_SIZE);
   if(!ar_ptr)
     return 0;
+  arena_drain_remote(ar_ptr);
 
   if (ar_ptr != &main_arena)
     bytes += FOOTER_OVERHEAD;
@@ -955,6 +1256,7 @@ internal_valloc(size_t bytes)
   arena_get(ar_ptr, bytes + FOOTER_OVERHEAD + MIN_CHUNK_SIZE);
   if(!ar_ptr)
     return 0;
+  arena_drain_remote(ar_ptr);
   if (ar_ptr != &main_arena)
     bytes += FOOTER_OVERHEAD;
   p = mspace_memalign(arena_to_mspace(ar_ptr), 4096, bytes);
@@ -1038,6 +1340,7 @@ internal_calloc(size_t n_elements, size_t elem_size)
   arena_get(ar_ptr, bytes + FOOTER_OVERHEAD);
   if(!ar_ptr)
     return 0;
+  arena_drain_remote(ar_ptr);
 
   if (ar_ptr != &main_arena)
     bytes += FOOTER_OVERHEAD;
@@ -1071,6 +1374,7 @@ internal_icalloc(size_t n, size_t elem_size, void* chunks[])
   arena_get(ar_ptr, n*(elem_size + FOOTER_OVERHEAD));
   if (!ar_ptr)
     return 0;
+  arena_drain_remote(ar_ptr);
 
   if (ar_ptr != &main_arena)
     elem_size += FOOTER_OVERHEAD;
@@ -1104,6 +1408,7 @@ internal_icomalloc(size_t n, size_t sizes[], void* chunks[])
   arena_get(ar_ptr, n*sizeof(size_t));
   if (!ar_ptr)
     return 0;
+  arena_drain_remote(ar_ptr);
 
   if (ar_ptr != &main_arena) {
     /* Temporary m_sizes[] array is ugly but it would be surprising to
@@ -1165,6 +1470,7 @@ internal_mtrim(size_t s)
   int result;
 
   (void)mutex_lock(&main_arena.mutex);
+  arena_drain_remote(&main_arena); /* remote frees can be trimmed too */
   result = mspace_trim(arena_to_mspace(&main_arena), s);
   (void)mutex_unlock(&main_arena.mutex);
   return result;
@@ -1225,6 +1531,10 @@ internal_mstats(void)
 #if THREAD_STATS
   long stat_lock_direct = 0, stat_lock_loop = 0, stat_lock_wait = 0;
 #endif
+#ifdef MUTEX_STATS
+  long stat_spin = 0, stat_futex_wait = 0;
+  unsigned long long stat_wait_cycles = 0, stat_hold_cycles = 0;
+#endif
 
   if(__malloc_initialized < 0)
     ptmalloc_init ();
@@ -1237,6 +1547,12 @@ internal_mstats(void)
     stat_lock_direct += ar_ptr->stat_lock_direct;
     stat_lock_loop += ar_ptr->stat_lock_loop;
     stat_lock_wait += ar_ptr->stat_lock_wait;
+#endif
+#ifdef MUTEX_STATS
+    stat_spin += ar_ptr->mutex.stat_spin;
+    stat_futex_wait += ar_ptr->mutex.stat_futex_wait;
+    stat_wait_cycles += ar_ptr->mutex.stat_wait_cycles;
+    stat_hold_cycles += ar_ptr->mutex.stat_hold_cycles;
 #endif
     if (MALLOC_DEBUG > 1) {
       struct malloc_segment* mseg = &msp->seg;
@@ -1259,6 +1575,12 @@ internal_mstats(void)
   if (main_arena.stat_starter > 0)
     fprintf(stderr, "starter hooks    = %10ld\n", main_arena.stat_starter);
 #endif
+#ifdef MUTEX_STATS
+  fprintf(stderr, "lock spins       = %10ld\n", stat_spin);
+  fprintf(stderr, "lock futex waits = %10ld\n", stat_futex_wait);
+  fprintf(stderr, "lock wait cycles = %10llu\n", stat_wait_cycles);
+  fprintf(stderr, "lock hold cycles = %10llu\n", stat_hold_cycles);
+#endif
 }
 
 size_t
@@ -49,6 +49,10 @@ typedef void *tsd_key_t;
 
 #endif /* !defined mutex_init */
 
+#ifndef TSD_KEY_STORAGE
+# define TSD_KEY_STORAGE
+#endif
+
 #ifndef atomic_full_barrier
 # define atomic_full_barrier() __asm ("" ::: "memory")
 #endif
@@ -29,55 +29,116 @@ PERFORMANCE OF THIS SOFTWARE.
 
 #undef thread_atfork_static
 
-/* Use fast inline spinlocks with gcc.  */
+/* Use fast inline locks with gcc: spin for a bounded time, then sleep
+   in the kernel with a futex until the owner wakes us up.  */
 #if (defined __i386__ || defined __x86_64__) && defined __GNUC__ && \
-    !defined USE_NO_SPINLOCKS
+    defined __linux__ && !defined USE_NO_SPINLOCKS
 
-#include <time.h>
-#include <sched.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+/* Number of pause loops before a thread sleeps on the futex. */
+#ifndef MUTEX_SPIN_COUNT
+# define MUTEX_SPIN_COUNT 100
+#endif
+
+#if defined THREAD_STATS && THREAD_STATS
+/* Lock statistics are kept in the mutex and updated by its owner. */
+# define MUTEX_STATS 1
+#endif
 
 typedef struct {
-  volatile unsigned int lock;
+  volatile int lock;    /* 0: free, 1: locked, 2: locked, maybe waiters */
   int pad0_;
+#ifdef MUTEX_STATS
+  long stat_spin;       /* pause loops spinning for the lock */
+  long stat_futex_wait; /* sleeps on the futex */
+  unsigned long long stat_wait_cycles; /* cycles spent waiting for the lock */
+  unsigned long long stat_hold_cycles; /* cycles the lock was held */
+  unsigned long long lock_tsc;         /* time stamp of the last lock */
+#endif
 } mutex_t;
 
 #define MUTEX_INITIALIZER          { 0 }
 #define mutex_init(m)              ((m)->lock = 0)
-static inline int mutex_lock(mutex_t *m) {
-  int cnt = 0, r;
-  struct timespec tm;
 
-  for(;;) {
-    __asm__ __volatile__
-      ("xchgl %0, %1"
-       : "=r"(r), "=m"(m->lock)
-       : "0"(1), "m"(m->lock)
-       : "memory");
-    if(!r)
-      return 0;
-    if(cnt < 50) {
-      sched_yield();
-      cnt++;
-    } else {
-      tm.tv_sec = 0;
-      tm.tv_nsec = 2000001;
-      nanosleep(&tm, NULL);
-      cnt = 0;
-    }
-  }
+static inline void mutex_pause(void) {
+  __asm__ __volatile__ ("pause" : : : "memory");
 }
-static inline int mutex_trylock(mutex_t *m) {
-  int r;
 
+static inline int mutex_xchg(mutex_t *m, int v) {
   __asm__ __volatile__
     ("xchgl %0, %1"
-     : "=r"(r), "=m"(m->lock)
-     : "0"(1), "m"(m->lock)
+     : "=r"(v), "=m"(m->lock)
+     : "0"(v), "m"(m->lock)
      : "memory");
-  return r;
+  return v;
+}
+
+#ifdef MUTEX_STATS
+static inline unsigned long long mutex_tsc(void) {
+  unsigned int lo, hi;
+  __asm__ __volatile__ ("rdtsc" : "=a"(lo), "=d"(hi));
+  return ((unsigned long long)hi << 32) | lo;
+}
+#endif
+
+static inline int mutex_trylock(mutex_t *m) {
+  if(__sync_val_compare_and_swap(&m->lock, 0, 1))
+    return 1;
+#ifdef MUTEX_STATS
+  m->lock_tsc = mutex_tsc();
+#endif
+  return 0;
+}
+static inline int mutex_lock(mutex_t *m) {
+  int spin = 0;
+#ifdef MUTEX_STATS
+  long waits = 0;
+  unsigned long long start;
+#endif
+
+  if(!__sync_val_compare_and_swap(&m->lock, 0, 1)) {
+#ifdef MUTEX_STATS
+    m->lock_tsc = mutex_tsc();
+#endif
+    return 0;
+  }
+#ifdef MUTEX_STATS
+  start = mutex_tsc();
+#endif
+  /* the owner should be out soon, do not leave the cpu yet */
+  for(;;) {
+    if(m->lock == 0 && !__sync_val_compare_and_swap(&m->lock, 0, 1))
+      goto locked;
+    if(spin == MUTEX_SPIN_COUNT)
+      break;
+    mutex_pause();
+    spin++;
+  }
+  /* mark the lock contended, so that the owner wakes us up on unlock */
+  while(mutex_xchg(m, 2)) {
+    syscall(SYS_futex, &m->lock, FUTEX_WAIT_PRIVATE, 2, NULL, NULL, 0);
+#ifdef MUTEX_STATS
+    waits++;
+#endif
+  }
+ locked:
+#ifdef MUTEX_STATS
+  m->lock_tsc = mutex_tsc();
+  m->stat_spin += spin;
+  m->stat_futex_wait += waits;
+  m->stat_wait_cycles += m->lock_tsc - start;
+#endif
+  return 0;
 }
 static inline int mutex_unlock(mutex_t *m) {
-  __asm__ __volatile__ ("movl %1, %0" : "=m" (m->lock) : "g"(0) : "memory");
+#ifdef MUTEX_STATS
+  m->stat_hold_cycles += mutex_tsc() - m->lock_tsc;
+#endif
+  if(mutex_xchg(m, 0) == 2)
+    syscall(SYS_futex, &m->lock, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
   return 0;
 }
 
@@ -92,10 +153,22 @@ typedef pthread_mutex_t mutex_t;
 #define mutex_trylock(m)           pthread_mutex_trylock(m)
 #define mutex_unlock(m)            pthread_mutex_unlock(m)
 
-#endif /* (__i386__ || __x86_64__) && __GNUC__ && !USE_NO_SPINLOCKS */
+#endif /* (__i386__ || __x86_64__) && __GNUC__ && __linux__ && !USE_NO_SPINLOCKS */
 
 /* thread specific data */
-#if defined(__sgi) || defined(USE_TSD_DATA_HACK)
+#if defined __GNUC__ && !defined USE_NO_TLS
+
+/* Thread-local storage of the compiler.  Unlike pthread_setspecific,
+   it never calls malloc(), and unlike the hack below, threads never
+   share a slot.  Keys must be declared with TSD_KEY_STORAGE. */
+
+#define TSD_KEY_STORAGE __thread __attribute__ ((tls_model ("initial-exec")))
+typedef void *tsd_key_t;
+#define tsd_key_create(key, destr) (*(key) = 0)
+#define tsd_setspecific(key, data) ((key) = (data))
+#define tsd_getspecific(key, vptr) (vptr = (key))
+
+#elif defined(__sgi) || defined(USE_TSD_DATA_HACK)
 
 /* Hack for thread-specific data, e.g. on Irix 6.x.  We can't use
    pthread_setspecific because that function calls malloc() itself.
@@ -26,6 +26,7 @@ SETARCH="setarch `uname -m` -3 -R "
 COMMANDLINE=$@
 
 date=`date +%H%M%S`
+SEMKEY=$$ # names the semaphore of the job, left in /dev/shm if it crashes
 cmdfile="runcmd.$date.sh"
 
 MALLOCLIB="$BASE/libsbllmalloc.so"
@@ -35,11 +36,11 @@ $RM $cmdfile
 echo "#!/bin/bash
 
 $KILL $1
-$RM /dev/shm/PSMallocTest /dev/shm/sem.*
+$RM /dev/shm/sem.tmpname$SEMKEY
 sleep 2
-LD_PRELOAD=$MALLOCLIB PROFILE_MODE=$PROF PTDEBUG=$DEBUG MERGE_METRIC=$MERGE_METHOD MALLOC_MERGE_FREQ=$FREQ MIN_MEM_TH=$TH ENABLE_BACKTRACE=$ENABLE_BACKTRACE $COMMANDLINE
+LD_PRELOAD=$MALLOCLIB SEM_KEY=$SEMKEY PROFILE_MODE=$PROF PTDEBUG=$DEBUG MERGE_METRIC=$MERGE_METHOD MALLOC_MERGE_FREQ=$FREQ MIN_MEM_TH=$TH ENABLE_BACKTRACE=$ENABLE_BACKTRACE $COMMANDLINE
 $KILL $1
-$RM /dev/shm/PSMallocTest /dev/shm/sem.*
+$RM /dev/shm/sem.tmpname$SEMKEY
 
 " > $cmdfile
 
@@ -5,6 +5,7 @@ RM="/bin/rm -f"
 KILL="skill -9 -c"
 BASE=/home/biswas3/LLNL_WORK/ptmalloc/tests/misc/sbllmalloc
 DATE=`date +%H%M%S`
+SEMKEY=$$ # names the semaphore of the job, left in /dev/shm if it crashes
 
 MALLOCLIB="$BASE/lib/libsbllmalloc.so"
 
@@ -15,7 +16,7 @@ function create_run_script()
 	$RM $cmdfile;
 	echo "#!/bin/bash
 
-LD_PRELOAD=$MALLOCLIB PROFILE_MODE=$PROF PTDEBUG=$DEBUG MERGE_METRIC=$MERGE_METHOD MALLOC_MERGE_FREQ=$FREQ MIN_MEM_TH=$TH ENABLE_BACKTRACE=$ENABLE_BACKTRACE $COMMANDLINE
+LD_PRELOAD=$MALLOCLIB SEM_KEY=$SEMKEY PROFILE_MODE=$PROF PTDEBUG=$DEBUG MERGE_METRIC=$MERGE_METHOD MALLOC_MERGE_FREQ=$FREQ MIN_MEM_TH=$TH ENABLE_BACKTRACE=$ENABLE_BACKTRACE $COMMANDLINE
 #$COMMANDLINE
 	" > $cmdfile;
 	chmod +x $cmdfile;
@@ -56,7 +57,7 @@ export VIADEV_USE_SRQ=0
 create_run_script "runcmd.$DATE.sh"
 echo "#!/bin/bash
 pkill -9 $1;
-rm -f /dev/shm/*
+rm -f /dev/shm/sem.tmpname$SEMKEY
 " > cleanup.sbllmalloc.sh
 chmod +x cleanup.sbllmalloc.sh
 